@@ -1,5 +1,6 @@
 #!/bin/sh
 set -xe
+libtoolize --copy
 aclocal
 autoconf
 autoheader
@@ -0,0 +1,494 @@
+#include <glib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <msgpack.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "common.h"
+#include "residency.h"
+#include "advise.h"
+
+/*
+ * The advisor samples the page cache residency of every regular file under
+ * some directories with mincore(), by segments of ADVISE_SEGMENT bytes,
+ * a segment being resident when at least half of its pages are. Segments
+ * seen resident, then evicted, then resident again count a return: they
+ * were read again soon enough to be worth keeping. Counts are halved every
+ * ADVISE_DECAY passes so that old patterns fade, except on the segments
+ * locked on advice, which cannot be evicted anymore.
+ *
+ * A pass samples every file once and is spread over the interval, each
+ * tick sampling its share of the bytes found by the walk starting the
+ * pass. Ranges of adjacent segments with returns are ranked by returns
+ * per segment. Only the advisor thread updates the state, and holds the
+ * mutex while doing so; other threads hold it while reading.
+ */
+
+#define ADVISE_BATCH 512        /* segments per mincore() call */
+
+#define SEGMENT_UNSEEN 0
+#define SEGMENT_COLD 1          /* never seen resident */
+#define SEGMENT_RESIDENT 2
+#define SEGMENT_EVICTED 3
+#define SEGMENT_STATE 0x3
+#define SEGMENT_PINNED 0x4      /* locked on advice */
+
+struct advise_file {
+    gchar *path;
+    dev_t dev;
+    ino_t ino;
+    guint64 size;
+    guint segments;
+    guint8 *state;
+    guint32 *returns;
+    gboolean seen;              /* by the last walk */
+};
+
+/* Adjacent segments with returns */
+struct candidate {
+    struct advise_file *file;
+    guint from;
+    guint to;
+    guint64 returns;
+};
+
+static GMutex advise_mutex;
+static GPtrArray *advise_dirs = NULL;
+static GHashTable *advise_files = NULL; /* path -> struct advise_file */
+static GPtrArray *advise_order = NULL;  /* files of the current pass */
+static guint cursor = 0, cursor_segment = 0;
+static guint advise_interval = DEFAULT_ADVISE_INTERVAL;
+static guint advise_count = 0;
+static guint64 advise_budget = 0;
+static guint64 passes = 0, total_returns = 0;
+static void (*advise_notify) (GPtrArray * selected) = NULL;
+
+static void advise_file_free(gpointer p)
+{
+    struct advise_file *f = (struct advise_file *) p;
+
+    g_free(f->path);
+    g_free(f->state);
+    g_free(f->returns);
+    g_free(f);
+}
+
+void advice_free(gpointer p)
+{
+    struct advice *a = (struct advice *) p;
+
+    g_free(a->path);
+    g_free(a);
+}
+
+/* Lists regular files under dir, without following symbolic links */
+static void advise_walk(const gchar * dir, GPtrArray * found)
+{
+    GError *err = NULL;
+    GDir *d;
+    const gchar *name;
+    gchar *path;
+    struct stat st;
+    struct advise_file *f;
+
+    if (!(d = g_dir_open(dir, 0, &err))) {
+        g_warning("advise_walk: %s", err->message);
+        g_error_free(err);
+        return;
+    }
+
+    while ((name = g_dir_read_name(d))) {
+        path = g_build_filename(dir, name, NULL);
+        if (lstat(path, &st) < 0) {
+            g_debug("advise_walk: lstat(%s): %s", path, strerror(errno));
+        } else if (S_ISDIR(st.st_mode)) {
+            advise_walk(path, found);
+        } else if (S_ISREG(st.st_mode) && st.st_size > 0) {
+            f = g_new0(struct advise_file, 1);
+            f->path = path;
+            f->dev = st.st_dev;
+            f->ino = st.st_ino;
+            f->size = st.st_size;
+            g_ptr_array_add(found, f);
+            continue;
+        }
+        g_free(path);
+    }
+    g_dir_close(d);
+}
+
+static gboolean advise_file_unseen(gpointer key, gpointer value,
+                                   gpointer ignored)
+{
+    return (!((struct advise_file *) value)->seen);
+}
+
+static gint advise_file_cmp(gconstpointer a, gconstpointer b)
+{
+    return (strcmp((*(struct advise_file **) a)->path,
+                   (*(struct advise_file **) b)->path));
+}
+
+/* Tracks the files found by a walk, forgetting the others; files replaced
+ * or resized start over. Returns the number of bytes to sample. */
+static guint64 advise_merge(GPtrArray * found)
+{
+    GHashTableIter iter;
+    gpointer value;
+    struct advise_file *f, *old;
+    guint64 total = 0;
+    guint i;
+
+    g_hash_table_iter_init(&iter, advise_files);
+    while (g_hash_table_iter_next(&iter, NULL, &value))
+        ((struct advise_file *) value)->seen = FALSE;
+
+    for (i = 0; i < found->len; i++) {
+        f = g_ptr_array_index(found, i);
+        old = g_hash_table_lookup(advise_files, f->path);
+        if (old && old->dev == f->dev && old->ino == f->ino &&
+            old->size == f->size) {
+            old->seen = TRUE;
+            advise_file_free(f);
+            continue;
+        }
+        f->segments = (f->size + ADVISE_SEGMENT - 1) / ADVISE_SEGMENT;
+        f->state = g_new0(guint8, f->segments);
+        f->returns = g_new0(guint32, f->segments);
+        f->seen = TRUE;
+        g_hash_table_replace(advise_files, f->path, f);
+    }
+    g_hash_table_foreach_remove(advise_files, advise_file_unseen, NULL);
+
+    g_ptr_array_set_size(advise_order, 0);
+    g_hash_table_iter_init(&iter, advise_files);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        g_ptr_array_add(advise_order, value);
+        total += ((struct advise_file *) value)->size;
+    }
+    g_ptr_array_sort(advise_order, advise_file_cmp);
+    return (total);
+}
+
+static void segment_sample(struct advise_file *f, guint i,
+                           gboolean resident)
+{
+    guint8 state = f->state[i] & SEGMENT_STATE;
+
+    if (resident) {
+        if (state == SEGMENT_EVICTED) {
+            f->returns[i]++;
+            total_returns++;
+        }
+        state = SEGMENT_RESIDENT;
+    } else if (state == SEGMENT_RESIDENT || state == SEGMENT_EVICTED) {
+        state = SEGMENT_EVICTED;
+    } else {
+        state = SEGMENT_COLD;
+    }
+    f->state[i] = (f->state[i] & ~SEGMENT_STATE) | state;
+}
+
+/* Samples segments [from, to) of a file */
+static int advise_sample(struct advise_file *f, guint from, guint to)
+{
+    long pagesize = sysconf(_SC_PAGESIZE);
+    guint64 offset = (guint64) from * ADVISE_SEGMENT;
+    size_t length = MIN((guint64) (to - from) * ADVISE_SEGMENT,
+                        f->size - offset);
+    size_t per_segment = ADVISE_SEGMENT / pagesize, pages, n;
+    struct stat st;
+    unsigned char *vec;
+    char *mmapped;
+    int fd, ret = 0;
+    guint i;
+
+    if ((fd = open(f->path, O_RDONLY)) < 0) {
+        g_debug("advise_sample: open(%s): %s", f->path, strerror(errno));
+        return (-1);
+    }
+
+    /* Replaced files are noticed by the next walk */
+    if (fstat(fd, &st) < 0 || st.st_dev != f->dev ||
+        st.st_ino != f->ino || (guint64) st.st_size < offset + length) {
+        close(fd);
+        return (-2);
+    }
+
+    mmapped = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, offset);
+    close(fd);
+    if (mmapped == MAP_FAILED) {
+        g_warning("advise_sample: mmap(%s): %s", f->path, strerror(errno));
+        return (-3);
+    }
+
+    pages = (length + pagesize - 1) / pagesize;
+    vec = g_malloc(pages);
+    if (mincore(mmapped, length, vec) < 0) {
+        g_warning("advise_sample: mincore(%s): %s", f->path,
+                  strerror(errno));
+        ret = -4;
+    } else {
+        for (i = from; i < to; i++) {
+            n = MIN(per_segment, pages - (i - from) * per_segment);
+            segment_sample(f, i, residency_count(vec + (i - from) *
+                                                 per_segment, n) * 2 >= n);
+        }
+    }
+
+    g_free(vec);
+    if (munmap(mmapped, length) < 0)
+        g_warning("advise_sample: munmap: %s", strerror(errno));
+    return (ret);
+}
+
+/* Samples about quota bytes from the cursor on */
+static void advise_tick(guint64 quota)
+{
+    struct advise_file *f;
+    guint n;
+
+    while (quota > 0 && cursor < advise_order->len) {
+        f = g_ptr_array_index(advise_order, cursor);
+        n = MIN(f->segments - cursor_segment,
+                MIN(ADVISE_BATCH, MAX(1, quota / ADVISE_SEGMENT)));
+        g_mutex_lock(&advise_mutex);
+        if (advise_sample(f, cursor_segment, cursor_segment + n) < 0)
+            n = f->segments - cursor_segment;
+        g_mutex_unlock(&advise_mutex);
+        quota -= MIN(quota, (guint64) n * ADVISE_SEGMENT);
+        cursor_segment += n;
+        if (cursor_segment >= f->segments) {
+            cursor++;
+            cursor_segment = 0;
+        }
+    }
+}
+
+/* Most returns per segment first, then most returns */
+static gint candidate_cmp(gconstpointer pa, gconstpointer pb)
+{
+    const struct candidate *a = pa, *b = pb;
+    guint64 da = a->returns * (b->to - b->from);
+    guint64 db = b->returns * (a->to - a->from);
+    int cmp;
+
+    if (da != db)
+        return (da > db ? -1 : 1);
+    if (a->returns != b->returns)
+        return (a->returns > b->returns ? -1 : 1);
+    if ((cmp = strcmp(a->file->path, b->file->path)))
+        return (cmp);
+    return (a->from < b->from ? -1 : 1);
+}
+
+/* Ranked ranges, with the mutex held */
+static GArray *advise_candidates()
+{
+    GArray *candidates = g_array_new(FALSE, FALSE,
+                                     sizeof(struct candidate));
+    GHashTableIter iter;
+    gpointer value;
+    struct candidate c;
+    guint i;
+
+    g_hash_table_iter_init(&iter, advise_files);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        c.file = (struct advise_file *) value;
+        for (i = 0; i < c.file->segments; i++) {
+            if (!c.file->returns[i])
+                continue;
+            c.from = i;
+            c.returns = 0;
+            for (; i < c.file->segments && c.file->returns[i]; i++)
+                c.returns += c.file->returns[i];
+            c.to = i;
+            g_array_append_val(candidates, c);
+        }
+    }
+    g_array_sort(candidates, candidate_cmp);
+    return (candidates);
+}
+
+static guint64 candidate_offset(struct candidate *c)
+{
+    return ((guint64) c->from * ADVISE_SEGMENT);
+}
+
+static guint64 candidate_length(struct candidate *c)
+{
+    return (MIN((guint64) c->to * ADVISE_SEGMENT, c->file->size) -
+            candidate_offset(c));
+}
+
+/* Picks the best ranges fitting the budget and pins them, with the mutex
+ * held */
+static GPtrArray *advise_select()
+{
+    GPtrArray *selected = g_ptr_array_new_with_free_func(advice_free);
+    GArray *candidates = advise_candidates();
+    GHashTableIter iter;
+    gpointer value;
+    struct advise_file *f;
+    struct candidate *c;
+    struct advice *a;
+    guint64 bytes = 0;
+    guint i, j;
+
+    g_hash_table_iter_init(&iter, advise_files);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        f = (struct advise_file *) value;
+        for (j = 0; j < f->segments; j++)
+            f->state[j] &= ~SEGMENT_PINNED;
+    }
+
+    for (i = 0; i < candidates->len && selected->len < advise_count; i++) {
+        c = &g_array_index(candidates, struct candidate, i);
+        if (advise_budget && bytes + candidate_length(c) > advise_budget)
+            continue;
+        a = g_new(struct advice, 1);
+        a->path = g_strdup(c->file->path);
+        a->offset = candidate_offset(c);
+        a->length = candidate_length(c);
+        a->returns = c->returns;
+        g_ptr_array_add(selected, a);
+        bytes += a->length;
+        for (j = c->from; j < c->to; j++)
+            c->file->state[j] |= SEGMENT_PINNED;
+    }
+
+    g_array_free(candidates, TRUE);
+    return (selected);
+}
+
+/* With the mutex held */
+static void advise_pass_end()
+{
+    GHashTableIter iter;
+    gpointer value;
+    struct advise_file *f;
+    guint i;
+
+    passes++;
+    if (passes % ADVISE_DECAY == 0) {
+        g_hash_table_iter_init(&iter, advise_files);
+        while (g_hash_table_iter_next(&iter, NULL, &value)) {
+            f = (struct advise_file *) value;
+            for (i = 0; i < f->segments; i++)
+                if (!(f->state[i] & SEGMENT_PINNED))
+                    f->returns[i] /= 2;
+        }
+    }
+    if (advise_count)
+        advise_notify(advise_select());
+}
+
+static gpointer advise_thread(gpointer ignored)
+{
+    GPtrArray *found;
+    gint64 started = 0, now;
+    guint64 total = 0, quota = 0;
+    guint i;
+
+    for (;;) {
+        if (cursor >= advise_order->len) {
+            now = g_get_monotonic_time();
+            if (started) {
+                g_mutex_lock(&advise_mutex);
+                advise_pass_end();
+                g_mutex_unlock(&advise_mutex);
+                /* Files are sampled once per interval at most */
+                if (now < started + advise_interval * G_USEC_PER_SEC)
+                    g_usleep(started + advise_interval * G_USEC_PER_SEC -
+                             now);
+            }
+            started = g_get_monotonic_time();
+
+            found = g_ptr_array_new();
+            for (i = 0; i < advise_dirs->len; i++)
+                advise_walk(g_ptr_array_index(advise_dirs, i), found);
+            g_mutex_lock(&advise_mutex);
+            total = advise_merge(found);
+            g_mutex_unlock(&advise_mutex);
+            g_ptr_array_free(found, TRUE);
+
+            cursor = cursor_segment = 0;
+            quota = MAX(total / advise_interval, ADVISE_SEGMENT);
+            g_debug("advise_thread: sampling %u files (%" G_GUINT64_FORMAT
+                    " bytes)", advise_order->len, total);
+        }
+        advise_tick(quota);
+        if (cursor < advise_order->len)
+            g_usleep(G_USEC_PER_SEC);
+    }
+    return (NULL);
+}
+
+/* Samples the files under dirs every interval seconds; when count is not
+ * 0, calls notify from another thread after every pass with the best
+ * count ranges holding at most budget bytes (0 for no limit), to be
+ * freed with g_ptr_array_free */
+int advise_init(GPtrArray * dirs, guint interval, guint count,
+                guint64 budget, void (*notify) (GPtrArray * selected))
+{
+    GError *err = NULL;
+
+    advise_dirs = dirs;
+    if (interval)
+        advise_interval = interval;
+    advise_count = count;
+    advise_budget = budget;
+    advise_notify = notify;
+    advise_files = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+                                         advise_file_free);
+    advise_order = g_ptr_array_new();
+
+    if (!g_thread_try_new("advise", advise_thread, NULL, &err)) {
+        g_critical("advise_init: g_thread_try_new: %s", err->message);
+        g_error_free(err);
+        return (-1);
+    }
+    return (0);
+}
+
+gboolean advise_enabled()
+{
+    return (advise_files != NULL);
+}
+
+/* Packs [passes, files, returns, ranges], ranges being the best count
+ * [path, offset, length, returns, locked] */
+void advise_pack(msgpack_packer * pk, guint count)
+{
+    GArray *candidates;
+    struct candidate *c;
+    guint i;
+
+    g_mutex_lock(&advise_mutex);
+    candidates = advise_candidates();
+    count = MIN(count, candidates->len);
+
+    msgpack_pack_array(pk, 4);
+    msgpack_pack_uint64(pk, passes);
+    msgpack_pack_uint64(pk, g_hash_table_size(advise_files));
+    msgpack_pack_uint64(pk, total_returns);
+    msgpack_pack_array(pk, count);
+    for (i = 0; i < count; i++) {
+        c = &g_array_index(candidates, struct candidate, i);
+        msgpack_pack_array(pk, 5);
+        string_pack(c->file->path, pk);
+        msgpack_pack_uint64(pk, candidate_offset(c));
+        msgpack_pack_uint64(pk, candidate_length(c));
+        msgpack_pack_uint64(pk, c->returns);
+        if (c->file->state[c->from] & SEGMENT_PINNED)
+            msgpack_pack_true(pk);
+        else
+            msgpack_pack_false(pk);
+    }
+    g_mutex_unlock(&advise_mutex);
+
+    g_array_free(candidates, TRUE);
+}
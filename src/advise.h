@@ -0,0 +1,27 @@
+#ifndef PCMA__ADVISE_H
+#define PCMA__ADVISE_H
+
+#include <glib.h>
+#include <msgpack.h>
+
+#define ADVISE_SEGMENT (2 << 20)        /* bytes sampled together */
+#define ADVISE_DECAY 8          /* passes between halvings of the counts */
+#define ADVISE_REPORT 64        /* ranges reported by default */
+#define ADVISE_TAG "advise"     /* of the locks taken on advice */
+#define DEFAULT_ADVISE_INTERVAL 60      /* seconds between samples */
+
+/* A range worth locking */
+struct advice {
+    gchar *path;
+    guint64 offset;
+    guint64 length;
+    guint64 returns;
+};
+
+int advise_init(GPtrArray * dirs, guint interval, guint count,
+                guint64 budget, void (*notify) (GPtrArray * selected));
+gboolean advise_enabled();
+void advise_pack(msgpack_packer * pk, guint count);
+void advice_free(gpointer p);
+
+#endif                          /* PCMA__ADVISE_H */
@@ -0,0 +1,732 @@
+#include <glib.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <msgpack.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zmq.h>
+#include "common.h"
+#include "bench.h"
+
+/*
+ * Benchmarks pcmad. A synthetic set of files is created, then requests
+ * drawn from a weighted mix are kept in flight over a DEALER socket, each
+ * one prefixed with a frame naming its slot, which pcmad echoes back with
+ * the rest of the envelope. Throughput and latency percentiles per
+ * operation are printed as a single JSON object on stdout.
+ *
+ * Which files are locked, and by which of their tags, is tracked from the
+ * replies, so that relock and unlock requests target locked files.
+ */
+
+enum bench_op {
+    OP_LOCK,
+    OP_RELOCK,
+    OP_LIST,
+    OP_UNLOCK,
+    OP_RELEASETAG,
+    OP_COUNT
+};
+
+static const char *op_names[OP_COUNT] = {
+    "lock", "relock", "list", "unlock", "releasetag"
+};
+
+struct bench_file {
+    gchar *path;
+    guint64 size;
+    guint tags[BENCH_MAX_FANOUT];
+    guint32 held;               /* bit k set while tags[k] is on the lock */
+    gint locked_at;             /* index in locked, -1 if not locked */
+};
+
+struct bench_op_stats {
+    guint weight;
+    guint64 errors;
+    GArray *latencies;          /* guint64, in microseconds */
+};
+
+struct bench_req {
+    enum bench_op op;
+    guint file;
+    guint tag;
+    gint64 sent;                /* monotonic, in microseconds */
+};
+
+static GRand *rnd = NULL;
+static struct bench_file *files = NULL;
+static guint nfiles = DEFAULT_BENCH_FILES;
+static guint ntags = DEFAULT_BENCH_TAGS;
+static guint fanout = DEFAULT_BENCH_FANOUT;
+static gchar **tag_names = NULL;
+static GArray **tag_files = NULL;       /* per tag, indices of its files */
+static GArray *locked = NULL;   /* indices of locked files */
+static struct bench_op_stats stats[OP_COUNT];
+static guint total_weight = 0;
+static const gchar *strategy = NULL;    /* pcmad's default if NULL */
+static gboolean hot = FALSE;    /* keep created files in the page cache */
+
+void locked_add(guint i)
+{
+    if (files[i].locked_at >= 0)
+        return;
+    files[i].locked_at = locked->len;
+    g_array_append_val(locked, i);
+}
+
+void locked_remove(guint i)
+{
+    gint at = files[i].locked_at;
+    guint last;
+
+    if (at < 0)
+        return;
+    last = g_array_index(locked, guint, locked->len - 1);
+    g_array_index(locked, guint, at) = last;
+    files[last].locked_at = at;
+    g_array_set_size(locked, locked->len - 1);
+    files[i].locked_at = -1;
+}
+
+/* Parses OP=WEIGHT[,OP=WEIGHT]... */
+int parse_mix(const gchar * mix)
+{
+    gchar **ops = g_strsplit(mix, ",", 0), *sep;
+    guint i, op;
+    int ret = 0;
+
+    for (op = 0; op < OP_COUNT; op++)
+        stats[op].weight = 0;
+
+    for (i = 0; ops[i] && !ret; i++) {
+        if (!(sep = strchr(ops[i], '='))) {
+            ret = -1;
+            break;
+        }
+        *sep = '\0';
+        for (op = 0; op < OP_COUNT; op++)
+            if (!strcmp(ops[i], op_names[op]))
+                break;
+        if (op == OP_COUNT)
+            ret = -2;
+        else
+            stats[op].weight = atoi(sep + 1);
+    }
+    g_strfreev(ops);
+
+    total_weight = 0;
+    for (op = 0; op < OP_COUNT; op++)
+        total_weight += stats[op].weight;
+    if (!ret && !total_weight)
+        ret = -3;
+    return (ret);
+}
+
+/* Parses SIZE or MIN:MAX */
+int parse_sizes(const gchar * sizes, guint64 * min, guint64 * max)
+{
+    gchar *str = g_strdup(sizes), *sep = strchr(str, ':');
+    int ret = 0;
+
+    if (sep)
+        *sep = '\0';
+    if (parse_size(str, min) < 0)
+        ret = -1;
+    else if (sep && parse_size(sep + 1, max) < 0)
+        ret = -2;
+    else if (!sep)
+        *max = *min;
+    if (!ret && (!*min || *max < *min))
+        ret = -3;
+    g_free(str);
+    return (ret);
+}
+
+int file_fill(const gchar * path, guint64 size, const gchar * buf)
+{
+    guint64 done = 0;
+    ssize_t ret;
+    int fd;
+
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        g_critical("file_fill: open(%s): %s", path, strerror(errno));
+        return (-1);
+    }
+    while (done < size) {
+        ret = write(fd, buf, MIN(size - done, BENCH_WRITE_SIZE));
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0) {
+            g_critical("file_fill: write(%s): %s", path, strerror(errno));
+            close(fd);
+            return (-2);
+        }
+        done += ret;
+    }
+    /* Locks start from a cold page cache, unless asked otherwise */
+    if (!hot && (fdatasync(fd) < 0 ||
+                 posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) != 0))
+        g_warning("file_fill: cannot evict %s from the page cache", path);
+    if (close(fd) < 0) {
+        g_critical("file_fill: close(%s): %s", path, strerror(errno));
+        return (-3);
+    }
+    return (0);
+}
+
+/* Creates the files, sizes being log-uniformly distributed in [min, max];
+ * file i is tagged with the fanout tags following i * fanout */
+guint64 files_create(const gchar * dir, guint64 min, guint64 max)
+{
+    gchar *buf = g_malloc(BENCH_WRITE_SIZE);
+    guint64 total = 0;
+    gdouble lmin = log(min), lmax = log(max);
+    guint i, k, tag;
+
+    memset(buf, 0xa5, BENCH_WRITE_SIZE);
+
+    tag_names = g_new0(gchar *, ntags + 1);
+    tag_files = g_new(GArray *, ntags);
+    for (tag = 0; tag < ntags; tag++) {
+        tag_names[tag] = g_strdup_printf("%s-%u", default_name, tag);
+        tag_files[tag] = g_array_new(FALSE, FALSE, sizeof(guint));
+    }
+
+    files = g_new0(struct bench_file, nfiles);
+    for (i = 0; i < nfiles; i++) {
+        files[i].path = g_strdup_printf("%s/%s-%06u", dir, default_name, i);
+        files[i].size = min == max ? min :
+            (guint64) exp(lmin + g_rand_double(rnd) * (lmax - lmin));
+        files[i].locked_at = -1;
+        for (k = 0; k < fanout; k++) {
+            tag = (i * fanout + k) % ntags;
+            files[i].tags[k] = tag;
+            g_array_append_val(tag_files[tag], i);
+        }
+        if (file_fill(files[i].path, files[i].size, buf) < 0)
+            g_error("cannot create %s", files[i].path);
+        total += files[i].size;
+    }
+
+    g_free(buf);
+    return (total);
+}
+
+void files_remove()
+{
+    guint i;
+
+    for (i = 0; i < nfiles; i++)
+        if (unlink(files[i].path) < 0)
+            g_warning("files_remove: unlink(%s): %s", files[i].path,
+                      strerror(errno));
+}
+
+int req_packfn(msgpack_packer * pk, void *r)
+{
+    struct bench_req *req = (struct bench_req *) r;
+    struct bench_file *f = &files[req->file];
+    guint k;
+
+    switch (req->op) {
+    case OP_LOCK:
+    case OP_RELOCK:
+        msgpack_pack_array(pk, strategy ? 5 : 3);
+        string_pack(LOCK_COMMAND, pk);
+        string_pack(f->path, pk);
+        msgpack_pack_array(pk, fanout);
+        for (k = 0; k < fanout; k++)
+            string_pack(tag_names[f->tags[k]], pk);
+        if (strategy) {
+            msgpack_pack_array(pk, 0);
+            msgpack_pack_map(pk, 1);
+            string_pack(LOCK_STRATEGY, pk);
+            string_pack((gpointer) strategy, pk);
+        }
+        break;
+    case OP_LIST:
+        msgpack_pack_array(pk, 1);
+        string_pack(LIST_COMMAND, pk);
+        break;
+    case OP_UNLOCK:
+        msgpack_pack_array(pk, 2);
+        string_pack(UNLOCK_COMMAND, pk);
+        string_pack(f->path, pk);
+        break;
+    case OP_RELEASETAG:
+        msgpack_pack_array(pk, 2);
+        string_pack(RELEASETAG_COMMAND, pk);
+        string_pack(tag_names[req->tag], pk);
+        break;
+    default:
+        return (-1);
+    }
+    return (0);
+}
+
+/* Packs ["residency", [tag, ...]] */
+int residency_packfn(msgpack_packer * pk, void *ignored)
+{
+    guint tag;
+
+    msgpack_pack_array(pk, 2);
+    string_pack(RESIDENCY_COMMAND, pk);
+    msgpack_pack_array(pk, ntags);
+    for (tag = 0; tag < ntags; tag++)
+        string_pack(tag_names[tag], pk);
+    return (0);
+}
+
+/* Reads the totals of [true, [size, resident, {...}]] */
+void residency_read(msgpack_object * obj, gpointer data)
+{
+    guint64 *totals = (guint64 *) data;
+    msgpack_object *r;
+
+    if (obj->via.array.size < 2)
+        return;
+    r = &obj->via.array.ptr[1];
+    if (r->type != MSGPACK_OBJECT_ARRAY || r->via.array.size < 2 ||
+        r->via.array.ptr[0].type != MSGPACK_OBJECT_POSITIVE_INTEGER ||
+        r->via.array.ptr[1].type != MSGPACK_OBJECT_POSITIVE_INTEGER)
+        return;
+    totals[0] = r->via.array.ptr[0].via.u64;
+    totals[1] = r->via.array.ptr[1].via.u64;
+}
+
+/* Packs ["unlockmany", [path, ...]] */
+int unlock_all_packfn(msgpack_packer * pk, void *ignored)
+{
+    guint i;
+
+    msgpack_pack_array(pk, 2);
+    string_pack(UNLOCKMANY_COMMAND, pk);
+    msgpack_pack_array(pk, nfiles);
+    for (i = 0; i < nfiles; i++)
+        string_pack(files[i].path, pk);
+    return (0);
+}
+
+/* Draws an operation from the mix, and a target fitting it */
+void req_pick(struct bench_req *req)
+{
+    guint draw = g_rand_int_range(rnd, 0, total_weight);
+
+    for (req->op = 0; draw >= stats[req->op].weight; req->op++)
+        draw -= stats[req->op].weight;
+
+    if ((req->op == OP_RELOCK || req->op == OP_UNLOCK) && locked->len)
+        req->file = g_array_index(locked, guint,
+                                  g_rand_int_range(rnd, 0, locked->len));
+    else
+        req->file = g_rand_int_range(rnd, 0, nfiles);
+    req->tag = g_rand_int_range(rnd, 0, ntags);
+}
+
+/* Updates which files are locked from a successful reply */
+void req_apply(struct bench_req *req)
+{
+    struct bench_file *f = &files[req->file];
+    GArray *tagged;
+    guint i, k, j;
+
+    switch (req->op) {
+    case OP_LOCK:
+    case OP_RELOCK:
+        f->held = fanout == BENCH_MAX_FANOUT ? G_MAXUINT32 :
+            (1U << fanout) - 1;
+        locked_add(req->file);
+        break;
+    case OP_UNLOCK:
+        f->held = 0;
+        locked_remove(req->file);
+        break;
+    case OP_RELEASETAG:
+        tagged = tag_files[req->tag];
+        for (i = 0; i < tagged->len; i++) {
+            j = g_array_index(tagged, guint, i);
+            for (k = 0; k < fanout; k++)
+                if (files[j].tags[k] == req->tag)
+                    files[j].held &= ~(1U << k);
+            if (!files[j].held)
+                locked_remove(j);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+int bench_send(guint32 slot, int (*pack_fn) (msgpack_packer *, void *),
+               void *data)
+{
+    zmq_msg_t frame;
+
+    if (zmq_msg_init_size(&frame, sizeof(slot)) < 0) {
+        g_critical("bench_send: zmq_msg_init_size: %s", strerror(errno));
+        return (-1);
+    }
+    memcpy(zmq_msg_data(&frame), &slot, sizeof(slot));
+    if (zmq_send(pcmab_sock, &frame, ZMQ_SNDMORE) < 0) {
+        g_critical("bench_send: zmq_send: %s", strerror(errno));
+        zmq_msg_close(&frame);
+        return (-2);
+    }
+    zmq_msg_close(&frame);
+
+    /* Empty delimiter, as sent by REQ sockets */
+    zmq_msg_init(&frame);
+    if (zmq_send(pcmab_sock, &frame, ZMQ_SNDMORE) < 0) {
+        g_critical("bench_send: zmq_send: %s", strerror(errno));
+        zmq_msg_close(&frame);
+        return (-3);
+    }
+    zmq_msg_close(&frame);
+
+    return (send_packed(pcmab_sock, pack_fn, data));
+}
+
+/* Waits for a reply, returning whether it succeeded; -1 if interrupted.
+ * Successful replies are handed to fn if set. */
+int bench_recv(guint32 * slot, void (*fn) (msgpack_object *, gpointer),
+               gpointer data)
+{
+    zmq_pollitem_t pollitem;
+    zmq_msg_t frame;
+    msgpack_unpacked pack;
+    msgpack_object *obj;
+    int64_t more;
+    size_t more_size;
+    int ret, part;
+
+    pollitem.socket = pcmab_sock;
+    pollitem.events = ZMQ_POLLIN;
+    ret = zmq_poll(&pollitem, 1, timeout * 1000L);
+    if (ret < 0 && errno == EINTR)
+        return (-1);
+    if (ret < 0)
+        g_error("zmq_poll: %s", strerror(errno));
+    if (ret == 0)
+        g_error("no reply after %li ms", timeout);
+
+    zmq_msg_init(&frame);
+    for (part = 0;; part++) {
+        while (zmq_recv(pcmab_sock, &frame, 0) < 0)
+            if (errno != EINTR)
+                g_error("zmq_recv: %s", strerror(errno));
+        if (part == 0 && zmq_msg_size(&frame) == sizeof(*slot))
+            memcpy(slot, zmq_msg_data(&frame), sizeof(*slot));
+
+        more_size = sizeof(more);
+        if (zmq_getsockopt(pcmab_sock, ZMQ_RCVMORE, &more, &more_size) < 0)
+            g_error("zmq_getsockopt: %s", strerror(errno));
+        if (!more)
+            break;
+    }
+
+    msgpack_unpacked_init(&pack);
+    ret = 0;
+    if (msgpack_unpack_next(&pack, zmq_msg_data(&frame),
+                            zmq_msg_size(&frame), NULL)) {
+        obj = &pack.data;
+        ret = obj->type == MSGPACK_OBJECT_ARRAY && obj->via.array.size &&
+            obj->via.array.ptr[0].type == MSGPACK_OBJECT_BOOLEAN &&
+            obj->via.array.ptr[0].via.boolean;
+        if (ret && fn)
+            fn(obj, data);
+    }
+    msgpack_unpacked_destroy(&pack);
+    zmq_msg_close(&frame);
+    return (ret);
+}
+
+gint latency_cmp(gconstpointer a, gconstpointer b)
+{
+    guint64 la = *(const guint64 *) a, lb = *(const guint64 *) b;
+
+    return (la < lb ? -1 : la > lb);
+}
+
+/* Nearest-rank percentile of sorted latencies */
+guint64 percentile(GArray * latencies, gdouble p)
+{
+    guint rank = (guint) ceil(p * latencies->len);
+
+    if (!latencies->len)
+        return (0);
+    return (g_array_index(latencies, guint64, rank ? rank - 1 : 0));
+}
+
+/* residency holds the size and resident bytes of locked files */
+void report(const gchar * endpoint, guint concurrency, guint64 bytes,
+            gint64 elapsed, const guint64 * residency)
+{
+    struct bench_op_stats *s;
+    guint64 count = 0, errors = 0;
+    gchar *ep = g_strescape(endpoint, NULL);
+    guint op;
+    gboolean first = TRUE;
+
+    for (op = 0; op < OP_COUNT; op++) {
+        count += stats[op].latencies->len;
+        errors += stats[op].errors;
+        g_array_sort(stats[op].latencies, latency_cmp);
+    }
+
+    printf("{\"endpoint\":\"%s\",\"strategy\":\"%s\",\"files\":%u,"
+           "\"bytes\":%" G_GUINT64_FORMAT ",\"tags\":%u,\"fanout\":%u,"
+           "\"concurrency\":%u,\"requests\":%" G_GUINT64_FORMAT
+           ",\"errors\":%" G_GUINT64_FORMAT ",\"elapsed_s\":%.3f,"
+           "\"throughput\":%.1f,\"locked_bytes\":%" G_GUINT64_FORMAT
+           ",\"resident_bytes\":%" G_GUINT64_FORMAT ",\"ops\":{", ep,
+           strategy ? strategy : "default", nfiles, bytes, ntags, fanout,
+           concurrency, count, errors, elapsed / 1e6,
+           elapsed ? count * 1e6 / elapsed : 0.0, residency[0],
+           residency[1]);
+    for (op = 0; op < OP_COUNT; op++) {
+        s = &stats[op];
+        if (!s->latencies->len)
+            continue;
+        printf("%s\"%s\":{\"count\":%u,\"errors\":%" G_GUINT64_FORMAT
+               ",\"p50_us\":%" G_GUINT64_FORMAT ",\"p99_us\":%"
+               G_GUINT64_FORMAT ",\"p999_us\":%" G_GUINT64_FORMAT
+               ",\"max_us\":%" G_GUINT64_FORMAT "}", first ? "" : ",",
+               op_names[op], s->latencies->len, s->errors,
+               percentile(s->latencies, 0.5),
+               percentile(s->latencies, 0.99),
+               percentile(s->latencies, 0.999),
+               percentile(s->latencies, 1.0));
+        first = FALSE;
+    }
+    printf("}}\n");
+    g_free(ep);
+}
+
+/* Keeps concurrency requests in flight until requests were answered */
+gint64 run(guint concurrency, guint64 requests)
+{
+    struct bench_req *reqs = g_new0(struct bench_req, concurrency);
+    struct bench_req *req;
+    guint64 sent = 0, latency;
+    guint inflight = 0;
+    guint32 slot;
+    gint64 started = g_get_monotonic_time();
+    int ret;
+
+    for (slot = 0; slot < concurrency && sent < requests; slot++) {
+        req_pick(&reqs[slot]);
+        reqs[slot].sent = g_get_monotonic_time();
+        if (bench_send(slot, req_packfn, &reqs[slot]) < 0)
+            g_error("cannot send requests");
+        sent++;
+        inflight++;
+    }
+
+    while (inflight) {
+        if (interrupted && sent < requests) {
+            g_info("interrupted, waiting for %u replies", inflight);
+            requests = sent;
+        }
+
+        slot = G_MAXUINT32;
+        if ((ret = bench_recv(&slot, NULL, NULL)) < 0)
+            continue;
+        if (slot >= concurrency)
+            g_error("reply for unknown slot %u", slot);
+        req = &reqs[slot];
+        inflight--;
+
+        latency = g_get_monotonic_time() - req->sent;
+        g_array_append_val(stats[req->op].latencies, latency);
+        if (ret)
+            req_apply(req);
+        else
+            stats[req->op].errors++;
+
+        if (sent < requests && !interrupted) {
+            req_pick(req);
+            req->sent = g_get_monotonic_time();
+            if (bench_send(slot, req_packfn, req) < 0)
+                g_error("cannot send requests");
+            sent++;
+            inflight++;
+        }
+    }
+
+    g_free(reqs);
+    return (g_get_monotonic_time() - started);
+}
+
+void help(const char *name)
+{
+    const char *disp_name = name;
+    if (!disp_name)
+        disp_name = default_name;
+
+    fprintf(stderr,
+            "Usage: %s [-e ENDPOINT] [-t TIMEOUT] [-d DIR] [-k] "
+            "[-n FILES] [-s MIN[:MAX]] [-T TAGS] [-f FANOUT] "
+            "[-c CONCURRENCY] [-r REQUESTS] [-m OP=WEIGHT,...] "
+            "[-L STRATEGY] [-H] [-S SEED]\n", disp_name);
+    exit(EXIT_FAILURE);
+}
+
+void sh_interrupt(int signum)
+{
+    interrupted = 1;
+}
+
+void setup_signals()
+{
+    setup_sig(SIGTERM, sh_interrupt, 1);
+    setup_sig(SIGINT, sh_interrupt, 1);
+    setup_sig(SIGQUIT, sh_interrupt, 1);
+}
+
+int main(int argc, char **argv)
+{
+    int opt, ret, keep = 0;
+    const char *endpoint = default_ep;
+    gchar *dir = NULL;
+    const gchar *mix = DEFAULT_BENCH_MIX, *sizes = DEFAULT_BENCH_SIZES;
+    guint concurrency = DEFAULT_BENCH_CONCURRENCY;
+    guint64 requests = DEFAULT_BENCH_REQUESTS, min, max, bytes;
+    guint32 seed = g_random_int(), slot;
+    guint64 residency[2] = { 0, 0 };
+    gboolean tmpdir = FALSE;
+    GError *err = NULL;
+    gint64 elapsed;
+    guint op;
+
+    setup_logging();
+    setup_signals();
+
+    while ((opt = getopt(argc, argv, "c:d:e:f:km:n:r:s:t:HL:S:T:")) != -1) {
+        switch (opt) {
+        case 'c':
+            concurrency = atoi(optarg);
+            if (concurrency < 1)
+                g_error("the concurrency should be at least 1");
+            break;
+        case 'd':
+            dir = optarg;
+            break;
+        case 'e':
+            endpoint = optarg;
+            break;
+        case 'f':
+            fanout = atoi(optarg);
+            if (fanout < 1 || fanout > BENCH_MAX_FANOUT)
+                g_error("the fan-out should be between 1 and %i",
+                        BENCH_MAX_FANOUT);
+            break;
+        case 'k':
+            keep = 1;
+            break;
+        case 'm':
+            mix = optarg;
+            break;
+        case 'n':
+            nfiles = atoi(optarg);
+            if (nfiles < 1)
+                g_error("at least 1 file is required");
+            break;
+        case 'r':
+            requests = g_ascii_strtoull(optarg, NULL, 10);
+            break;
+        case 's':
+            sizes = optarg;
+            break;
+        case 't':
+            timeout = atol(optarg);
+            if (timeout < 0 || timeout >= LONG_MAX / 1000L)
+                g_error("invalid timeout %s", optarg);
+            break;
+        case 'S':
+            seed = strtoul(optarg, NULL, 10);
+            break;
+        case 'H':
+            hot = TRUE;
+            break;
+        case 'L':
+            strategy = optarg;
+            break;
+        case 'T':
+            ntags = atoi(optarg);
+            if (ntags < 1)
+                g_error("at least 1 tag is required");
+            break;
+        default:
+            help(argc > 0 ? argv[0] : NULL);
+        }
+    }
+
+    if (fanout > ntags)
+        g_error("the fan-out cannot exceed the number of tags");
+    if (parse_mix(mix) < 0)
+        g_error("invalid mix %s", mix);
+    if (parse_sizes(sizes, &min, &max) < 0)
+        g_error("invalid sizes %s, should be SIZE or MIN:MAX", sizes);
+
+    if (!dir) {
+        if (!(dir = g_dir_make_tmp("pcmab-XXXXXX", &err)))
+            g_error("g_dir_make_tmp: %s", err->message);
+        tmpdir = TRUE;
+    } else if (g_mkdir_with_parents(dir, 0755) < 0) {
+        g_error("cannot create %s: %s", dir, strerror(errno));
+    }
+
+    rnd = g_rand_new_with_seed(seed);
+    locked = g_array_new(FALSE, FALSE, sizeof(guint));
+    for (op = 0; op < OP_COUNT; op++)
+        stats[op].latencies = g_array_new(FALSE, FALSE, sizeof(guint64));
+
+    g_info("creating %u files in %s (seed %u)", nfiles, dir, seed);
+    bytes = files_create(dir, min, max);
+
+    if (!(pcmab_ctx = zmq_init(1)))
+        g_error("zmq_init: %s", strerror(errno));
+    if (!(pcmab_sock = zmq_socket(pcmab_ctx, ZMQ_DEALER)))
+        g_error("zmq_socket: %s", strerror(errno));
+    if (zmq_connect(pcmab_sock, endpoint) < 0)
+        g_error("zmq_connect: %s", strerror(errno));
+
+    g_info("sending %" G_GUINT64_FORMAT " requests to %s, %u at a time",
+           requests, endpoint, concurrency);
+    elapsed = run(concurrency, requests);
+
+    /* Locked files left by the run, and how much of them is resident */
+    if (bench_send(0, residency_packfn, NULL) < 0)
+        g_error("cannot send requests");
+    do {
+        ret = bench_recv(&slot, residency_read, residency);
+    } while (ret < 0);
+    report(endpoint, concurrency, bytes, elapsed, residency);
+
+    /* Leaves nothing locked behind */
+    if (bench_send(0, unlock_all_packfn, NULL) < 0)
+        g_error("cannot send requests");
+    do {
+        ret = bench_recv(&slot, NULL, NULL);
+    } while (ret < 0);
+    if (!ret)
+        g_warning("unlockmany failed");
+
+    if (!keep) {
+        files_remove();
+        if (tmpdir && rmdir(dir) < 0)
+            g_warning("rmdir(%s): %s", dir, strerror(errno));
+    }
+
+    if (zmq_close(pcmab_sock) < 0)
+        g_error("zmq_close: %s", strerror(errno));
+    if (zmq_term(pcmab_ctx) < 0)
+        g_error("zmq_term: %s", strerror(errno));
+
+    return (EXIT_SUCCESS);
+}
@@ -0,0 +1,19 @@
+#ifndef PCMA__BENCH_H
+#define PCMA__BENCH_H
+
+#define DEFAULT_BENCH_FILES 100
+#define DEFAULT_BENCH_TAGS 10
+#define DEFAULT_BENCH_FANOUT 1
+#define DEFAULT_BENCH_CONCURRENCY 8
+#define DEFAULT_BENCH_REQUESTS 10000
+#define DEFAULT_BENCH_SIZES "64K:16M"
+#define DEFAULT_BENCH_MIX "lock=40,relock=30,list=5,unlock=20,releasetag=5"
+#define BENCH_MAX_FANOUT 32     /* bits of struct bench_file's held */
+#define BENCH_WRITE_SIZE (1 << 20)
+
+const char *default_name = "pcmab";
+long timeout = 10000;           /* ms */
+void *pcmab_ctx = NULL, *pcmab_sock = NULL;
+volatile sig_atomic_t interrupted = 0;
+
+#endif                          /* PCMA__BENCH_H */
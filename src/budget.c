@@ -0,0 +1,177 @@
+#include <glib.h>
+#include "common.h"
+#include "budget.h"
+
+/*
+ * Locked bytes are accounted globally and per tag, a file counting fully
+ * against each of its tags. Locks are admitted before any page is faulted
+ * in: the bytes they may add are reserved until they complete, so that
+ * concurrent locks cannot overshoot a limit together.
+ */
+
+static struct budget_usage global = { 0, 0, 0 };
+static GHashTable *tags = NULL; /* tag -> struct budget_usage */
+static gboolean limited = FALSE;
+static guint64 generation = 0;  /* bumped whenever anything changes */
+
+void budget_init(guint64 limit)
+{
+    global.limit = limit;
+    generation++;
+    if (limit)
+        limited = TRUE;
+    if (!tags)
+        tags = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                     g_free);
+}
+
+static struct budget_usage *budget_tag(const gchar * tag, gboolean create)
+{
+    struct budget_usage *usage = g_hash_table_lookup(tags, tag);
+
+    if (!usage && create) {
+        usage = g_new0(struct budget_usage, 1);
+        g_hash_table_insert(tags, g_strdup(tag), usage);
+    }
+    return (usage);
+}
+
+/* Forgets tags that are neither limited nor used */
+static void budget_tag_check(const gchar * tag, struct budget_usage *usage)
+{
+    if (!usage->limit && !usage->used && !usage->reserved)
+        g_hash_table_remove(tags, tag);
+}
+
+void budget_set_tag_limit(const gchar * tag, guint64 limit)
+{
+    budget_tag(tag, TRUE)->limit = limit;
+    generation++;
+    if (limit)
+        limited = TRUE;
+}
+
+/* Whether locks need to be admitted at all */
+gboolean budget_limited()
+{
+    return (limited);
+}
+
+/* Tells replies embedding the budget whether they are still current */
+guint64 budget_generation()
+{
+    return (generation);
+}
+
+const struct budget_usage *budget_global()
+{
+    return (&global);
+}
+
+void budget_foreach_tag(GHFunc fn, gpointer user_data)
+{
+    g_hash_table_foreach(tags, fn, user_data);
+}
+
+guint budget_tag_count()
+{
+    return (g_hash_table_size(tags));
+}
+
+void budget_charge(GList * t, guint64 bytes)
+{
+    if (!bytes)
+        return;
+
+    generation++;
+    global.used += bytes;
+    for (; t; t = t->next)
+        budget_tag(t->data, TRUE)->used += bytes;
+}
+
+void budget_release(GList * t, guint64 bytes)
+{
+    struct budget_usage *usage;
+
+    if (!bytes)
+        return;
+
+    generation++;
+    global.used -= MIN(global.used, bytes);
+    for (; t; t = t->next) {
+        if (!(usage = budget_tag(t->data, FALSE))) {
+            g_critical("budget_release: %s was never charged",
+                       (const gchar *) t->data);
+            continue;
+        }
+        usage->used -= MIN(usage->used, bytes);
+        budget_tag_check(t->data, usage);
+    }
+}
+
+/* Reserves all claims, or none and returns why (to be freed) */
+gchar *budget_reserve(GArray * claims)
+{
+    struct budget_claim *claim;
+    struct budget_usage *usage;
+    guint i;
+
+    for (i = 0; i < claims->len; i++) {
+        claim = &g_array_index(claims, struct budget_claim, i);
+        usage = claim->tag ? budget_tag(claim->tag, FALSE) : &global;
+        if (!usage || !usage->limit || !claim->bytes)
+            continue;
+        if (usage->used + usage->reserved + claim->bytes > usage->limit) {
+            if (claim->tag)
+                return (g_strdup_printf
+                        ("over budget for tag %s: %" G_GUINT64_FORMAT
+                         " bytes locked, %" G_GUINT64_FORMAT
+                         " pending, %" G_GUINT64_FORMAT
+                         " requested, limit %" G_GUINT64_FORMAT,
+                         claim->tag, usage->used, usage->reserved,
+                         claim->bytes, usage->limit));
+            return (g_strdup_printf
+                    ("over budget: %" G_GUINT64_FORMAT
+                     " bytes locked, %" G_GUINT64_FORMAT
+                     " pending, %" G_GUINT64_FORMAT
+                     " requested, limit %" G_GUINT64_FORMAT,
+                     usage->used, usage->reserved, claim->bytes,
+                     usage->limit));
+        }
+    }
+
+    generation++;
+    for (i = 0; i < claims->len; i++) {
+        claim = &g_array_index(claims, struct budget_claim, i);
+        usage = claim->tag ? budget_tag(claim->tag, TRUE) : &global;
+        usage->reserved += claim->bytes;
+    }
+    return (NULL);
+}
+
+void budget_unreserve(GArray * claims)
+{
+    struct budget_claim *claim;
+    struct budget_usage *usage;
+    guint i;
+
+    generation++;
+    for (i = 0; i < claims->len; i++) {
+        claim = &g_array_index(claims, struct budget_claim, i);
+        usage = claim->tag ? budget_tag(claim->tag, FALSE) : &global;
+        if (!usage)
+            continue;
+        usage->reserved -= MIN(usage->reserved, claim->bytes);
+        if (claim->tag)
+            budget_tag_check(claim->tag, usage);
+    }
+}
+
+void budget_claims_free(GArray * claims)
+{
+    guint i;
+
+    for (i = 0; i < claims->len; i++)
+        g_free(g_array_index(claims, struct budget_claim, i).tag);
+    g_array_free(claims, TRUE);
+}
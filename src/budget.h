@@ -0,0 +1,31 @@
+#ifndef PCMA__BUDGET_H
+#define PCMA__BUDGET_H
+
+#include <glib.h>
+
+struct budget_usage {
+    guint64 limit;              /* bytes, 0 for unlimited */
+    guint64 used;               /* bytes locked */
+    guint64 reserved;           /* bytes admitted for locks in flight */
+};
+
+/* Bytes a lock may add to the usage of a tag, or globally if tag is NULL */
+struct budget_claim {
+    gchar *tag;
+    guint64 bytes;
+};
+
+void budget_init(guint64 limit);
+void budget_set_tag_limit(const gchar * tag, guint64 limit);
+gboolean budget_limited();
+guint64 budget_generation();
+const struct budget_usage *budget_global();
+void budget_foreach_tag(GHFunc fn, gpointer user_data);
+guint budget_tag_count();
+void budget_charge(GList * tags, guint64 bytes);
+void budget_release(GList * tags, guint64 bytes);
+gchar *budget_reserve(GArray * claims);
+void budget_unreserve(GArray * claims);
+void budget_claims_free(GArray * claims);
+
+#endif                          /* PCMA__BUDGET_H */
@@ -7,20 +7,115 @@
 #include <unistd.h>
 #include <zmq.h>
 #include "common.h"
+#include "pcma.h"
 #include "client.h"
 
 struct pcma_req {
     int argc;
     char **argv;
+    GArray *ranges;             /* struct pcma_range */
+    GPtrArray *includes;
+    GPtrArray *excludes;
+    GPtrArray *paths;           /* read from stdin for batch requests */
+    const char *strategy;       /* lock strategy, NULL for the default */
+    guint64 rate;               /* bytes per second, 0 for the default */
 };
 
+void range_pack(msgpack_packer * pk, struct pcma_range *range)
+{
+    msgpack_pack_array(pk, 2);
+    msgpack_pack_uint64(pk, range->offset);
+    msgpack_pack_uint64(pk, range->length);
+}
+
+/* Whether lock requests need their options */
+gboolean has_lock_options(const struct pcma_req *req)
+{
+    return (req->strategy || req->rate);
+}
+
+/* Packs the options of lock requests */
+void lock_options_pack(msgpack_packer * pk, const struct pcma_req *req)
+{
+    msgpack_pack_map(pk, (req->strategy ? 1 : 0) + (req->rate ? 1 : 0));
+    if (req->strategy) {
+        string_pack(LOCK_STRATEGY, pk);
+        string_pack((gpointer) req->strategy, pk);
+    }
+    if (req->rate) {
+        string_pack(LOCK_RATE, pk);
+        msgpack_pack_uint64(pk, req->rate);
+    }
+}
+
+void ranges_pack(msgpack_packer * pk, GArray * ranges)
+{
+    guint i;
+
+    msgpack_pack_array(pk, ranges->len);
+    for (i = 0; i < ranges->len; i++)
+        range_pack(pk, &g_array_index(ranges, struct pcma_range, i));
+}
+
 int pcma_req_packfn(msgpack_packer * pk, void *req)
 {
-    int i, len;
+    int i, j, len;
     const char *str;
+    gchar *key;
     const struct pcma_req *rreq = (struct pcma_req *) req;
-    if (!strcmp(rreq->argv[0], LOCK_COMMAND)) {
-        if (rreq->argc > 2)
+    if (!strcmp(rreq->argv[0], LOCKMANY_COMMAND)) {
+        /* Every entry gets the tags and ranges from the command line */
+        msgpack_pack_array(pk, 2);
+        string_pack(rreq->argv[0], pk);
+        msgpack_pack_array(pk, rreq->paths->len);
+        for (i = 0; i < rreq->paths->len; i++) {
+            msgpack_pack_array(pk, has_lock_options(rreq) ? 4 : 3);
+            string_pack(g_ptr_array_index(rreq->paths, i), pk);
+            msgpack_pack_array(pk, rreq->argc - 1);
+            for (j = 1; j < rreq->argc; j++)
+                string_pack(rreq->argv[j], pk);
+            ranges_pack(pk, rreq->ranges);
+            if (has_lock_options(rreq))
+                lock_options_pack(pk, rreq);
+        }
+    } else if (!strcmp(rreq->argv[0], UNLOCKMANY_COMMAND)) {
+        if (rreq->ranges->len > 1)
+            g_error("unlockmany expects at most one range");
+
+        msgpack_pack_array(pk, 2);
+        string_pack(rreq->argv[0], pk);
+        msgpack_pack_array(pk, rreq->paths->len);
+        for (i = 0; i < rreq->paths->len; i++) {
+            if (rreq->ranges->len > 0)
+                msgpack_pack_array(pk, 2);
+            string_pack(g_ptr_array_index(rreq->paths, i), pk);
+            if (rreq->ranges->len > 0)
+                range_pack(pk, &g_array_index(rreq->ranges,
+                                              struct pcma_range, 0));
+        }
+    } else if (!strcmp(rreq->argv[0], LIST_COMMAND) && rreq->argc > 1) {
+        /* Options are given as KEY=VALUE */
+        msgpack_pack_array(pk, 2);
+        string_pack(rreq->argv[0], pk);
+        msgpack_pack_map(pk, rreq->argc - 1);
+        for (i = 1; i < rreq->argc; i++) {
+            str = strchr(rreq->argv[i], '=');
+            if (!str)
+                g_error("list option %s should be KEY=VALUE", rreq->argv[i]);
+            key = g_strndup(rreq->argv[i], str - rreq->argv[i]);
+            string_pack(key, pk);
+            if (!strcmp(key, LIST_LIMIT) || !strcmp(key, LIST_STREAM))
+                msgpack_pack_uint64(pk, g_ascii_strtoull(str + 1, NULL, 10));
+            else
+                string_pack((gpointer) (str + 1), pk);
+            g_free(key);
+        }
+    } else if (!strcmp(rreq->argv[0], LOCK_COMMAND)) {
+        if (has_lock_options(rreq))
+            msgpack_pack_array(pk, 5);
+        else if (rreq->ranges->len > 0)
+            msgpack_pack_array(pk, 4);
+        else if (rreq->argc > 2)
             msgpack_pack_array(pk, 3);
         else if (rreq->argc == 2)
             msgpack_pack_array(pk, 2);
@@ -30,11 +125,55 @@ int pcma_req_packfn(msgpack_packer * pk, void *req)
         string_pack(rreq->argv[0], pk);
         string_pack(rreq->argv[1], pk);
 
-        if (rreq->argc > 2) {
+        if (rreq->argc > 2 || rreq->ranges->len > 0 ||
+            has_lock_options(rreq)) {
             msgpack_pack_array(pk, rreq->argc - 2);
             for (i = 2; i < rreq->argc; i++)
                 string_pack(rreq->argv[i], pk);
         }
+
+        if (rreq->ranges->len > 0 || has_lock_options(rreq))
+            ranges_pack(pk, rreq->ranges);
+        if (has_lock_options(rreq))
+            lock_options_pack(pk, rreq);
+    } else if (!strcmp(rreq->argv[0], LOCKDIR_COMMAND)) {
+        if (rreq->argc < 2)
+            g_error("lockdir expects a directory");
+
+        msgpack_pack_array(pk, has_lock_options(rreq) ? 6 : 5);
+        string_pack(rreq->argv[0], pk);
+        string_pack(rreq->argv[1], pk);
+
+        msgpack_pack_array(pk, rreq->argc - 2);
+        for (i = 2; i < rreq->argc; i++)
+            string_pack(rreq->argv[i], pk);
+
+        msgpack_pack_array(pk, rreq->includes->len);
+        g_ptr_array_foreach(rreq->includes, string_pack, pk);
+        msgpack_pack_array(pk, rreq->excludes->len);
+        g_ptr_array_foreach(rreq->excludes, string_pack, pk);
+        if (has_lock_options(rreq))
+            lock_options_pack(pk, rreq);
+    } else if (!strcmp(rreq->argv[0], UNLOCK_COMMAND)
+               && rreq->ranges->len > 0) {
+        if (rreq->argc != 2)
+            g_error("unlock expects a path");
+        if (rreq->ranges->len > 1)
+            g_error("unlock expects at most one range");
+
+        msgpack_pack_array(pk, 3);
+        string_pack(rreq->argv[0], pk);
+        string_pack(rreq->argv[1], pk);
+        range_pack(pk, &g_array_index(rreq->ranges, struct pcma_range, 0));
+    } else if (!strcmp(rreq->argv[0], WARM_COMMAND)
+               && rreq->ranges->len > 0) {
+        if (rreq->argc != 2)
+            g_error("warm expects a path");
+
+        msgpack_pack_array(pk, 3);
+        string_pack(rreq->argv[0], pk);
+        string_pack(rreq->argv[1], pk);
+        ranges_pack(pk, rreq->ranges);
     } else {
         msgpack_pack_array(pk, rreq->argc);
         for (i = 0; i < rreq->argc; i++)
@@ -44,45 +183,48 @@ int pcma_req_packfn(msgpack_packer * pk, void *req)
     return (0);
 }
 
-int handle_rep(zmq_msg_t * msg)
+/* Reads one path per line, skipping empty lines */
+void read_paths(GPtrArray * paths)
 {
-    msgpack_object obj;
-    msgpack_unpacked pack;
-    char *errmsg;
-
-    msgpack_unpacked_init(&pack);
-
-    if (!msgpack_unpack_next
-        (&pack, zmq_msg_data(msg), zmq_msg_size(msg), NULL))
-        g_error("handle_rep: msgpack_unpack_next failed");
-
-    obj = pack.data;
-
-    if (obj.type != MSGPACK_OBJECT_ARRAY)
-        g_error("handle_rep: not an array");
+    GIOChannel *in = g_io_channel_unix_new(STDIN_FILENO);
+    GError *err = NULL;
+    GIOStatus status;
+    gchar *line;
+    gsize term;
+
+    while ((status = g_io_channel_read_line(in, &line, NULL, &term,
+                                            &err)) == G_IO_STATUS_NORMAL) {
+        line[term] = '\0';
+        if (*line)
+            g_ptr_array_add(paths, line);
+        else
+            g_free(line);
+    }
+    if (status == G_IO_STATUS_ERROR)
+        g_error("read_paths: %s", err->message);
+    g_io_channel_unref(in);
+}
 
-    if (obj.via.array.size < 1)
-        g_error("handle_rep: empty array");
+/* Prints the values of a reply, after the frames streamed before it */
+int handle_rep(struct pcma_reply *reply)
+{
+    const msgpack_object *value;
+    unsigned int i;
 
-    if (obj.via.array.ptr[0].type != MSGPACK_OBJECT_BOOLEAN)
-        g_error("handle_rep: first entry is not a boolean");
+    for (i = 0; i < pcma_reply_parts(reply); i++) {
+        msgpack_object_print(stdout, *pcma_reply_part(reply, i));
+        printf("\n");
+    }
 
-    if (obj.via.array.ptr[0].via.boolean == false) {
-        if (obj.via.array.size > 1
-            && obj.via.array.ptr[1].type == MSGPACK_OBJECT_RAW) {
-            errmsg = raw_to_string(&(obj.via.array.ptr[1].via.raw));
-            if (errmsg) {
-                g_critical("server: %s", errmsg);
-                free(errmsg);
-            }
-        }
-        msgpack_unpacked_destroy(&pack);
+    if (!pcma_reply_ok(reply)) {
+        if (pcma_reply_error(reply))
+            g_critical("server: %s", pcma_reply_error(reply));
         return (1);
     }
 
-    if (obj.via.array.size > 1) {
+    for (i = 0; (value = pcma_reply_value(reply, i)); i++) {
         /* Technically speaking unspecified, but I feel lazy */
-        msgpack_object_print(stdout, obj.via.array.ptr[1]);
+        msgpack_object_print(stdout, *value);
         printf("\n");
     }
     return (0);
@@ -95,7 +237,9 @@ void help(const char *name)
         disp_name = default_name;
 
     fprintf(stderr,
-            "Usage: %s [-t TIMEOUT] [-e ENDPOINT] REQUEST [PARAMETER...]\n",
+            "Usage: %s [-t TIMEOUT] [-e ENDPOINT] [-r OFFSET,LENGTH]... "
+            "[-I GLOB]... [-X GLOB]... [-L STRATEGY] [-R BYTES] "
+            "REQUEST [PARAMETER...]\n",
             disp_name);
     exit(EXIT_LOCAL_FAILURE);
 }
@@ -105,10 +249,9 @@ int client_leave(int signum)
     if (signum >= 0)
         g_info("Signal %i received", signum);
 
-    if (pcmac_sock && (zmq_close(pcmac_sock) < 0))
-        return (-1);
-    if (pcmac_ctx && (zmq_term(pcmac_ctx) < 0))
-        return (-2);
+    if (pcmac_conn)
+        pcma_disconnect(pcmac_conn);
+    pcmac_conn = NULL;
     return (0);
 }
 
@@ -145,8 +288,9 @@ int main(int argc, char **argv)
     int ret, opt;
     const char *endpoint = default_ep;
     struct pcma_req req;
-    zmq_pollitem_t pollitem;
-    zmq_msg_t msg;
+    struct pcma_range range;
+    struct pcma_reply *reply;
+    char *end;
 
     setup_logging();
     setup_signals();
@@ -156,7 +300,14 @@ int main(int argc, char **argv)
     if (argc < 2)
         help(argv[0]);
 
-    while ((opt = getopt(argc, argv, "e:t:")) != -1) {
+    req.ranges = g_array_new(FALSE, FALSE, sizeof(struct pcma_range));
+    req.includes = g_ptr_array_new();
+    req.excludes = g_ptr_array_new();
+    req.paths = g_ptr_array_new_with_free_func(g_free);
+    req.strategy = NULL;
+    req.rate = 0;
+
+    while ((opt = getopt(argc, argv, "e:r:t:I:L:R:X:")) != -1) {
         switch (opt) {
         case 'e':
             endpoint = optarg;
@@ -166,6 +317,28 @@ int main(int argc, char **argv)
             if (timeout >= LONG_MAX / 1000L)
                 g_error("timeout %li too high", timeout);
             break;
+        case 'r':
+            range.offset = g_ascii_strtoull(optarg, &end, 10);
+            if (*end != ',')
+                g_error("range %s should be OFFSET,LENGTH", optarg);
+            range.length = g_ascii_strtoull(end + 1, &end, 10);
+            if (*end != '\0')
+                g_error("range %s should be OFFSET,LENGTH", optarg);
+            g_array_append_val(req.ranges, range);
+            break;
+        case 'I':
+            g_ptr_array_add(req.includes, optarg);
+            break;
+        case 'X':
+            g_ptr_array_add(req.excludes, optarg);
+            break;
+        case 'L':
+            req.strategy = optarg;
+            break;
+        case 'R':
+            if (parse_size(optarg, &req.rate) < 0)
+                g_error("invalid rate %s", optarg);
+            break;
         default:
             help(argv[0]);
         }
@@ -176,14 +349,8 @@ int main(int argc, char **argv)
         g_info("using a %li ms timeout", timeout);
     }
 
-    if (!(pcmac_ctx = zmq_init(1)))
-        g_error("zmq_init: %s", strerror(errno));
-
-    if (!(pcmac_sock = zmq_socket(pcmac_ctx, ZMQ_REQ)))
-        g_error("zmq_socket: %s", strerror(errno));
-
-    if (zmq_connect(pcmac_sock, endpoint) < 0)
-        g_error("zmq_connect: %s", strerror(errno));
+    if (!(pcmac_conn = pcma_connect(endpoint)))
+        g_error("pcma_connect failed");
 
     if (optind >= argc)
         g_error("command expected");
@@ -191,40 +358,22 @@ int main(int argc, char **argv)
     req.argc = argc - optind;
     req.argv = argv + optind;
 
-    if ((ret = pcma_send(pcmac_sock, pcma_req_packfn, &req)) < 0)
-        g_error("pcma_send: %i", ret);
+    if (!strcmp(req.argv[0], LOCKMANY_COMMAND) ||
+        !strcmp(req.argv[0], UNLOCKMANY_COMMAND))
+        read_paths(req.paths);
 
-    if (timeout >= 0) {
-        pollitem.socket = pcmac_sock;
-        pollitem.events = ZMQ_POLLIN;
-
-        ret = zmq_poll(&pollitem, 1, timeout * 1000L);
-        if (ret < 0)
-            g_error("zmq_poll: %s", strerror(errno));
-        if (ret == 0) {
-            int zero = 0;
-            zmq_setsockopt(pcmac_sock, ZMQ_LINGER, &zero, sizeof(zero));
-            g_error("timeout after %li ms", timeout);
-        }
+    if (!(reply = pcma_call(pcmac_conn, pcma_req_packfn, &req, timeout))) {
+        if (timeout >= 0)
+            g_error("no reply after %li ms", timeout);
+        g_error("pcma_call failed");
     }
 
-    if (zmq_msg_init(&msg) < 0)
-        g_error("zmq_msg_init: %s", strerror(errno));
-
-    if (zmq_recv(pcmac_sock, &msg, 0) < 0)
-        g_error("zmq_recv: %s", strerror(errno));
-
-    ret = handle_rep(&msg);
+    ret = handle_rep(reply);
+    pcma_reply_free(reply);
     if (ret > 0) {
         client_exit_code = EXIT_REMOTE_FAILURE;
         main_exit();
     }
-    if (ret != 0) {
-        g_error("handle_rep: %i", ret);
-    }
-
-    if (zmq_msg_close(&msg) < 0)
-        g_error("zmq_msg_close: %s", strerror(errno));
 
     client_exit_code = EXIT_OK;
     main_exit();
@@ -7,7 +7,7 @@
 
 const char *default_name = "pcmac";
 long timeout = -1;
-void *pcmac_ctx = NULL, *pcmac_sock = NULL;
+struct pcma_conn *pcmac_conn = NULL;
 int client_exit_code = EXIT_LOCAL_FAILURE;
 
 #endif                          /* PCMA__CLIENT_H */
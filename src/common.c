@@ -1,6 +1,7 @@
 #include <glib.h>
 #include <msgpack.h>
 #include <signal.h>
+#include <stdlib.h>
 #include <string.h>
 #include <zmq.h>
 
@@ -44,57 +45,124 @@ char *raw_to_string(msgpack_object_raw * raw)
     return res;
 }
 
+/* Parses a size in bytes, optionally suffixed with K, M, G or T */
+int parse_size(const gchar * str, guint64 * bytes)
+{
+    gchar *end;
+    const gchar *units = "KMGT", *unit;
+
+    *bytes = g_ascii_strtoull(str, &end, 10);
+    if (end == str)
+        return (-1);
+    if (*end == '\0')
+        return (0);
+    if (end[1] != '\0' || !(unit = strchr(units, *end)))
+        return (-2);
+    *bytes <<= 10 * (unit - units + 1);
+    return (0);
+}
+
+/*
+ * Replies are packed into a buffer kept by each thread for the next ones,
+ * then copied into their message, zmq storing the smallest ones inline.
+ * A single copy is cheaper than growing a fresh buffer for every reply.
+ * Replies larger than SEND_KEEP_MAX hand the buffer's data over to zmq
+ * instead, which frees it once sent, so that idle threads do not pin it.
+ */
+
+#define SEND_KEEP_MAX (1 << 20)
+
+static GPrivate send_buffer = G_PRIVATE_INIT((GDestroyNotify)
+                                             msgpack_sbuffer_free);
+
 void zmq_free_helper(void *data, void *hint)
 {
-    if (hint)
-        msgpack_packer_free(hint);
+    free(data);
 }
 
-int pcma_send(void *socket,
-              int (*pack_fn) (msgpack_packer *, void *), void *data)
+/* Sends size bytes at data as one frame, ffn(data, hint) releasing them
+ * once zmq is done with them, even if sending fails */
+int send_data(void *socket, int flags, void *data, size_t size,
+              zmq_free_fn * ffn, void *hint)
 {
     zmq_msg_t msg;
+    int ret = 0;
 
-    msgpack_sbuffer *buffer = msgpack_sbuffer_new();
+    if (zmq_msg_init_data(&msg, data, size, ffn, hint) < 0) {
+        g_critical("send_data: zmq_msg_init_data: %s", strerror(errno));
+        ffn(data, hint);
+        return (-4);
+    }
 
-    if (!buffer) {
-        g_critical("pcma_send: msgpack_sbuffer_new failed");
-        return (-1);
+    if (zmq_send(socket, &msg, flags) < 0) {
+        g_critical("send_data: zmq_send: %s", strerror(errno));
+        ret = -5;
     }
 
-    msgpack_packer *pk = msgpack_packer_new(buffer, msgpack_sbuffer_write);
+    if (zmq_msg_close(&msg) < 0) {
+        g_critical("send_data: zmq_msg_close: %s", strerror(errno));
+    }
 
-    if (!pk) {
-        g_critical("pcma_send: msgpack init failed");
-        return (-2);
+    return (ret);
+}
+
+/* Sends one frame, flags being passed to zmq_send (ZMQ_SNDMORE) */
+int send_packed_part(void *socket, int flags,
+                     int (*pack_fn) (msgpack_packer *, void *), void *data)
+{
+    zmq_msg_t msg;
+    msgpack_packer pk;
+    msgpack_sbuffer *buffer = g_private_get(&send_buffer);
+    size_t size;
+
+    if (!buffer) {
+        if (!(buffer = msgpack_sbuffer_new())) {
+            g_critical("send_packed: msgpack_sbuffer_new failed");
+            return (-1);
+        }
+        g_private_set(&send_buffer, buffer);
     }
+    buffer->size = 0;
 
-    if (pack_fn(pk, data) < 0) {
-        g_critical("pcma_send: pack function failed");
+    msgpack_packer_init(&pk, buffer, msgpack_sbuffer_write);
+
+    if (pack_fn(&pk, data) < 0) {
+        g_critical("send_packed: pack function failed");
         return (-3);
     }
 
-    msgpack_packer_free(pk);
+    if (buffer->size > SEND_KEEP_MAX) {
+        size = buffer->size;
+        return (send_data(socket, flags, msgpack_sbuffer_release(buffer),
+                          size, zmq_free_helper, NULL));
+    }
 
-    if (zmq_msg_init_data(&msg,
-                          (void *) buffer->data, buffer->size,
-                          zmq_free_helper, buffer) < 0) {
-        g_critical("pcma_send: zmq_msg_init_data: %s", strerror(errno));
+    if (zmq_msg_init_size(&msg, buffer->size) < 0) {
+        g_critical("send_packed: zmq_msg_init_size: %s", strerror(errno));
         return (-4);
     }
+    if (buffer->size > 0)
+        memcpy(zmq_msg_data(&msg), buffer->data, buffer->size);
 
-    if (zmq_send(socket, &msg, 0) < 0) {
-        g_critical("pcma_send: zmq_send: %s", strerror(errno));
+    if (zmq_send(socket, &msg, flags) < 0) {
+        g_critical("send_packed: zmq_send: %s", strerror(errno));
+        zmq_msg_close(&msg);
         return (-5);
     }
 
     if (zmq_msg_close(&msg) < 0) {
-        g_critical("pcma_send: zmq_msg_close: %s", strerror(errno));
+        g_critical("send_packed: zmq_msg_close: %s", strerror(errno));
     }
 
     return (0);
 }
 
+int send_packed(void *socket,
+                int (*pack_fn) (msgpack_packer *, void *), void *data)
+{
+    return (send_packed_part(socket, 0, pack_fn, data));
+}
+
 void string_pack(gpointer data, gpointer user_data)
 {
     msgpack_packer *pk = (msgpack_packer *) user_data;
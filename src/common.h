@@ -8,9 +8,14 @@
 extern const char *default_ep;
 
 char *raw_to_string(msgpack_object_raw * raw);
+int parse_size(const gchar * str, guint64 * bytes);
 void zmq_free_helper(void *data, void *hint);
-int pcma_send(void *socket,
-              int (*pack_fn) (msgpack_packer *, void *), void *data);
+int send_packed(void *socket,
+                int (*pack_fn) (msgpack_packer *, void *), void *data);
+int send_packed_part(void *socket, int flags,
+                     int (*pack_fn) (msgpack_packer *, void *), void *data);
+int send_data(void *socket, int flags, void *data, size_t size,
+              zmq_free_fn * ffn, void *hint);
 void setup_sig(int signum, void (*sh) (int), int keep_ignoring);
 void setup_logging();
 void string_pack(gpointer data, gpointer user_data);
@@ -34,5 +39,40 @@ void string_pack(gpointer data, gpointer user_data);
 #define RELEASETAG_COMMAND_ID 5
 #define RELEASETAG_COMMAND "releasetag"
 #define RELEASETAG_COMMAND_SIZE 10
+#define LOCKDIR_COMMAND_ID 6
+#define LOCKDIR_COMMAND "lockdir"
+#define LOCKDIR_COMMAND_SIZE 7
+#define RESIDENCY_COMMAND_ID 7
+#define RESIDENCY_COMMAND "residency"
+#define RESIDENCY_COMMAND_SIZE 9
+#define WARM_COMMAND_ID 8
+#define WARM_COMMAND "warm"
+#define WARM_COMMAND_SIZE 4
+#define LOCKMANY_COMMAND_ID 9
+#define LOCKMANY_COMMAND "lockmany"
+#define LOCKMANY_COMMAND_SIZE 8
+#define UNLOCKMANY_COMMAND_ID 10
+#define UNLOCKMANY_COMMAND "unlockmany"
+#define UNLOCKMANY_COMMAND_SIZE 10
+#define STATS_COMMAND_ID 11
+#define STATS_COMMAND "stats"
+#define STATS_COMMAND_SIZE 5
+#define REFRESH_COMMAND_ID 12
+#define REFRESH_COMMAND "refresh"
+#define REFRESH_COMMAND_SIZE 7
+#define ADVISE_COMMAND_ID 13
+#define ADVISE_COMMAND "advise"
+#define ADVISE_COMMAND_SIZE 6
+
+/* Options of the lock, lockmany and lockdir commands */
+#define LOCK_STRATEGY "strategy"
+#define LOCK_RATE "rate"
+
+/* Options of the list command */
+#define LIST_CURSOR "cursor"
+#define LIST_LIMIT "limit"
+#define LIST_TAG "tag"
+#define LIST_PREFIX "prefix"
+#define LIST_STREAM "stream"
 
 #endif                          /* PCMA__COMMON_H */
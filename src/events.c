@@ -0,0 +1,138 @@
+#include <glib.h>
+#include <msgpack.h>
+#include <stdint.h>
+#include <string.h>
+#include <zmq.h>
+#include "common.h"
+#include "events.h"
+
+/*
+ * Changes to locked files are published on a PUB socket, so that agents
+ * follow them instead of polling list. Every event is sent once under
+ * each tag of its file, the tag being the first frame, so that ZeroMQ
+ * subscriptions filter events by tag prefix; events of untagged files go
+ * out under an empty tag. Every tag numbers its events in sequence, so
+ * that subscribers see lost events as gaps in the sequence of a tag; the
+ * rest of the body is packed once for all the tags.
+ *
+ * Publishing never blocks: events are dropped for subscribers falling
+ * more than EVENTS_HWM behind. Only the main thread publishes.
+ */
+
+static void *pub = NULL;
+static GHashTable *sequences = NULL;    /* tag -> guint64, last sent */
+
+int events_init(void *ctx, const gchar * endpoint)
+{
+    uint64_t hwm = EVENTS_HWM;
+    int linger = 0;
+
+    if (!(pub = zmq_socket(ctx, ZMQ_PUB))) {
+        g_critical("events_init: zmq_socket: %s", strerror(errno));
+        return (-1);
+    }
+    if (zmq_setsockopt(pub, ZMQ_HWM, &hwm, sizeof(hwm)) < 0 ||
+        zmq_setsockopt(pub, ZMQ_LINGER, &linger, sizeof(linger)) < 0)
+        g_warning("events_init: zmq_setsockopt: %s", strerror(errno));
+    if (zmq_bind(pub, endpoint) < 0) {
+        g_critical("events_init: zmq_bind(%s): %s", endpoint,
+                   strerror(errno));
+        zmq_close(pub);
+        pub = NULL;
+        return (-2);
+    }
+    sequences = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                      g_free);
+    return (0);
+}
+
+void events_close()
+{
+    if (pub && zmq_close(pub) < 0)
+        g_critical("events_close: zmq_close: %s", strerror(errno));
+    pub = NULL;
+}
+
+gboolean events_enabled()
+{
+    return (pub != NULL);
+}
+
+static void event_free(void *data, void *hint)
+{
+    msgpack_sbuffer_free(hint);
+}
+
+/* Sends the tail of an event under a tag, numbered in its sequence */
+static void event_send(const gchar * tag, msgpack_sbuffer * tail)
+{
+    msgpack_sbuffer *buffer;
+    msgpack_packer pk;
+    zmq_msg_t topic, body;
+    size_t len = strlen(tag);
+    guint64 *sequence = g_hash_table_lookup(sequences, tag);
+
+    if (!sequence) {
+        sequence = g_new0(guint64, 1);
+        g_hash_table_insert(sequences, g_strdup(tag), sequence);
+    }
+
+    buffer = msgpack_sbuffer_new();
+    msgpack_packer_init(&pk, buffer, msgpack_sbuffer_write);
+    msgpack_pack_array(&pk, 7);
+    msgpack_pack_uint64(&pk, ++*sequence);
+    msgpack_sbuffer_write(buffer, tail->data, tail->size);
+
+    if (zmq_msg_init_data(&body, buffer->data, buffer->size, event_free,
+                          buffer) < 0) {
+        g_critical("event_send: zmq_msg_init_data: %s", strerror(errno));
+        msgpack_sbuffer_free(buffer);
+        return;
+    }
+    if (zmq_msg_init_size(&topic, len) < 0) {
+        g_critical("event_send: zmq_msg_init_size: %s", strerror(errno));
+        zmq_msg_close(&body);
+        return;
+    }
+    memcpy(zmq_msg_data(&topic), tag, len);
+
+    if (zmq_send(pub, &topic, ZMQ_SNDMORE | ZMQ_NOBLOCK) < 0 ||
+        zmq_send(pub, &body, ZMQ_NOBLOCK) < 0)
+        g_warning("event_send: zmq_send: %s", strerror(errno));
+    zmq_msg_close(&topic);
+    zmq_msg_close(&body);
+}
+
+/* Publishes [sequence, time, event, path, size, tags, detail], time being
+ * in microseconds since the epoch and detail packed by detail_fn, or nil */
+void events_publish(const gchar * event, const gchar * path, guint64 size,
+                    GList * tags,
+                    int (*detail_fn) (msgpack_packer *, void *),
+                    void *detail)
+{
+    msgpack_sbuffer tail;
+    msgpack_packer pk;
+    GList *t;
+
+    if (!pub)
+        return;
+
+    msgpack_sbuffer_init(&tail);
+    msgpack_packer_init(&pk, &tail, msgpack_sbuffer_write);
+    msgpack_pack_uint64(&pk, g_get_real_time());
+    string_pack((gpointer) event, &pk);
+    string_pack((gpointer) path, &pk);
+    msgpack_pack_uint64(&pk, size);
+    msgpack_pack_array(&pk, g_list_length(tags));
+    g_list_foreach(tags, string_pack, &pk);
+    if (detail_fn)
+        detail_fn(&pk, detail);
+    else
+        msgpack_pack_nil(&pk);
+
+    if (!tags)
+        event_send("", &tail);
+    for (t = tags; t; t = t->next)
+        event_send(t->data, &tail);
+    msgpack_sbuffer_destroy(&tail);
+}
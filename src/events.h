@@ -0,0 +1,25 @@
+#ifndef PCMA__EVENTS_H
+#define PCMA__EVENTS_H
+
+#include <glib.h>
+#include <msgpack.h>
+
+#define EVENTS_HWM 10000        /* events queued per subscriber */
+
+#define EVENT_LOCK "lock"
+#define EVENT_RELOCK "relock"
+#define EVENT_UNLOCK "unlock"
+#define EVENT_RELEASETAG "releasetag"
+#define EVENT_FAIL "fail"
+#define EVENT_SHED "shed"
+#define EVENT_UNSHED "unshed"
+
+int events_init(void *ctx, const gchar * endpoint);
+void events_close();
+gboolean events_enabled();
+void events_publish(const gchar * event, const gchar * path, guint64 size,
+                    GList * tags,
+                    int (*detail_fn) (msgpack_packer *, void *),
+                    void *detail);
+
+#endif                          /* PCMA__EVENTS_H */
@@ -0,0 +1,644 @@
+#include <glib.h>
+#include <msgpack.h>
+#include <string.h>
+#include <zmq.h>
+#include "common.h"
+#include "pcma.h"
+
+/*
+ * Requests go through a DEALER socket, prefixed with a frame holding their
+ * ID and an empty delimiter, which pcmad echoes back with the reply (see
+ * client_recv in server.c). Replies are matched by ID, whatever the order
+ * they come back in; callbacks of outstanding requests are kept in a table.
+ */
+
+struct pcma_conn {
+    void *ctx;
+    void *sock;
+    guint32 last_id;
+    GHashTable *pending;        /* ID -> struct pcma_pending */
+};
+
+struct pcma_pending {
+    pcma_callback callback;
+    void *data;
+};
+
+struct pcma_reply {
+    guint32 id;
+    gboolean ok;
+    gchar *error;               /* reason of a failure, NULL if none given */
+    GPtrArray *frames;          /* zmq_msg_t, envelope included */
+    msgpack_unpacked *bodies;   /* one per frame after the envelope */
+    guint nbodies;
+};
+
+#define ENVELOPE_FRAMES 2       /* ID and empty delimiter */
+
+struct pcma_conn *pcma_connect(const char *endpoint)
+{
+    struct pcma_conn *conn = g_new0(struct pcma_conn, 1);
+
+    if (!endpoint)
+        endpoint = default_ep;
+
+    conn->pending = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                          NULL, g_free);
+
+    if (!(conn->ctx = zmq_init(1))) {
+        g_critical("pcma_connect: zmq_init: %s", strerror(errno));
+        pcma_disconnect(conn);
+        return (NULL);
+    }
+    if (!(conn->sock = zmq_socket(conn->ctx, ZMQ_DEALER))) {
+        g_critical("pcma_connect: zmq_socket: %s", strerror(errno));
+        pcma_disconnect(conn);
+        return (NULL);
+    }
+    if (zmq_connect(conn->sock, endpoint) < 0) {
+        g_critical("pcma_connect: zmq_connect(%s): %s", endpoint,
+                   strerror(errno));
+        pcma_disconnect(conn);
+        return (NULL);
+    }
+    return (conn);
+}
+
+/* Outstanding requests are dropped without their callbacks being called */
+void pcma_disconnect(struct pcma_conn *conn)
+{
+    int linger = 0;
+
+    if (conn->sock) {
+        zmq_setsockopt(conn->sock, ZMQ_LINGER, &linger, sizeof(linger));
+        if (zmq_close(conn->sock) < 0)
+            g_warning("pcma_disconnect: zmq_close: %s", strerror(errno));
+    }
+    if (conn->ctx && zmq_term(conn->ctx) < 0)
+        g_warning("pcma_disconnect: zmq_term: %s", strerror(errno));
+    g_hash_table_unref(conn->pending);
+    g_free(conn);
+}
+
+unsigned int pcma_pending(const struct pcma_conn *conn)
+{
+    return (g_hash_table_size(conn->pending));
+}
+
+static int send_frame(void *sock, const void *data, size_t size)
+{
+    zmq_msg_t frame;
+
+    if (zmq_msg_init_size(&frame, size) < 0) {
+        g_critical("send_frame: zmq_msg_init_size: %s", strerror(errno));
+        return (-1);
+    }
+    if (size)
+        memcpy(zmq_msg_data(&frame), data, size);
+    if (zmq_send(sock, &frame, ZMQ_SNDMORE) < 0) {
+        g_critical("send_frame: zmq_send: %s", strerror(errno));
+        zmq_msg_close(&frame);
+        return (-2);
+    }
+    zmq_msg_close(&frame);
+    return (0);
+}
+
+/* Sends a request packed by pack_fn, callback being called with its reply.
+ * Its ID is stored in *id if set. */
+int pcma_request(struct pcma_conn *conn,
+                 int (*pack_fn) (msgpack_packer *, void *), void *pack_data,
+                 pcma_callback callback, void *data, uint32_t * id)
+{
+    struct pcma_pending *pending;
+    guint32 next = conn->last_id + 1;
+    int ret;
+
+    /* 0 is never used, IDs still outstanding are skipped */
+    while (!next || g_hash_table_lookup(conn->pending,
+                                        GUINT_TO_POINTER(next)))
+        next++;
+
+    if (send_frame(conn->sock, &next, sizeof(next)) < 0 ||
+        send_frame(conn->sock, NULL, 0) < 0)
+        return (-1);
+    if ((ret = send_packed(conn->sock, pack_fn, pack_data)) < 0) {
+        g_critical("pcma_request: send_packed: %i", ret);
+        return (-2);
+    }
+
+    conn->last_id = next;
+    pending = g_new(struct pcma_pending, 1);
+    pending->callback = callback;
+    pending->data = data;
+    g_hash_table_insert(conn->pending, GUINT_TO_POINTER(next), pending);
+    if (id)
+        *id = next;
+    return (0);
+}
+
+struct command_args {
+    const char *command;
+    const char *argument;
+};
+
+static int command_packfn(msgpack_packer * pk, void *p)
+{
+    struct command_args *args = (struct command_args *) p;
+
+    msgpack_pack_array(pk, args->argument ? 2 : 1);
+    string_pack((gpointer) args->command, pk);
+    if (args->argument)
+        string_pack((gpointer) args->argument, pk);
+    return (0);
+}
+
+/* Sends a command taking at most one string, such as ping, list, stats,
+ * releasetag or refresh */
+int pcma_command(struct pcma_conn *conn, const char *command,
+                 const char *argument, pcma_callback callback, void *data)
+{
+    struct command_args args = { command, argument };
+
+    return (pcma_request(conn, command_packfn, &args, callback, data,
+                         NULL));
+}
+
+struct lock_args {
+    const char *path;
+    const char *const *tags;
+    const struct pcma_range *ranges;
+    size_t nranges;
+    const char *strategy;
+};
+
+static void range_pack(msgpack_packer * pk, const struct pcma_range *range)
+{
+    msgpack_pack_array(pk, 2);
+    msgpack_pack_uint64(pk, range->offset);
+    msgpack_pack_uint64(pk, range->length);
+}
+
+static int lock_packfn(msgpack_packer * pk, void *p)
+{
+    struct lock_args *args = (struct lock_args *) p;
+    size_t i, ntags = 0;
+
+    while (args->tags && args->tags[ntags])
+        ntags++;
+
+    msgpack_pack_array(pk, args->strategy ? 5 : 4);
+    string_pack(LOCK_COMMAND, pk);
+    string_pack((gpointer) args->path, pk);
+    msgpack_pack_array(pk, ntags);
+    for (i = 0; i < ntags; i++)
+        string_pack((gpointer) args->tags[i], pk);
+    msgpack_pack_array(pk, args->nranges);
+    for (i = 0; i < args->nranges; i++)
+        range_pack(pk, &args->ranges[i]);
+    if (args->strategy) {
+        msgpack_pack_map(pk, 1);
+        string_pack(LOCK_STRATEGY, pk);
+        string_pack((gpointer) args->strategy, pk);
+    }
+    return (0);
+}
+
+/* Locks a file; tags are NULL-terminated, ranges and strategy optional */
+int pcma_lock(struct pcma_conn *conn, const char *path,
+              const char *const *tags, const struct pcma_range *ranges,
+              size_t nranges, const char *strategy,
+              pcma_callback callback, void *data)
+{
+    struct lock_args args = { path, tags, ranges, nranges, strategy };
+
+    return (pcma_request(conn, lock_packfn, &args, callback, data, NULL));
+}
+
+struct unlock_args {
+    const char *path;
+    const struct pcma_range *range;
+};
+
+static int unlock_packfn(msgpack_packer * pk, void *p)
+{
+    struct unlock_args *args = (struct unlock_args *) p;
+
+    msgpack_pack_array(pk, args->range ? 3 : 2);
+    string_pack(UNLOCK_COMMAND, pk);
+    string_pack((gpointer) args->path, pk);
+    if (args->range)
+        range_pack(pk, args->range);
+    return (0);
+}
+
+/* Unlocks a file, or a single range of it if range is set */
+int pcma_unlock(struct pcma_conn *conn, const char *path,
+                const struct pcma_range *range,
+                pcma_callback callback, void *data)
+{
+    struct unlock_args args = { path, range };
+
+    return (pcma_request(conn, unlock_packfn, &args, callback, data,
+                         NULL));
+}
+
+void pcma_reply_free(struct pcma_reply *reply)
+{
+    guint i;
+    zmq_msg_t *frame;
+
+    for (i = 0; i < reply->nbodies; i++)
+        msgpack_unpacked_destroy(&reply->bodies[i]);
+    g_free(reply->bodies);
+    for (i = 0; i < reply->frames->len; i++) {
+        frame = g_ptr_array_index(reply->frames, i);
+        zmq_msg_close(frame);
+        g_free(frame);
+    }
+    g_ptr_array_free(reply->frames, TRUE);
+    g_free(reply->error);
+    g_free(reply);
+}
+
+/* Receives the frames of a reply if one is waiting, or returns NULL */
+static GPtrArray *recv_frames(void *sock, int *ret)
+{
+    GPtrArray *frames = g_ptr_array_new();
+    zmq_msg_t *frame;
+    int64_t more = 1;
+    size_t more_size;
+
+    *ret = 0;
+    while (more) {
+        frame = g_new(zmq_msg_t, 1);
+        zmq_msg_init(frame);
+        /* Later frames of a message are always there with the first */
+        while (zmq_recv(sock, frame, frames->len ? 0 : ZMQ_NOBLOCK) < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN) {
+                g_critical("recv_frames: zmq_recv: %s", strerror(errno));
+                *ret = -1;
+            }
+            zmq_msg_close(frame);
+            g_free(frame);
+            g_ptr_array_free(frames, TRUE);
+            return (NULL);
+        }
+        g_ptr_array_add(frames, frame);
+
+        more_size = sizeof(more);
+        if (zmq_getsockopt(sock, ZMQ_RCVMORE, &more, &more_size) < 0) {
+            g_critical("recv_frames: zmq_getsockopt: %s", strerror(errno));
+            *ret = -2;
+            more = 0;
+        }
+    }
+    return (frames);
+}
+
+/* Decodes the frames of a reply, NULL if they are malformed */
+static struct pcma_reply *reply_new(GPtrArray * frames)
+{
+    struct pcma_reply *reply = g_new0(struct pcma_reply, 1);
+    zmq_msg_t *frame;
+    msgpack_object *status;
+    guint i;
+
+    reply->frames = frames;
+    if (frames->len <= ENVELOPE_FRAMES ||
+        zmq_msg_size(g_ptr_array_index(frames, 0)) != sizeof(reply->id)) {
+        g_warning("reply_new: malformed envelope");
+        pcma_reply_free(reply);
+        return (NULL);
+    }
+    memcpy(&reply->id, zmq_msg_data(g_ptr_array_index(frames, 0)),
+           sizeof(reply->id));
+
+    reply->bodies = g_new(msgpack_unpacked, frames->len - ENVELOPE_FRAMES);
+    for (i = ENVELOPE_FRAMES; i < frames->len; i++) {
+        frame = g_ptr_array_index(frames, i);
+        msgpack_unpacked_init(&reply->bodies[reply->nbodies]);
+        reply->nbodies++;
+        if (!msgpack_unpack_next(&reply->bodies[reply->nbodies - 1],
+                                 zmq_msg_data(frame), zmq_msg_size(frame),
+                                 NULL)) {
+            g_warning("reply_new: msgpack_unpack_next failed");
+            pcma_reply_free(reply);
+            return (NULL);
+        }
+    }
+
+    status = &reply->bodies[reply->nbodies - 1].data;
+    if (!pcma_decode_result(status, &reply->ok, &reply->error)) {
+        g_warning("reply_new: malformed status");
+        pcma_reply_free(reply);
+        return (NULL);
+    }
+    return (reply);
+}
+
+/* Handles the replies received so far, returns how many */
+static int dispatch_ready(struct pcma_conn *conn)
+{
+    GPtrArray *frames;
+    struct pcma_reply *reply;
+    struct pcma_pending *pending;
+    gpointer key;
+    int ret, count = 0;
+
+    while ((frames = recv_frames(conn->sock, &ret))) {
+        if (!(reply = reply_new(frames)))
+            continue;
+        key = GUINT_TO_POINTER(reply->id);
+        if (!(pending = g_hash_table_lookup(conn->pending, key))) {
+            g_warning("dispatch_ready: reply for unknown request %u",
+                      reply->id);
+            pcma_reply_free(reply);
+            continue;
+        }
+        /* Callbacks may send requests, the ID is released first */
+        g_hash_table_steal(conn->pending, key);
+        if (pending->callback)
+            pending->callback(reply, pending->data);
+        else
+            pcma_reply_free(reply);
+        g_free(pending);
+        count++;
+    }
+    return (ret < 0 ? ret : count);
+}
+
+/* Waits at most timeout milliseconds (-1 for ever) for replies, then calls
+ * the callbacks of all of them. Returns how many, 0 on timeout. */
+int pcma_dispatch(struct pcma_conn *conn, long timeout)
+{
+    zmq_pollitem_t pollitem;
+    int ret;
+
+    pollitem.socket = conn->sock;
+    pollitem.events = ZMQ_POLLIN;
+
+    while ((ret = zmq_poll(&pollitem, 1,
+                           timeout < 0 ? -1 : timeout * 1000L)) < 0) {
+        if (errno != EINTR) {
+            g_critical("pcma_dispatch: zmq_poll: %s", strerror(errno));
+            return (-1);
+        }
+    }
+    if (ret == 0)
+        return (0);
+    return (dispatch_ready(conn));
+}
+
+/* Dispatches replies until no request is outstanding. Returns 0 once done,
+ * 1 on timeout, < 0 on failure. */
+int pcma_wait(struct pcma_conn *conn, long timeout)
+{
+    gint64 deadline = g_get_monotonic_time() + timeout * 1000L, now;
+    int ret;
+
+    while (pcma_pending(conn)) {
+        now = g_get_monotonic_time();
+        if (timeout >= 0 && now >= deadline)
+            return (1);
+        ret = pcma_dispatch(conn, timeout < 0 ? -1 :
+                            (deadline - now + 999) / 1000);
+        if (ret < 0)
+            return (ret);
+    }
+    return (0);
+}
+
+static void call_done(struct pcma_reply *reply, void *data)
+{
+    *(struct pcma_reply **) data = reply;
+}
+
+/* Sends a request and waits for its reply, other replies being dispatched
+ * meanwhile. Returns NULL on failure or timeout. */
+struct pcma_reply *pcma_call(struct pcma_conn *conn,
+                             int (*pack_fn) (msgpack_packer *, void *),
+                             void *pack_data, long timeout)
+{
+    struct pcma_reply *reply = NULL;
+    struct pcma_pending *pending;
+    gint64 deadline = g_get_monotonic_time() + timeout * 1000L, now;
+    guint32 id;
+
+    if (pcma_request(conn, pack_fn, pack_data, call_done, &reply, &id) < 0)
+        return (NULL);
+
+    while (!reply) {
+        now = g_get_monotonic_time();
+        if ((timeout >= 0 && now >= deadline) ||
+            pcma_dispatch(conn, timeout < 0 ? -1 :
+                          (deadline - now + 999) / 1000) < 0)
+            break;
+    }
+
+    /* A late reply gets dropped */
+    if (!reply && (pending = g_hash_table_lookup(conn->pending,
+                                                 GUINT_TO_POINTER(id))))
+        pending->callback = NULL;
+    return (reply);
+}
+
+uint32_t pcma_reply_id(const struct pcma_reply *reply)
+{
+    return (reply->id);
+}
+
+int pcma_reply_ok(const struct pcma_reply *reply)
+{
+    return (reply->ok);
+}
+
+const char *pcma_reply_error(const struct pcma_reply *reply)
+{
+    return (reply->error);
+}
+
+/* Values following the status in the last frame, NULL past the end */
+const msgpack_object *pcma_reply_value(const struct pcma_reply *reply,
+                                       unsigned int index)
+{
+    msgpack_object *status = &reply->bodies[reply->nbodies - 1].data;
+
+    if (index + 1 >= status->via.array.size)
+        return (NULL);
+    return (&status->via.array.ptr[index + 1]);
+}
+
+/* Frames streamed before the last one, see the list command */
+unsigned int pcma_reply_parts(const struct pcma_reply *reply)
+{
+    return (reply->nbodies - 1);
+}
+
+const msgpack_object *pcma_reply_part(const struct pcma_reply *reply,
+                                      unsigned int index)
+{
+    if (index + 1 >= reply->nbodies)
+        return (NULL);
+    return (&reply->bodies[index].data);
+}
+
+static char *raw_dup(const msgpack_object * obj)
+{
+    return (g_strndup(obj->via.raw.ptr, obj->via.raw.size));
+}
+
+/* Decodes [true, value...] or [false, reason?], returning the first value
+ * (a nil object if none) or NULL for malformed objects; *error is set to a
+ * copy of the reason if any, to be freed */
+const msgpack_object *pcma_decode_result(const msgpack_object * obj,
+                                         int *ok, char **error)
+{
+    static const msgpack_object none = { MSGPACK_OBJECT_NIL };
+
+    if (obj->type != MSGPACK_OBJECT_ARRAY || obj->via.array.size < 1 ||
+        obj->via.array.ptr[0].type != MSGPACK_OBJECT_BOOLEAN)
+        return (NULL);
+
+    *ok = obj->via.array.ptr[0].via.boolean;
+    *error = NULL;
+    if (!*ok && obj->via.array.size > 1 &&
+        obj->via.array.ptr[1].type == MSGPACK_OBJECT_RAW)
+        *error = raw_dup(&obj->via.array.ptr[1]);
+    return (obj->via.array.size > 1 ? &obj->via.array.ptr[1] : &none);
+}
+
+/* Decodes a list of integers such as the reply to lockdir, warm or
+ * refresh; counts missing from the object are set to 0 */
+int pcma_decode_counts(const msgpack_object * obj, uint64_t * counts,
+                       size_t ncounts)
+{
+    size_t i;
+
+    if (obj->type != MSGPACK_OBJECT_ARRAY)
+        return (-1);
+    for (i = 0; i < ncounts; i++) {
+        if (i >= obj->via.array.size) {
+            counts[i] = 0;
+        } else if (obj->via.array.ptr[i].type ==
+                   MSGPACK_OBJECT_POSITIVE_INTEGER) {
+            counts[i] = obj->via.array.ptr[i].via.u64;
+        } else {
+            return (-2);
+        }
+    }
+    return (0);
+}
+
+/* Decodes a list of strings into a NULL-terminated array */
+static char **strings_decode(const msgpack_object * obj)
+{
+    char **strings;
+    guint i;
+
+    if (obj->type != MSGPACK_OBJECT_ARRAY)
+        return (NULL);
+    strings = g_new0(char *, obj->via.array.size + 1);
+    for (i = 0; i < obj->via.array.size; i++) {
+        if (obj->via.array.ptr[i].type != MSGPACK_OBJECT_RAW) {
+            g_strfreev(strings);
+            return (NULL);
+        }
+        strings[i] = raw_dup(&obj->via.array.ptr[i]);
+    }
+    return (strings);
+}
+
+/* Decodes [fd, size, tags, ranges, aliases?], the path being left NULL */
+int pcma_decode_file(const msgpack_object * obj, struct pcma_file *file)
+{
+    msgpack_object *fields = obj->via.array.ptr, *range;
+    guint i;
+
+    memset(file, 0, sizeof(*file));
+    if (obj->type != MSGPACK_OBJECT_ARRAY || obj->via.array.size < 4 ||
+        fields[0].type != MSGPACK_OBJECT_POSITIVE_INTEGER ||
+        fields[1].type != MSGPACK_OBJECT_POSITIVE_INTEGER ||
+        fields[3].type != MSGPACK_OBJECT_ARRAY)
+        return (-1);
+
+    file->fd = fields[0].via.u64;
+    file->size = fields[1].via.u64;
+    if (!(file->tags = strings_decode(&fields[2]))) {
+        pcma_file_clear(file);
+        return (-2);
+    }
+
+    file->nranges = fields[3].via.array.size;
+    file->ranges = g_new(struct pcma_range, file->nranges);
+    for (i = 0; i < file->nranges; i++) {
+        range = &fields[3].via.array.ptr[i];
+        if (range->type != MSGPACK_OBJECT_ARRAY ||
+            range->via.array.size != 2 ||
+            range->via.array.ptr[0].type != MSGPACK_OBJECT_POSITIVE_INTEGER
+            || range->via.array.ptr[1].type !=
+            MSGPACK_OBJECT_POSITIVE_INTEGER) {
+            pcma_file_clear(file);
+            return (-3);
+        }
+        file->ranges[i].offset = range->via.array.ptr[0].via.u64;
+        file->ranges[i].length = range->via.array.ptr[1].via.u64;
+    }
+
+    if (obj->via.array.size > 4)
+        file->aliases = strings_decode(&fields[4]);
+    else
+        file->aliases = g_new0(char *, 1);
+    if (!file->aliases) {
+        pcma_file_clear(file);
+        return (-4);
+    }
+    return (0);
+}
+
+/* Decodes a map of paths to files, as in list replies and frames */
+int pcma_decode_files(const msgpack_object * obj, struct pcma_file **files,
+                      size_t *nfiles)
+{
+    msgpack_object_kv *kv;
+    guint i;
+
+    *files = NULL;
+    *nfiles = 0;
+    if (obj->type != MSGPACK_OBJECT_MAP)
+        return (-1);
+
+    *files = g_new0(struct pcma_file, obj->via.map.size);
+    for (i = 0; i < obj->via.map.size; i++) {
+        kv = &obj->via.map.ptr[i];
+        if (kv->key.type != MSGPACK_OBJECT_RAW ||
+            pcma_decode_file(&kv->val, &(*files)[i]) < 0) {
+            pcma_files_free(*files, i);
+            *files = NULL;
+            return (-2);
+        }
+        (*files)[i].path = raw_dup(&kv->key);
+    }
+    *nfiles = obj->via.map.size;
+    return (0);
+}
+
+void pcma_file_clear(struct pcma_file *file)
+{
+    g_free(file->path);
+    g_strfreev(file->tags);
+    g_free(file->ranges);
+    g_strfreev(file->aliases);
+    memset(file, 0, sizeof(*file));
+}
+
+void pcma_files_free(struct pcma_file *files, size_t nfiles)
+{
+    size_t i;
+
+    for (i = 0; i < nfiles; i++)
+        pcma_file_clear(&files[i]);
+    g_free(files);
+}
@@ -0,0 +1,245 @@
+#include <glib.h>
+#include <msgpack.h>
+#include <string.h>
+#include <sys/resource.h>
+#include "budget.h"
+#include "common.h"
+#include "metrics.h"
+
+/*
+ * Counters are plain integers only touched by the main thread: requests
+ * are accounted when their reply is sent, lock workers hand their timings
+ * over with their results. Recording a request is an increment and a bit
+ * scan, so that it does not show in request latencies.
+ *
+ * Metrics are reported by the stats request and, optionally, written in
+ * the Prometheus text format to a file a local scraper can read.
+ */
+
+struct command_metrics {
+    guint64 count;
+    guint64 sum;                /* microseconds */
+    guint64 buckets[METRICS_BUCKETS];
+};
+
+static struct command_metrics commands[METRICS_COMMANDS];
+static struct mlocktimes lock_times = { 0, 0, 0 };
+
+static const char *command_names[METRICS_COMMANDS] = {
+    [0] = "invalid",
+    [PING_COMMAND_ID] = PING_COMMAND,
+    [LIST_COMMAND_ID] = LIST_COMMAND,
+    [LOCK_COMMAND_ID] = LOCK_COMMAND,
+    [UNLOCK_COMMAND_ID] = UNLOCK_COMMAND,
+    [RELEASETAG_COMMAND_ID] = RELEASETAG_COMMAND,
+    [LOCKDIR_COMMAND_ID] = LOCKDIR_COMMAND,
+    [RESIDENCY_COMMAND_ID] = RESIDENCY_COMMAND,
+    [WARM_COMMAND_ID] = WARM_COMMAND,
+    [LOCKMANY_COMMAND_ID] = LOCKMANY_COMMAND,
+    [UNLOCKMANY_COMMAND_ID] = UNLOCKMANY_COMMAND,
+    [STATS_COMMAND_ID] = STATS_COMMAND,
+    [REFRESH_COMMAND_ID] = REFRESH_COMMAND,
+    [ADVISE_COMMAND_ID] = ADVISE_COMMAND,
+};
+
+static gchar *exposition_path = NULL;
+static gint64 exposition_deadline = -1;
+
+/* Accounts a request answered after elapsed microseconds */
+void metrics_request(int command, gint64 elapsed)
+{
+    struct command_metrics *m;
+    guint bucket = 0;
+
+    if (command < 0 || command >= METRICS_COMMANDS)
+        command = 0;
+    if (elapsed < 0)
+        elapsed = 0;
+
+    /* Bounds are inclusive, as le labels are */
+    if (elapsed > 1)
+        bucket = MIN(g_bit_storage(elapsed - 1), METRICS_BUCKETS - 1);
+    m = &commands[command];
+    m->count++;
+    m->sum += elapsed;
+    m->buckets[bucket]++;
+}
+
+/* Accounts the system calls of a finished lock job */
+void metrics_lock(const struct mlocktimes *times)
+{
+    lock_times.open += times->open;
+    lock_times.mmap += times->mmap;
+    lock_times.mlock += times->mlock;
+}
+
+/* Returns 1 when locked memory is not limited */
+int metrics_memlock(guint64 * limit, guint64 * headroom)
+{
+    struct rlimit rl;
+    guint64 used = budget_global()->used;
+
+    if (getrlimit(RLIMIT_MEMLOCK, &rl) < 0) {
+        g_critical("metrics_memlock: getrlimit: %s", strerror(errno));
+        return (-1);
+    }
+    if (rl.rlim_cur == RLIM_INFINITY)
+        return (1);
+    *limit = rl.rlim_cur;
+    *headroom = *limit > used ? *limit - used : 0;
+    return (0);
+}
+
+static void uint_pack(msgpack_packer * pk, const char *key, guint64 value)
+{
+    string_pack((gpointer) key, pk);
+    msgpack_pack_uint64(pk, value);
+}
+
+/* Packs the requests, lock_us and memlock entries of the stats map */
+void metrics_pack(msgpack_packer * pk)
+{
+    struct command_metrics *m;
+    guint64 limit, headroom;
+    int i, j, count = 0;
+
+    for (i = 0; i < METRICS_COMMANDS; i++)
+        if (commands[i].count)
+            count++;
+
+    string_pack("requests", pk);
+    msgpack_pack_map(pk, count);
+    for (i = 0; i < METRICS_COMMANDS; i++) {
+        m = &commands[i];
+        if (!m->count)
+            continue;
+        string_pack((gpointer) (command_names[i] ? command_names[i] :
+                                command_names[0]), pk);
+        msgpack_pack_map(pk, 3);
+        uint_pack(pk, "count", m->count);
+        uint_pack(pk, "sum_us", m->sum);
+        string_pack("buckets", pk);
+        msgpack_pack_array(pk, METRICS_BUCKETS);
+        for (j = 0; j < METRICS_BUCKETS; j++)
+            msgpack_pack_uint64(pk, m->buckets[j]);
+    }
+
+    string_pack("lock_us", pk);
+    msgpack_pack_map(pk, 3);
+    uint_pack(pk, "open", lock_times.open);
+    uint_pack(pk, "mmap", lock_times.mmap);
+    uint_pack(pk, "mlock", lock_times.mlock);
+
+    string_pack("memlock", pk);
+    if (metrics_memlock(&limit, &headroom) != 0) {
+        msgpack_pack_nil(pk);
+    } else {
+        msgpack_pack_map(pk, 2);
+        uint_pack(pk, "limit", limit);
+        uint_pack(pk, "headroom", headroom);
+    }
+}
+
+static void exposition_tag(gpointer key, gpointer value, gpointer user_data)
+{
+    const struct budget_usage *usage = (struct budget_usage *) value;
+    gchar *tag = g_strescape((const gchar *) key, NULL);
+
+    g_string_append_printf((GString *) user_data,
+                           "pcma_tag_locked_bytes{tag=\"%s\"} %"
+                           G_GUINT64_FORMAT "\n", tag, usage->used);
+    g_free(tag);
+}
+
+static void exposition_write()
+{
+    GString *out = g_string_sized_new(4096);
+    GError *err = NULL;
+    struct command_metrics *m;
+    const char *name;
+    guint64 cumulated, limit, headroom;
+    int i, j;
+
+    g_string_append(out, "# TYPE pcma_request_seconds histogram\n");
+    for (i = 0; i < METRICS_COMMANDS; i++) {
+        m = &commands[i];
+        if (!m->count)
+            continue;
+        name = command_names[i] ? command_names[i] : command_names[0];
+        cumulated = 0;
+        for (j = 0; j < METRICS_BUCKETS - 1; j++) {
+            cumulated += m->buckets[j];
+            g_string_append_printf(out, "pcma_request_seconds_bucket"
+                                   "{command=\"%s\",le=\"%g\"} %"
+                                   G_GUINT64_FORMAT "\n", name,
+                                   (1 << j) / 1e6, cumulated);
+        }
+        g_string_append_printf(out, "pcma_request_seconds_bucket"
+                               "{command=\"%s\",le=\"+Inf\"} %"
+                               G_GUINT64_FORMAT "\n", name, m->count);
+        g_string_append_printf(out, "pcma_request_seconds_sum"
+                               "{command=\"%s\"} %g\n", name,
+                               m->sum / 1e6);
+        g_string_append_printf(out, "pcma_request_seconds_count"
+                               "{command=\"%s\"} %" G_GUINT64_FORMAT "\n",
+                               name, m->count);
+    }
+
+    g_string_append(out, "# TYPE pcma_lock_seconds_total counter\n");
+    g_string_append_printf(out, "pcma_lock_seconds_total{phase=\"open\"} "
+                           "%g\n", lock_times.open / 1e6);
+    g_string_append_printf(out, "pcma_lock_seconds_total{phase=\"mmap\"} "
+                           "%g\n", lock_times.mmap / 1e6);
+    g_string_append_printf(out, "pcma_lock_seconds_total{phase=\"mlock\"} "
+                           "%g\n", lock_times.mlock / 1e6);
+
+    g_string_append(out, "# TYPE pcma_locked_bytes gauge\n");
+    g_string_append_printf(out, "pcma_locked_bytes %" G_GUINT64_FORMAT
+                           "\n", budget_global()->used);
+    g_string_append(out, "# TYPE pcma_tag_locked_bytes gauge\n");
+    budget_foreach_tag(exposition_tag, out);
+
+    if (metrics_memlock(&limit, &headroom) == 0) {
+        g_string_append(out, "# TYPE pcma_memlock_limit_bytes gauge\n");
+        g_string_append_printf(out, "pcma_memlock_limit_bytes %"
+                               G_GUINT64_FORMAT "\n", limit);
+        g_string_append(out, "# TYPE pcma_memlock_headroom_bytes gauge\n");
+        g_string_append_printf(out, "pcma_memlock_headroom_bytes %"
+                               G_GUINT64_FORMAT "\n", headroom);
+    }
+
+    /* Written to a temporary file renamed over the previous one */
+    if (!g_file_set_contents(exposition_path, out->str, out->len, &err)) {
+        g_critical("exposition_write: %s", err->message);
+        g_error_free(err);
+    }
+    g_string_free(out, TRUE);
+}
+
+int metrics_init(const gchar * path)
+{
+    exposition_path = g_strdup(path);
+    exposition_deadline = g_get_monotonic_time();
+    return (0);
+}
+
+/* Microseconds until the text file is due, -1 if it is not written */
+glong metrics_timeout()
+{
+    gint64 left;
+
+    if (!exposition_path)
+        return (-1);
+
+    left = exposition_deadline - g_get_monotonic_time();
+    return (left > 0 ? left : 0);
+}
+
+void metrics_check()
+{
+    if (!exposition_path || g_get_monotonic_time() < exposition_deadline)
+        return;
+
+    exposition_write();
+    exposition_deadline = g_get_monotonic_time() + METRICS_INTERVAL * 1000;
+}
@@ -0,0 +1,22 @@
+#ifndef PCMA__METRICS_H
+#define PCMA__METRICS_H
+
+#include <glib.h>
+#include <msgpack.h>
+#include "mlockfile.h"
+
+/* Bucket i counts requests answered in at most 2^i microseconds (and more
+ * than 2^(i-1)), the last one all slower requests */
+#define METRICS_BUCKETS 24
+#define METRICS_COMMANDS 32     /* above the highest command ID */
+#define METRICS_INTERVAL 10000  /* ms between writes of the text file */
+
+void metrics_request(int command, gint64 elapsed);
+void metrics_lock(const struct mlocktimes *times);
+void metrics_pack(msgpack_packer * pk);
+int metrics_memlock(guint64 * limit, guint64 * headroom);
+int metrics_init(const gchar * path);
+glong metrics_timeout();
+void metrics_check();
+
+#endif                          /* PCMA__METRICS_H */
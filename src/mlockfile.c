@@ -1,20 +1,70 @@
+#define _GNU_SOURCE             /* mlock2 */
 #include <glib.h>
 #include <fcntl.h>
+#include <malloc.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 #include "common.h"
 #include "mlockfile.h"
+#include "throttle.h"
 
-struct mlockfile *mlockfile_init()
+static const gchar *strategy_names[MLOCK_STRATEGIES] = {
+    "mlock", "onfault", "maplocked", "populate"
+};
+
+/* Returns the strategy with that name, or -1 */
+int mlock_strategy_parse(const gchar * name, gsize len)
+{
+    int i;
+
+    for (i = 0; i < MLOCK_STRATEGIES; i++)
+        if (strlen(strategy_names[i]) == len &&
+            !strncmp(strategy_names[i], name, len))
+            return (i);
+    return (-1);
+}
+
+const gchar *mlock_strategy_name(int strategy)
 {
-    struct mlockfile *f = g_new0(struct mlockfile, 1);
+    if (strategy < 0 || strategy >= MLOCK_STRATEGIES)
+        return ("unknown");
+    return (strategy_names[strategy]);
+}
+
+/* The path is stored in the same block as the entry */
+struct mlockfile *mlockfile_init(const gchar * path)
+{
+    gsize len = strlen(path) + 1;
+    struct mlockfile *f = g_malloc0(sizeof(struct mlockfile) + len);
+
+    f->path = (gchar *) (f + 1);
+    memcpy(f->path, path, len);
     f->fd = -1;
+    f->regions = g_array_new(FALSE, FALSE, sizeof(struct mlockregion));
     return (f);
 }
 
+/* Copies the file descriptor and regions, but neither mappings nor tags */
+void mlockfile_copy(struct mlockfile *dst, const struct mlockfile *src)
+{
+    dst->fd = src->fd;
+    dst->dev = src->dev;
+    dst->ino = src->ino;
+    dst->size = src->size;
+    dst->mmappedsize = src->mmappedsize;
+    memset(&dst->times, 0, sizeof(dst->times));
+    dst->throttle = NULL;
+    dst->regions = g_array_sized_new(FALSE, FALSE,
+                                     sizeof(struct mlockregion),
+                                     src->regions->len);
+    g_array_append_vals(dst->regions, src->regions->data, src->regions->len);
+}
+
 void mlockfile_destroy(gpointer p)
 {
     struct mlockfile *f = (struct mlockfile *) p;
@@ -23,17 +73,420 @@ void mlockfile_destroy(gpointer p)
     if ((res = mlockfile_unlock(f)) < 0)
         g_critical("mlockfile_release: mlockfile_unlock: %i", res);
 
-    g_list_free_full(f->tags, g_free);
+    g_array_free(f->regions, TRUE);
+    g_list_free(f->tags);
+    if (f->waiting)
+        g_queue_free(f->waiting);
+    g_list_free_full(f->aliases, g_free);
+    if (f->path != (gchar *) (f + 1))
+        g_free(f->path);
     g_free(f);
 }
 
-int mlockfile_lock(const gchar * path, struct mlockfile *f)
+/* Heap used by the entry, glib's own headers being estimated */
+gsize mlockfile_memory(const struct mlockfile *f)
+{
+    gsize total = malloc_usable_size((void *) f);
+    GList *a;
+
+    total += 2 * sizeof(gpointer) + sizeof(guint);     /* GArray */
+    if (f->regions->data)
+        total += malloc_usable_size(f->regions->data);
+    total += g_list_length(f->tags) * sizeof(GList);
+    if (f->waiting)
+        total += sizeof(GQueue);
+    for (a = f->aliases; a; a = a->next)
+        total += sizeof(GList) + malloc_usable_size(a->data);
+    if (f->path != (gchar *) (f + 1))
+        total += malloc_usable_size(f->path);
+    return (total);
+}
+
+size_t mlockregion_locked_size(const struct mlockregion *r)
+{
+    return (r->start + r->mmappedsize - r->offset);
+}
+
+static int mlockregion_release(struct mlockregion *r)
+{
+    if (munlock(r->mmapped, r->mmappedsize) < 0) {
+        g_critical("mlockregion_release: munlock: %s", strerror(errno));
+        return (-1);
+    }
+    if (munmap(r->mmapped, r->mmappedsize) < 0) {
+        g_critical("mlockregion_release: munmap: %s", strerror(errno));
+        return (-2);
+    }
+    return (0);
+}
+
+static struct mlockregion *mlockfile_find_region(struct mlockfile *f,
+                                                 off_t offset,
+                                                 size_t length, guint * idx)
+{
+    guint i;
+    struct mlockregion *r;
+
+    for (i = 0; i < f->regions->len; i++) {
+        r = &g_array_index(f->regions, struct mlockregion, i);
+        if (r->offset == offset && r->length == length) {
+            if (idx)
+                *idx = i;
+            return (r);
+        }
+    }
+    return (NULL);
+}
+
+static int mlock_onfault(void *addr, size_t len)
+{
+#if defined(MLOCK_ONFAULT)
+    return (mlock2(addr, len, MLOCK_ONFAULT));
+#elif defined(SYS_mlock2)
+    return (syscall(SYS_mlock2, addr, len, 1 /* MLOCK_ONFAULT */ ));
+#else
+    errno = ENOSYS;
+    return (-1);
+#endif
+}
+
+/*
+ * Pins pages of a mapping. mlock faults every page in before returning;
+ * with MLOCK_ONFAULT, pages only get pinned once something touches them,
+ * which suits large files read sparsely. MAP_LOCKED mappings are faulted
+ * in by mmap itself but do not report failures to lock, so they are still
+ * mlocked, which is cheap once pages are in. MADV_POPULATE_READ faults
+ * pages in before mlock, in larger batches on recent kernels.
+ */
+static int mlock_pages_serial(void *addr, size_t len, int strategy)
+{
+    switch (strategy) {
+    case MLOCK_STRATEGY_ONFAULT:
+        return (mlock_onfault(addr, len));
+    case MLOCK_STRATEGY_POPULATE:
+#ifdef MADV_POPULATE_READ
+        /* EINVAL on kernels without MADV_POPULATE_READ */
+        if (madvise(addr, len, MADV_POPULATE_READ) < 0 && errno != EINVAL)
+            g_warning("mlock_pages: madvise: %s", strerror(errno));
+#endif
+        return (mlock(addr, len));
+    default:
+        return (mlock(addr, len));
+    }
+}
+
+/*
+ * Large mappings can be faulted in by several threads at once: mlock only
+ * holds mmap_lock exclusively while it flags the pages, faulting them in
+ * under the shared lock, so chunks of a mapping locked concurrently are
+ * read from disk at a higher queue depth. Lock workers wait for their
+ * chunks; fault_pool threads never wait on anything.
+ */
+
+struct fault_run {
+    GMutex lock;
+    GCond done;
+    guint pending;              /* chunks */
+    int error;                  /* errno of the first failure, or 0 */
+    int strategy;
+};
+
+struct fault_chunk {
+    struct fault_run *run;
+    char *addr;
+    size_t len;
+};
+
+static GThreadPool *fault_pool = NULL;
+static size_t fault_chunk_size = 0;
+
+static void fault_chunk_done(struct fault_run *run, int error)
+{
+    g_mutex_lock(&run->lock);
+    if (error && !run->error)
+        run->error = error;
+    if (--run->pending == 0)
+        g_cond_signal(&run->done);
+    g_mutex_unlock(&run->lock);
+}
+
+static void fault_worker(gpointer data, gpointer ignored)
+{
+    struct fault_chunk *chunk = (struct fault_chunk *) data;
+    int ret = mlock_pages_serial(chunk->addr, chunk->len,
+                                 chunk->run->strategy);
+
+    fault_chunk_done(chunk->run, ret < 0 ? errno : 0);
+    g_free(chunk);
+}
+
+/* Splits mappings larger than chunk bytes across threads, 0 to disable */
+int mlock_parallel_init(guint threads, size_t chunk)
+{
+    GError *err = NULL;
+    long pagesize = sysconf(_SC_PAGESIZE);
+
+    if (threads < 2 || !chunk)
+        return (0);
+
+    fault_chunk_size = (chunk + pagesize - 1) / pagesize * pagesize;
+    fault_pool = g_thread_pool_new(fault_worker, NULL, threads, TRUE, &err);
+    if (!fault_pool) {
+        g_critical("mlock_parallel_init: g_thread_pool_new: %s",
+                   err->message);
+        g_error_free(err);
+        return (-1);
+    }
+    return (0);
+}
+
+static int mlock_pages_parallel(char *addr, size_t len, int strategy)
+{
+    struct fault_run run;
+    struct fault_chunk *chunk;
+    GError *err = NULL;
+    size_t offset;
+
+    g_mutex_init(&run.lock);
+    g_cond_init(&run.done);
+    run.pending = 1;            /* released once every chunk is queued */
+    run.error = 0;
+    run.strategy = strategy;
+
+    for (offset = 0; offset < len; offset += fault_chunk_size) {
+        chunk = g_new(struct fault_chunk, 1);
+        chunk->run = &run;
+        chunk->addr = addr + offset;
+        chunk->len = MIN(fault_chunk_size, len - offset);
+
+        g_mutex_lock(&run.lock);
+        run.pending++;
+        g_mutex_unlock(&run.lock);
+        if (!g_thread_pool_push(fault_pool, chunk, &err)) {
+            g_critical("mlock_pages_parallel: g_thread_pool_push: %s",
+                       err->message);
+            g_clear_error(&err);
+            fault_worker(chunk, NULL);
+        }
+    }
+    fault_chunk_done(&run, 0);
+
+    g_mutex_lock(&run.lock);
+    while (run.pending)
+        g_cond_wait(&run.done, &run.lock);
+    g_mutex_unlock(&run.lock);
+    g_mutex_clear(&run.lock);
+    g_cond_clear(&run.done);
+
+    if (run.error) {
+        errno = run.error;
+        return (-1);
+    }
+    return (0);
+}
+
+/*
+ * Nothing is read when pages are pinned on fault, and MAP_LOCKED mappings
+ * were faulted in by mmap, so both are left to a single call.
+ */
+static int mlock_pages(void *addr, size_t len, int strategy)
+{
+    if (fault_pool && len > fault_chunk_size &&
+        strategy != MLOCK_STRATEGY_ONFAULT &&
+        strategy != MLOCK_STRATEGY_MAP_LOCKED)
+        return (mlock_pages_parallel(addr, len, strategy));
+    return (mlock_pages_serial(addr, len, strategy));
+}
+
+/* Bytes of a range missing from the page cache, all of them if unknown */
+static size_t mlock_missing(char *addr, size_t len)
+{
+    long pagesize = sysconf(_SC_PAGESIZE);
+    char *start = addr - (gsize) addr % pagesize;
+    size_t pages = (addr + len - start + pagesize - 1) / pagesize;
+    size_t i, missing = 0;
+    unsigned char *vec = g_malloc(pages);
+
+    if (mincore(start, pages * pagesize, vec) < 0) {
+        g_warning("mlock_missing: mincore: %s", strerror(errno));
+        missing = len;
+    } else {
+        for (i = 0; i < pages; i++)
+            if (!(vec[i] & 1))
+                missing += pagesize;
+    }
+    g_free(vec);
+    return (MIN(missing, len));
+}
+
+/*
+ * Throttled mappings are locked by chunks, taking tokens for the pages of
+ * each chunk that are about to be read from disk. Pages pinned on fault
+ * and MAP_LOCKED mappings are not read here, and not paced.
+ */
+static int mlock_pages_throttled(char *addr, size_t len, int strategy,
+                                 struct throttle *throttle)
+{
+    size_t offset, chunk;
+
+    if (!throttle_active(throttle) || strategy == MLOCK_STRATEGY_ONFAULT ||
+        strategy == MLOCK_STRATEGY_MAP_LOCKED)
+        return (mlock_pages(addr, len, strategy));
+
+    for (offset = 0; offset < len; offset += chunk) {
+        chunk = MIN(THROTTLE_CHUNK, len - offset);
+        throttle_take(throttle, mlock_missing(addr + offset, chunk));
+        if (mlock_pages(addr + offset, chunk, strategy) < 0)
+            return (-1);
+    }
+    return (0);
+}
+
+/* Maps a grown region again elsewhere, its pages, resident already,
+ * being locked again before the tail */
+static int mlockregion_remap(int fd, struct mlockregion *r, size_t size,
+                             struct mlocktimes *times,
+                             struct throttle *throttle)
+{
+    long pagesize = sysconf(_SC_PAGESIZE);
+    size_t oldend = (r->mmappedsize + pagesize - 1) / pagesize * pagesize;
+    int ret, flags = MAP_SHARED | MAP_FILE;
+    char *mmapped;
+    gint64 started;
+
+    if (r->strategy == MLOCK_STRATEGY_MAP_LOCKED)
+        flags |= MAP_POPULATE | MAP_LOCKED;
+
+    started = g_get_monotonic_time();
+    mmapped = mmap(NULL, size, PROT_READ, flags, fd, r->start);
+    times->mmap += g_get_monotonic_time() - started;
+    if (mmapped == MAP_FAILED) {
+        g_critical("mlockregion_remap: mmap: %s", strerror(errno));
+        return (-3);
+    }
+
+    started = g_get_monotonic_time();
+    ret = mlock_pages(mmapped, oldend, r->strategy);
+    if (ret >= 0)
+        ret = mlock_pages_throttled(mmapped + oldend, size - oldend,
+                                    r->strategy, throttle);
+    times->mlock += g_get_monotonic_time() - started;
+    if (ret < 0) {
+        g_critical("mlockregion_remap: mlock: %s", strerror(errno));
+        if (munmap(mmapped, size) < 0)
+            g_critical("mlockregion_remap: munmap: %s", strerror(errno));
+        return (-4);
+    }
+
+    if (munmap(r->mmapped, r->mmappedsize) < 0)
+        g_critical("mlockregion_remap: munmap: %s", strerror(errno));
+    r->mmapped = mmapped;
+    r->mmappedsize = size;
+    return (0);
+}
+
+/*
+ * Grows or shrinks a locked region, only (un)locking the difference. The
+ * mapping being locked, mremap would fault a grown tail in by itself,
+ * unthrottled and on a single thread: the tail is mapped on its own right
+ * after the region and locked like a new mapping instead, unless that
+ * address is taken and the region gets mapped again.
+ */
+static int mlockregion_resize(const gchar * path, int fd,
+                              struct mlockregion *r, size_t size,
+                              struct mlocktimes *times,
+                              struct throttle *throttle)
+{
+    long pagesize = sysconf(_SC_PAGESIZE);
+    size_t oldend = (r->mmappedsize + pagesize - 1) / pagesize * pagesize;
+    size_t end = (size + pagesize - 1) / pagesize * pagesize;
+    char *tail, *wanted = (char *) r->mmapped + oldend;
+    int ret, flags = MAP_SHARED | MAP_FILE;
+    gint64 started;
+
+    /* Shrinking, or growing within the last page, which is mapped */
+    if (end <= oldend) {
+        if (end < oldend &&
+            munmap((char *) r->mmapped + end, oldend - end) < 0) {
+            g_critical("mlockregion_resize: munmap: %s", strerror(errno));
+            return (-3);
+        }
+        r->mmappedsize = size;
+        g_debug("relocked %s (%li bytes)", path, (long) size);
+        return (0);
+    }
+
+    if (r->strategy == MLOCK_STRATEGY_MAP_LOCKED)
+        flags |= MAP_POPULATE | MAP_LOCKED;
+
+    /* Only a hint, the tail may land elsewhere */
+    started = g_get_monotonic_time();
+    tail = mmap(wanted, end - oldend, PROT_READ, flags, fd,
+                r->start + oldend);
+    times->mmap += g_get_monotonic_time() - started;
+    if (tail != MAP_FAILED && tail != wanted) {
+        if (munmap(tail, end - oldend) < 0)
+            g_critical("mlockregion_resize: munmap: %s", strerror(errno));
+        tail = MAP_FAILED;
+    }
+    if (tail == MAP_FAILED) {
+        g_debug("mlockregion_resize: mapping %s again", path);
+        ret = mlockregion_remap(fd, r, size, times, throttle);
+    } else {
+        started = g_get_monotonic_time();
+        ret = mlock_pages_throttled(tail, end - oldend, r->strategy,
+                                    throttle);
+        times->mlock += g_get_monotonic_time() - started;
+        if (ret < 0) {
+            g_critical("mlockregion_resize: mlock: %s", strerror(errno));
+            if (munmap(tail, end - oldend) < 0)
+                g_critical("mlockregion_resize: munmap: %s",
+                           strerror(errno));
+            return (-4);
+        }
+        r->mmappedsize = size;
+    }
+    if (ret < 0)
+        return (ret);
+
+    g_debug("relocked %s (%li bytes)", path, (long) size);
+    return (0);
+}
+
+/* Size of the mapping locking a range of a file of filesize bytes */
+size_t mlockfile_range_size(off_t filesize, off_t offset, size_t length)
+{
+    off_t start = offset - offset % sysconf(_SC_PAGESIZE);
+    off_t end = filesize;
+
+    if (offset < 0 || offset >= filesize)
+        return (0);
+    if (length && (off_t) length < filesize - offset)
+        end = offset + length;
+    return (end - start);
+}
+
+int mlockfile_lock(const gchar * path, struct mlockfile *f, int strategy)
+{
+    return (mlockfile_lock_range(path, f, 0, 0, strategy));
+}
+
+int mlockfile_lock_range(const gchar * path, struct mlockfile *f,
+                         off_t offset, size_t length, int strategy)
 {
     struct stat stats;
+    struct mlockregion *found, region;
     char *mmapped;
+    off_t start;
+    size_t size;
+    gint64 started;
+    guint idx;
+    int ret, flags = MAP_SHARED | MAP_FILE;
 
     if (f->fd < 0) {
+        started = g_get_monotonic_time();
         f->fd = open(path, O_RDONLY);
+        f->times.open += g_get_monotonic_time() - started;
         if (f->fd < 0) {
             g_critical("mlockfile_lock: open: %s", strerror(errno));
             return (-1);
@@ -45,49 +498,105 @@ int mlockfile_lock(const gchar * path, struct mlockfile *f)
         g_critical("mlockfile_lock: stat: %s", strerror(errno));
         return (-2);
     }
+    f->dev = stats.st_dev;
+    f->ino = stats.st_ino;
+    f->size = stats.st_size;
+
+    if (offset < 0 || offset >= stats.st_size) {
+        g_critical("mlockfile_lock: offset %li beyond the end of %s",
+                   (long) offset, path);
+        return (-5);
+    }
 
-    mmapped = mmap(NULL, stats.st_size,
-                   PROT_READ, MAP_SHARED | MAP_FILE, f->fd, (off_t) 0);
+    start = offset - offset % sysconf(_SC_PAGESIZE);
+    size = mlockfile_range_size(stats.st_size, offset, length);
+
+    found = mlockfile_find_region(f, offset, length, &idx);
+    if (found && found->strategy != strategy) {
+        /* Locked differently, mapped again from scratch */
+        if (mlockregion_release(found) < 0)
+            return (-6);
+        f->mmappedsize -= found->mmappedsize;
+        g_array_remove_index_fast(f->regions, idx);
+        found = NULL;
+    }
+    if (found) {
+        if (found->mmappedsize == size) {
+            g_debug("%s unchanged (%li bytes)", path, (long) size);
+            return (0);
+        }
+        f->mmappedsize -= found->mmappedsize;
+        ret = mlockregion_resize(path, f->fd, found, size, &f->times,
+                                 f->throttle);
+        f->mmappedsize += found->mmappedsize;
+        return (ret);
+    }
+
+    if (strategy == MLOCK_STRATEGY_MAP_LOCKED)
+        flags |= MAP_POPULATE | MAP_LOCKED;
+
+    started = g_get_monotonic_time();
+    mmapped = mmap(NULL, size, PROT_READ, flags, f->fd, start);
+    f->times.mmap += g_get_monotonic_time() - started;
     if (mmapped == MAP_FAILED) {
         g_critical("mlockfile_lock: mmap: %s", strerror(errno));
         return (-3);
     }
 
-    if (mlock(mmapped, stats.st_size) < 0) {
+    started = g_get_monotonic_time();
+    ret = mlock_pages_throttled(mmapped, size, strategy, f->throttle);
+    f->times.mlock += g_get_monotonic_time() - started;
+    if (ret < 0) {
         g_critical("mlockfile_lock: mlock: %s", strerror(errno));
-        if (munmap(mmapped, stats.st_size) < 0)
+        if (munmap(mmapped, size) < 0)
             g_critical("mlockfile_lock: mlock failure: munmap: ");
         return (-4);
     }
 
-    if (f->mmapped) {
-        g_debug("relocked %s (%li -> %li bytes)",
-                path, (long) f->mmappedsize, (long) stats.st_size);
-        if (munlock(f->mmapped, f->mmappedsize) < 0)
-            g_critical("mlockfile_lock: munlock: %s", strerror(errno));
-        if (munmap(f->mmapped, f->mmappedsize) < 0)
-            g_critical("mlockfile_lock: munmap: %s", strerror(errno));
-    }
+    region.offset = offset;
+    region.length = length;
+    region.start = start;
+    region.mmapped = mmapped;
+    region.mmappedsize = size;
+    region.strategy = strategy;
+    g_array_append_val(f->regions, region);
 
-    f->mmapped = mmapped;
-    f->mmappedsize = stats.st_size;
+    f->mmappedsize += size;
 
     return (0);
 }
 
+/* Returns 1 when no such region is locked */
+int mlockfile_unlock_range(struct mlockfile *f, off_t offset, size_t length)
+{
+    guint idx;
+    int ret;
+    struct mlockregion *r = mlockfile_find_region(f, offset, length, &idx);
+
+    if (!r)
+        return (1);
+
+    if ((ret = mlockregion_release(r)) < 0)
+        return (ret);
+
+    f->mmappedsize -= r->mmappedsize;
+    g_array_remove_index_fast(f->regions, idx);
+    return (0);
+}
+
 int mlockfile_unlock(struct mlockfile *f)
 {
-    if (f->mmapped) {
-        if (munlock(f->mmapped, f->mmappedsize) < 0) {
-            g_critical("mlockfile_unlock: munlock: %s", strerror(errno));
+    struct mlockregion *r;
+
+    while (f->regions->len > 0) {
+        r = &g_array_index(f->regions, struct mlockregion,
+                           f->regions->len - 1);
+        if (mlockregion_release(r) < 0) {
+            g_critical("mlockfile_unlock: could not release region");
             return (-1);
         }
-        if (munmap(f->mmapped, f->mmappedsize) < 0) {
-            g_critical("mlockfile_unlock: munmap: %s", strerror(errno));
-            return (-2);
-        }
-
-        f->mmapped = NULL;
+        f->mmappedsize -= r->mmappedsize;
+        g_array_set_size(f->regions, f->regions->len - 1);
     }
     if (f->fd > -1) {
         if (close(f->fd) < 0) {
@@ -2,17 +2,78 @@
 #define PCMA__MLOCKFILE_H
 
 #include <glib.h>
+#include <sys/types.h>
+
+struct throttle;
+
+#define DEFAULT_FAULT_CHUNK "256M"   /* see mlock_parallel_init */
+
+/* How pages get pinned, see mlock_pages */
+enum mlock_strategy {
+    MLOCK_STRATEGY_MLOCK,       /* mlock, faulting every page in */
+    MLOCK_STRATEGY_ONFAULT,     /* pinned once touched, MLOCK_ONFAULT */
+    MLOCK_STRATEGY_MAP_LOCKED,  /* faulted in by mmap, MAP_LOCKED */
+    MLOCK_STRATEGY_POPULATE,    /* MADV_POPULATE_READ, then mlock */
+    MLOCK_STRATEGIES
+};
+
+struct mlockregion {
+    off_t offset;               /* as requested */
+    size_t length;              /* as requested, 0 up to the end of the file */
+    off_t start;                /* page-aligned offset of the mapping */
+    void *mmapped;
+    size_t mmappedsize;
+    int strategy;               /* enum mlock_strategy */
+};
+
+/* Time spent in system calls while locking, in microseconds */
+struct mlocktimes {
+    guint64 open;
+    guint64 mmap;               /* MAP_LOCKED faults included */
+    guint64 mlock;
+};
 
 struct mlockfile {
     int fd;
-    size_t mmappedsize;
-    void *mmapped;
-    GList *tags;
+    dev_t dev;                  /* identity and size of the file locked, */
+    ino_t ino;                  /* as of the last lock */
+    off_t size;
+    size_t mmappedsize;         /* sum over all regions */
+    GArray *regions;            /* struct mlockregion */
+    GList *tags;                /* interned, see tags.h */
+    size_t charged;             /* bytes accounted in the budget */
+    struct mlocktimes times;    /* by the lock worker, on its copy */
+    struct throttle *throttle;  /* pacing the lock worker, on its copy */
+
+    /* Set while a lock worker owns the mapping; the fields above are then
+     * only updated once the worker hands its results back. */
+    gboolean busy;
+    /* Set when the file was unlocked while busy, so that it is destroyed
+     * by whoever completes the pending lock. */
+    gboolean detached;
+    /* Lock requests waiting for the busy one to complete. */
+    GQueue *waiting;
+
+    /* Other paths to the same inode, keys in lockaliases */
+    GList *aliases;
+    /* Key in lockfiles, allocated along unless taken over from an alias */
+    gchar *path;
 };
 
-struct mlockfile *mlockfile_init();
-int mlockfile_lock(const gchar * filename, struct mlockfile *f);
+struct mlockfile *mlockfile_init(const gchar * path);
+int mlock_parallel_init(guint threads, size_t chunk);
+void mlockfile_copy(struct mlockfile *dst, const struct mlockfile *src);
+int mlock_strategy_parse(const gchar * name, gsize len);
+const gchar *mlock_strategy_name(int strategy);
+int mlockfile_lock(const gchar * filename, struct mlockfile *f,
+                   int strategy);
+int mlockfile_lock_range(const gchar * filename, struct mlockfile *f,
+                         off_t offset, size_t length, int strategy);
 int mlockfile_unlock(struct mlockfile *f);
+int mlockfile_unlock_range(struct mlockfile *f, off_t offset, size_t length);
+size_t mlockfile_range_size(off_t filesize, off_t offset, size_t length);
+gsize mlockfile_memory(const struct mlockfile *f);
+size_t mlockregion_locked_size(const struct mlockregion *r);
 void mlockfile_destroy(gpointer f);
 
 #endif                          /* PCMA__MLOCKFILE_H */
@@ -0,0 +1,82 @@
+#ifndef PCMA__PCMA_H
+#define PCMA__PCMA_H
+
+#include <msgpack.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * libpcma, the pcma client library, see libpcma(3).
+ *
+ * A connection keeps its socket open across requests, and any number of
+ * requests may be outstanding on it: every one gets an ID, and its callback
+ * is called with the matching reply from pcma_dispatch or pcma_wait.
+ * A connection is not thread-safe.
+ */
+
+struct pcma_conn;
+struct pcma_reply;
+
+struct pcma_range {
+    uint64_t offset;
+    uint64_t length;            /* 0 up to the end of the file */
+};
+
+/* A locked file, as in list and lock replies */
+struct pcma_file {
+    char *path;                 /* NULL when decoded from a lock reply */
+    uint64_t fd;
+    uint64_t size;
+    char **tags;                /* NULL-terminated */
+    struct pcma_range *ranges;
+    size_t nranges;
+    char **aliases;             /* NULL-terminated */
+};
+
+/* Called with the reply, which it should free with pcma_reply_free */
+typedef void (*pcma_callback) (struct pcma_reply * reply, void *data);
+
+struct pcma_conn *pcma_connect(const char *endpoint);
+void pcma_disconnect(struct pcma_conn *conn);
+unsigned int pcma_pending(const struct pcma_conn *conn);
+
+int pcma_request(struct pcma_conn *conn,
+                 int (*pack_fn) (msgpack_packer *, void *), void *pack_data,
+                 pcma_callback callback, void *data, uint32_t * id);
+int pcma_command(struct pcma_conn *conn, const char *command,
+                 const char *argument, pcma_callback callback, void *data);
+int pcma_lock(struct pcma_conn *conn, const char *path,
+              const char *const *tags, const struct pcma_range *ranges,
+              size_t nranges, const char *strategy,
+              pcma_callback callback, void *data);
+int pcma_unlock(struct pcma_conn *conn, const char *path,
+                const struct pcma_range *range,
+                pcma_callback callback, void *data);
+
+int pcma_dispatch(struct pcma_conn *conn, long timeout);
+int pcma_wait(struct pcma_conn *conn, long timeout);
+struct pcma_reply *pcma_call(struct pcma_conn *conn,
+                             int (*pack_fn) (msgpack_packer *, void *),
+                             void *pack_data, long timeout);
+
+uint32_t pcma_reply_id(const struct pcma_reply *reply);
+int pcma_reply_ok(const struct pcma_reply *reply);
+const char *pcma_reply_error(const struct pcma_reply *reply);
+const msgpack_object *pcma_reply_value(const struct pcma_reply *reply,
+                                       unsigned int index);
+unsigned int pcma_reply_parts(const struct pcma_reply *reply);
+const msgpack_object *pcma_reply_part(const struct pcma_reply *reply,
+                                      unsigned int index);
+void pcma_reply_free(struct pcma_reply *reply);
+
+const msgpack_object *pcma_decode_result(const msgpack_object * obj,
+                                         int *ok, char **error);
+int pcma_decode_counts(const msgpack_object * obj, uint64_t * counts,
+                       size_t ncounts);
+int pcma_decode_file(const msgpack_object * obj, struct pcma_file *file);
+int pcma_decode_files(const msgpack_object * obj, struct pcma_file **files,
+                      size_t *nfiles);
+void pcma_file_clear(struct pcma_file *file);
+void pcma_files_free(struct pcma_file *files, size_t nfiles);
+
+#endif                          /* PCMA__PCMA_H */
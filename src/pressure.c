@@ -0,0 +1,115 @@
+#include <glib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include "common.h"
+#include "pressure.h"
+
+/*
+ * Memory pressure is watched through a PSI trigger on /proc/pressure/memory,
+ * which becomes readable with POLLPRI whenever tasks stalled on memory for
+ * longer than the threshold within a window, at most once per window. A
+ * thread waits on it and notifies the main thread of every trigger, and
+ * of every calm period going by without one.
+ *
+ * Tags carry priorities, 0 unless set; a file is as important as its most
+ * important tag. Priorities are only used by the main thread.
+ */
+
+static int psi_fd = -1;
+static guint calm_ms = DEFAULT_PRESSURE_CALM;
+static void (*pressure_notify) (gboolean high) = NULL;
+static GHashTable *priorities = NULL;   /* tag -> GINT_TO_POINTER */
+
+static gpointer pressure_thread(gpointer ignored)
+{
+    struct pollfd pfd;
+    int ret;
+
+    pfd.fd = psi_fd;
+    pfd.events = POLLPRI;
+    for (;;) {
+        ret = poll(&pfd, 1, calm_ms);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0) {
+            g_critical("pressure_thread: poll: %s", strerror(errno));
+            break;
+        }
+        if (ret == 0) {
+            pressure_notify(FALSE);
+        } else if (pfd.revents & POLLERR) {
+            g_critical("pressure_thread: the PSI monitor went away");
+            break;
+        } else if (pfd.revents & POLLPRI) {
+            pressure_notify(TRUE);
+        }
+    }
+    return (NULL);
+}
+
+/* Calls notify(TRUE) from another thread when tasks stalled on memory for
+ * more than stall ms within window ms, notify(FALSE) after calm ms
+ * without that happening; 0 keeps the default calm period */
+int pressure_init(guint stall, guint window, guint calm,
+                  void (*notify) (gboolean high))
+{
+    GError *err = NULL;
+    gchar *trigger;
+    int ret = 0;
+
+    if (calm)
+        calm_ms = calm;
+    pressure_notify = notify;
+
+    if ((psi_fd = open(PSI_MEMORY, O_RDWR | O_NONBLOCK)) < 0) {
+        g_critical("pressure_init: open(%s): %s", PSI_MEMORY,
+                   strerror(errno));
+        return (-1);
+    }
+
+    trigger = g_strdup_printf("some %u %u", stall * 1000, window * 1000);
+    if (write(psi_fd, trigger, strlen(trigger) + 1) < 0) {
+        g_critical("pressure_init: write(%s): %s", trigger,
+                   strerror(errno));
+        ret = -2;
+    }
+    g_free(trigger);
+    if (ret < 0)
+        return (ret);
+
+    if (!g_thread_try_new("pressure", pressure_thread, NULL, &err)) {
+        g_critical("pressure_init: g_thread_try_new: %s", err->message);
+        g_error_free(err);
+        return (-3);
+    }
+    return (0);
+}
+
+void pressure_set_priority(const gchar * tag, gint priority)
+{
+    if (!priorities)
+        priorities = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                           g_free, NULL);
+    g_hash_table_insert(priorities, g_strdup(tag),
+                        GINT_TO_POINTER(priority));
+}
+
+/* Priority of a file with those tags */
+gint pressure_priority(GList * tags)
+{
+    gint best = 0, priority;
+    gboolean first = TRUE;
+    GList *t;
+
+    for (t = tags; t; t = t->next) {
+        priority = priorities ?
+            GPOINTER_TO_INT(g_hash_table_lookup(priorities, t->data)) : 0;
+        if (first || priority > best)
+            best = priority;
+        first = FALSE;
+    }
+    return (best);
+}
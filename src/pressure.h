@@ -0,0 +1,14 @@
+#ifndef PCMA__PRESSURE_H
+#define PCMA__PRESSURE_H
+
+#include <glib.h>
+
+#define PSI_MEMORY "/proc/pressure/memory"
+#define DEFAULT_PRESSURE_CALM 30000     /* ms, see pressure_init */
+
+int pressure_init(guint stall, guint window, guint calm,
+                  void (*notify) (gboolean high));
+void pressure_set_priority(const gchar * tag, gint priority);
+gint pressure_priority(GList * tags);
+
+#endif                          /* PCMA__PRESSURE_H */
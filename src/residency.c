@@ -0,0 +1,152 @@
+#include <glib.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "common.h"
+#include "residency.h"
+
+/* mincore() is called on windows of this many pages */
+#define RESIDENCY_WINDOW (1 << 18)
+
+#define ONES 0x0101010101010101ULL
+
+/*
+ * Counts resident pages in a mincore() vector, where only the lowest bit
+ * of each byte is meaningful. Bytes are summed 8 at a time in the lanes of
+ * a 64-bit accumulator, which is folded before any lane can overflow; the
+ * inner loop gets vectorized by the compiler.
+ */
+size_t residency_count(const unsigned char *vec, size_t len)
+{
+    size_t i = 0, count = 0;
+    uint64_t w, acc;
+    int j;
+
+    while (i + 8 <= len) {
+        acc = 0;
+        for (j = 0; j < 255 && i + 8 <= len; j++, i += 8) {
+            memcpy(&w, vec + i, 8);
+            acc += w & ONES;
+        }
+        acc = (acc & 0x00ff00ff00ff00ffULL) + ((acc >> 8) &
+                                                0x00ff00ff00ff00ffULL);
+        count += (acc * 0x0001000100010001ULL) >> 48;
+    }
+
+    for (; i < len; i++)
+        count += vec[i] & 1;
+
+    return (count);
+}
+
+static void runs_extend(GArray * runs, gboolean resident, guint64 pages)
+{
+    guint64 zero = 0;
+
+    /* Odd runs are non-resident */
+    if ((runs->len % 2 == 1) != resident)
+        g_array_append_val(runs, zero);
+
+    g_array_index(runs, guint64, runs->len - 1) += pages;
+}
+
+/* Appends the runs of a mincore() vector, skipping whole words when all
+ * their pages are in the same state */
+void residency_runs(const unsigned char *vec, size_t len, GArray * runs)
+{
+    size_t i = 0;
+    uint64_t w;
+
+    if (runs->len == 0)
+        runs_extend(runs, TRUE, 0);
+
+    while (i < len) {
+        if (i + 8 <= len) {
+            memcpy(&w, vec + i, 8);
+            w &= ONES;
+            if (w == 0 || w == ONES) {
+                runs_extend(runs, w == ONES, 8);
+                i += 8;
+                continue;
+            }
+        }
+        runs_extend(runs, vec[i] & 1, 1);
+        i++;
+    }
+}
+
+int residency_file(const gchar * path, struct residency *r,
+                   gboolean with_runs)
+{
+    struct stat stats;
+    long pagesize = sysconf(_SC_PAGESIZE);
+    size_t pages, offset, window;
+    unsigned char *vec;
+    char *mmapped;
+    int fd, ret = 0;
+
+    memset(r, 0, sizeof(*r));
+    if (with_runs)
+        r->runs = g_array_new(FALSE, FALSE, sizeof(guint64));
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        g_warning("residency_file: open(%s): %s", path, strerror(errno));
+        return (-1);
+    }
+
+    if (fstat(fd, &stats) < 0) {
+        g_warning("residency_file: fstat: %s", strerror(errno));
+        close(fd);
+        return (-2);
+    }
+
+    r->size = stats.st_size;
+    if (r->size == 0) {
+        close(fd);
+        return (0);
+    }
+
+    mmapped = mmap(NULL, r->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mmapped == MAP_FAILED) {
+        g_warning("residency_file: mmap: %s", strerror(errno));
+        return (-3);
+    }
+
+    pages = (r->size + pagesize - 1) / pagesize;
+    vec = g_malloc(MIN(pages, RESIDENCY_WINDOW));
+
+    for (offset = 0; offset < pages; offset += window) {
+        window = MIN(pages - offset, RESIDENCY_WINDOW);
+        if (mincore(mmapped + offset * pagesize,
+                    MIN(window * pagesize, r->size - offset * pagesize),
+                    vec) < 0) {
+            g_warning("residency_file: mincore: %s", strerror(errno));
+            ret = -4;
+            break;
+        }
+        r->resident += residency_count(vec, window) * pagesize;
+        if (with_runs)
+            residency_runs(vec, window, r->runs);
+    }
+
+    /* The last page may be partial */
+    if (r->resident > r->size)
+        r->resident = r->size;
+
+    g_free(vec);
+    if (munmap(mmapped, r->size) < 0)
+        g_warning("residency_file: munmap: %s", strerror(errno));
+
+    return (ret);
+}
+
+void residency_clear(struct residency *r)
+{
+    if (r->runs)
+        g_array_free(r->runs, TRUE);
+    r->runs = NULL;
+}
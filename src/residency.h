@@ -0,0 +1,20 @@
+#ifndef PCMA__RESIDENCY_H
+#define PCMA__RESIDENCY_H
+
+#include <glib.h>
+
+struct residency {
+    size_t size;                /* bytes */
+    size_t resident;            /* bytes */
+    /* Page counts of alternating resident and non-resident runs, starting
+     * with a resident one, NULL unless requested */
+    GArray *runs;
+};
+
+size_t residency_count(const unsigned char *vec, size_t len);
+void residency_runs(const unsigned char *vec, size_t len, GArray * runs);
+int residency_file(const gchar * path, struct residency *r,
+                   gboolean with_runs);
+void residency_clear(struct residency *r);
+
+#endif                          /* PCMA__RESIDENCY_H */
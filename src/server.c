@@ -1,15 +1,29 @@
 #include <glib.h>
 #include <glib/gprintf.h>
+#include <dirent.h>
+#include <fcntl.h>
 #include <msgpack.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <zmq.h>
+#include "advise.h"
+#include "budget.h"
 #include "common.h"
+#include "events.h"
 #include "server.h"
+#include "metrics.h"
 #include "mlockfile.h"
+#include "pressure.h"
+#include "residency.h"
+#include "state.h"
+#include "tags.h"
+#include "throttle.h"
+#include "warm.h"
+#include "watch.h"
 
 void lockfile_print_tag(gpointer data, gpointer user_data)
 {
@@ -24,12 +38,28 @@ void lockfile_print(gpointer key, gpointer value, gpointer user_data)
     const gchar *name = (const gchar *) key;
     struct mlockfile *f = (struct mlockfile *) value;
 
+    struct mlockregion *r;
+    guint i;
+
+    if (!f->regions->len)
+        return;
+
     if (g_printf
         ("%s, %li bytes, fd: %i, tags: ", name, (long) f->mmappedsize, f->fd) < 0)
         g_critical(errmsg, strerror(errno));
 
     g_list_foreach(f->tags, lockfile_print_tag, NULL);
 
+    if (g_printf(", regions: ") < 0)
+        g_critical(errmsg, strerror(errno));
+
+    for (i = 0; i < f->regions->len; i++) {
+        r = &g_array_index(f->regions, struct mlockregion, i);
+        if (g_printf("%li+%li ", (long) r->offset,
+                     (long) mlockregion_locked_size(r)) < 0)
+            g_critical(errmsg, strerror(errno));
+    }
+
     if (g_printf("\n") < 0)
         g_critical(errmsg, strerror(errno));
 }
@@ -49,11 +79,25 @@ void lockfiles_print(GHashTable * lockfiles)
 
 void mlockfile_pack(msgpack_packer * pk, struct mlockfile *f)
 {
-    msgpack_pack_array(pk, 3);
+    struct mlockregion *r;
+    guint i;
+
+    msgpack_pack_array(pk, 5);
     msgpack_pack_uint64(pk, f->fd);
     msgpack_pack_uint64(pk, f->mmappedsize);
     msgpack_pack_array(pk, g_list_length(f->tags));
     g_list_foreach(f->tags, string_pack, pk);
+
+    msgpack_pack_array(pk, f->regions->len);
+    for (i = 0; i < f->regions->len; i++) {
+        r = &g_array_index(f->regions, struct mlockregion, i);
+        msgpack_pack_array(pk, 2);
+        msgpack_pack_uint64(pk, r->offset);
+        msgpack_pack_uint64(pk, mlockregion_locked_size(r));
+    }
+
+    msgpack_pack_array(pk, g_list_length(f->aliases));
+    g_list_foreach(f->aliases, string_pack, pk);
 }
 
 int mlockfile_packfn(msgpack_packer * pk, void *lockfile)
@@ -65,245 +109,3177 @@ int mlockfile_packfn(msgpack_packer * pk, void *lockfile)
     return (0);
 }
 
-void lockfiles_entry_packfn(gpointer key, gpointer value,
-                            gpointer user_data)
+void budget_usage_pack(msgpack_packer * pk,
+                       const struct budget_usage *usage)
 {
-    const gchar *name = (const gchar *) key;
-    struct mlockfile *lockfile = (struct mlockfile *) value;
+    msgpack_pack_array(pk, 3);
+    msgpack_pack_uint64(pk, usage->limit);
+    msgpack_pack_uint64(pk, usage->used);
+    msgpack_pack_uint64(pk, usage->reserved);
+}
+
+void budget_tag_packfn(gpointer key, gpointer value, gpointer user_data)
+{
+    const gchar *tag = (const gchar *) key;
     msgpack_packer *pk = (msgpack_packer *) user_data;
-    int namelen = strlen(name);
+    int taglen = strlen(tag);
 
-    msgpack_pack_raw(pk, namelen);
-    msgpack_pack_raw_body(pk, name, namelen);
+    msgpack_pack_raw(pk, taglen);
+    msgpack_pack_raw_body(pk, tag, taglen);
+    budget_usage_pack(pk, (struct budget_usage *) value);
+}
 
-    mlockfile_pack(pk, lockfile);
+void budget_pack(msgpack_packer * pk)
+{
+    const struct budget_usage *global = budget_global();
+
+    msgpack_pack_array(pk, 4);
+    msgpack_pack_uint64(pk, global->limit);
+    msgpack_pack_uint64(pk, global->used);
+    msgpack_pack_uint64(pk, global->reserved);
+    msgpack_pack_map(pk, budget_tag_count());
+    budget_foreach_tag(budget_tag_packfn, pk);
+}
+
+gint lockpaths_cmp(gconstpointer a, gconstpointer b, gpointer ignored)
+{
+    return (strcmp((const gchar *) a, (const gchar *) b));
+}
+
+/* Pages through lockpaths, so that a page costs O(log(n) + page size) */
+struct list_query {
+    gchar *cursor;              /* list paths sorting after this one */
+    gchar *prefix;
+    gchar *tag;
+    guint64 limit;              /* entries per page, 0 for all */
+    guint64 stream;             /* entries per frame, 0 for a single one */
+    GSequenceIter *iter;
+    guint64 listed;
+    const gchar *last;          /* last path listed */
+    gboolean truncated;         /* more entries after the page */
+    GPtrArray *paths;           /* in the current frame */
+};
+
+void list_query_start(struct list_query *q)
+{
+    gchar *from = q->cursor;
+
+    if (q->prefix && (!from || strcmp(q->prefix, from) > 0))
+        from = q->prefix;
+    if (from)
+        q->iter = g_sequence_search(lockpaths, from, lockpaths_cmp, NULL);
+    else
+        q->iter = g_sequence_get_begin_iter(lockpaths);
+    q->paths = g_ptr_array_new();
+}
+
+const gchar *list_query_next(struct list_query *q)
+{
+    const gchar *path;
+    struct mlockfile *file;
+
+    while (!g_sequence_iter_is_end(q->iter)) {
+        path = g_sequence_get(q->iter);
+        if (q->prefix && !g_str_has_prefix(path, q->prefix))
+            break;
+        q->iter = g_sequence_iter_next(q->iter);
+
+        if (q->cursor && strcmp(path, q->cursor) <= 0)
+            continue;
+        file = g_hash_table_lookup(lockfiles, path);
+        /* First locks still in flight are not reported */
+        if (!file->regions->len)
+            continue;
+        if (q->tag && !g_list_find_custom(file->tags, q->tag, g_strcmp0))
+            continue;
+
+        if (q->limit && q->listed == q->limit) {
+            q->truncated = TRUE;
+            break;
+        }
+        q->listed++;
+        q->last = path;
+        return (path);
+    }
+    return (NULL);
+}
+
+/* Collects the next paths into q->paths, at most max of them if not 0 */
+void list_query_fill(struct list_query *q, guint64 max)
+{
+    const gchar *path;
+
+    g_ptr_array_set_size(q->paths, 0);
+    while ((!max || q->paths->len < max) && (path = list_query_next(q)))
+        g_ptr_array_add(q->paths, (gpointer) path);
+}
+
+void list_query_clear(struct list_query *q)
+{
+    free(q->cursor);
+    free(q->prefix);
+    free(q->tag);
+    if (q->paths)
+        g_ptr_array_free(q->paths, TRUE);
+}
+
+int list_frame_packfn(msgpack_packer * pk, void *lq)
+{
+    struct list_query *q = (struct list_query *) lq;
+    const gchar *path;
+    guint i;
+
+    msgpack_pack_map(pk, q->paths->len);
+    for (i = 0; i < q->paths->len; i++) {
+        path = g_ptr_array_index(q->paths, i);
+        string_pack((gpointer) path, pk);
+        mlockfile_pack(pk, g_hash_table_lookup(lockfiles, path));
+    }
+    return (0);
+}
+
+void list_next_pack(msgpack_packer * pk, struct list_query *q)
+{
+    if (q->truncated)
+        string_pack((gpointer) q->last, pk);
+    else
+        msgpack_pack_nil(pk);
+}
+
+int list_packfn(msgpack_packer * pk, void *lq)
+{
+    struct list_query *q = (struct list_query *) lq;
+
+    msgpack_pack_array(pk, 4);
+    msgpack_pack_true(pk);
+    list_frame_packfn(pk, q);
+    budget_pack(pk);
+    list_next_pack(pk, q);
+    return (0);
+}
+
+/* Last frame of a streamed list */
+int list_status_packfn(msgpack_packer * pk, void *lq)
+{
+    struct list_query *q = (struct list_query *) lq;
+
+    msgpack_pack_array(pk, 3);
+    msgpack_pack_true(pk);
+    budget_pack(pk);
+    list_next_pack(pk, q);
+    return (0);
+}
+
+int failed_packfn(msgpack_packer * pk, void *msg)
+{
+    size_t msg_length = strlen((char *) msg);
+
+    msgpack_pack_array(pk, 2);
+    msgpack_pack_false(pk);
+
+    msgpack_pack_raw(pk, msg_length);
+    msgpack_pack_raw_body(pk, msg, msg_length);
+    return (0);
+}
+
+int string_packfn(msgpack_packer * pk, void *str)
+{
+    string_pack(str, pk);
+    return (0);
+}
+
+/* Microseconds a lock worker spent opening, mapping and locking */
+int lock_times_packfn(msgpack_packer * pk, void *lt)
+{
+    struct mlocktimes *times = (struct mlocktimes *) lt;
+
+    msgpack_pack_array(pk, 3);
+    msgpack_pack_uint64(pk, times->open);
+    msgpack_pack_uint64(pk, times->mmap);
+    msgpack_pack_uint64(pk, times->mlock);
+    return (0);
+}
+
+int empty_ok_packfn(msgpack_packer * pk, void *ignored)
+{
+    msgpack_pack_array(pk, 1);
+    msgpack_pack_true(pk);
+    return (0);
+}
+
+/* Packs a reply into a buffer, to be embedded in a batch reply */
+msgpack_sbuffer *packed_new(int (*pack_fn) (msgpack_packer *, void *),
+                            void *data)
+{
+    msgpack_sbuffer *buffer = msgpack_sbuffer_new();
+    msgpack_packer pk;
+
+    msgpack_packer_init(&pk, buffer, msgpack_sbuffer_write);
+    pack_fn(&pk, data);
+    return (buffer);
+}
+
+GPtrArray *packed_list_new(guint len)
+{
+    GPtrArray *list = g_ptr_array_new_with_free_func((GDestroyNotify)
+                                                     msgpack_sbuffer_free);
+    g_ptr_array_set_size(list, len);
+    return (list);
 }
 
-int lockfiles_packfn(msgpack_packer * pk, void *lf)
+/* Packs [true, [reply, ...]] from a list of packed replies */
+int packed_list_packfn(msgpack_packer * pk, void *pl)
 {
-    GHashTable *lockfiles = (GHashTable *) lf;
+    GPtrArray *list = (GPtrArray *) pl;
+    msgpack_sbuffer *buffer;
+    guint i;
 
     msgpack_pack_array(pk, 2);
+    msgpack_pack_true(pk);
+    msgpack_pack_array(pk, list->len);
+    for (i = 0; i < list->len; i++) {
+        buffer = g_ptr_array_index(list, i);
+        pk->callback(pk->data, buffer->data, buffer->size);
+    }
+    return (0);
+}
+
+struct pcma_client {
+    /* Routing frames from the ROUTER socket, empty delimiter included */
+    GPtrArray *envelope;
+    gboolean replying;          /* envelope sent */
+    int command;                /* ID, 0 until known */
+    gint64 received;            /* monotonic, in microseconds */
+};
+
+struct pcma_client *client_new()
+{
+    struct pcma_client *client = g_new0(struct pcma_client, 1);
+    client->envelope = g_ptr_array_new();
+    return (client);
+}
+
+void client_free(struct pcma_client *client)
+{
+    guint i;
+    zmq_msg_t *frame;
+
+    for (i = 0; i < client->envelope->len; i++) {
+        frame = g_ptr_array_index(client->envelope, i);
+        if (zmq_msg_close(frame) < 0)
+            g_warning("client_free: zmq_msg_close: %s", strerror(errno));
+        g_free(frame);
+    }
+    g_ptr_array_free(client->envelope, TRUE);
+    g_free(client);
+}
+
+int client_send_envelope(struct pcma_client *client)
+{
+    guint i;
+
+    if (client->replying)
+        return (0);
+    client->replying = TRUE;
+
+    for (i = 0; i < client->envelope->len; i++) {
+        if (zmq_send(pcmad_sock, g_ptr_array_index(client->envelope, i),
+                     ZMQ_SNDMORE) < 0) {
+            g_critical("client_send_envelope: zmq_send: %s",
+                       strerror(errno));
+            return (-1);
+        }
+    }
+    return (0);
+}
+
+/* Sends a frame of a multipart reply, client_reply sending the last one */
+int client_reply_part(struct pcma_client *client,
+                      int (*pack_fn) (msgpack_packer *, void *), void *data)
+{
+    int ret;
+
+    if ((ret = client_send_envelope(client)) < 0)
+        return (ret);
+    if ((ret = send_packed_part(pcmad_sock, ZMQ_SNDMORE, pack_fn, data)) < 0)
+        g_critical("client_reply_part: send_packed_part: %i", ret);
+    return (ret);
+}
+
+void client_done(struct pcma_client *client)
+{
+    metrics_request(client->command,
+                    g_get_monotonic_time() - client->received);
+    client_free(client);
+}
+
+/* Sends the reply to the client, then frees it */
+int client_reply(struct pcma_client *client,
+                 int (*pack_fn) (msgpack_packer *, void *), void *data)
+{
+    int ret = client_send_envelope(client);
+
+    if (!ret && (ret = send_packed(pcmad_sock, pack_fn, data)) < 0)
+        g_critical("client_reply: send_packed: %i", ret);
+
+    client_done(client);
+    return (ret);
+}
+
+/* A packed reply, referenced by the messages zmq has yet to send */
+struct shared_reply {
+    msgpack_sbuffer *buffer;
+    gint refs;
+};
+
+/* Called by zmq I/O threads too, as a zmq_free_fn */
+void shared_reply_unref(void *data, void *hint)
+{
+    struct shared_reply *shared = (struct shared_reply *) hint;
+
+    if (g_atomic_int_dec_and_test(&shared->refs)) {
+        msgpack_sbuffer_free(shared->buffer);
+        g_free(shared);
+    }
+}
+
+/* Sends a reply packed beforehand without copying it, then frees the
+ * client */
+int client_reply_shared(struct pcma_client *client,
+                        struct shared_reply *shared)
+{
+    int ret = client_send_envelope(client);
+
+    if (!ret) {
+        g_atomic_int_inc(&shared->refs);
+        if ((ret = send_data(pcmad_sock, 0, shared->buffer->data,
+                             shared->buffer->size,
+                             shared_reply_unref, shared)) < 0)
+            g_critical("client_reply_shared: send_data: %i", ret);
+    }
+
+    client_done(client);
+    return (ret);
+}
+
+void handle_ping_request(struct pcma_client *client)
+{
+    g_info("ping request");
+
+    client_reply(client, empty_ok_packfn, NULL);
+}
+
+/*
+ * Replies to plain list requests, which monitoring polls, are packed once
+ * and sent until lockfiles or the budget they embed change.
+ */
+static struct shared_reply *list_cache = NULL;
+static guint64 list_cache_generation = 0;
+static guint64 list_cache_budget = 0;
+
+gboolean list_query_plain(struct list_query *q)
+{
+    return (!q->cursor && !q->prefix && !q->tag && !q->limit && !q->stream);
+}
+
+struct shared_reply *list_cache_get(struct list_query *q)
+{
+    if (list_cache && list_cache_generation == lockfiles_generation &&
+        list_cache_budget == budget_generation())
+        return (list_cache);
+
+    if (list_cache)
+        shared_reply_unref(NULL, list_cache);
+    list_query_start(q);
+    list_query_fill(q, 0);
+    list_cache = g_new(struct shared_reply, 1);
+    list_cache->buffer = packed_new(list_packfn, q);
+    list_cache->refs = 1;       /* the cache's own */
+    list_cache_generation = lockfiles_generation;
+    list_cache_budget = budget_generation();
+    return (list_cache);
+}
+
+void handle_list_request(struct pcma_client *client, struct list_query *q)
+{
+    g_info("list request");
+
+    if (list_query_plain(q)) {
+        client_reply_shared(client, list_cache_get(q));
+        return;
+    }
+
+    list_query_start(q);
+
+    if (!q->stream) {
+        list_query_fill(q, 0);
+        client_reply(client, list_packfn, q);
+        return;
+    }
+
+    /* Frames are packed and queued one at a time, bounding allocations */
+    for (;;) {
+        list_query_fill(q, q->stream);
+        if (!q->paths->len)
+            break;
+        if (client_reply_part(client, list_frame_packfn, q) < 0)
+            break;
+    }
+    client_reply(client, list_status_packfn, q);
+}
+
+void add_new_tags_to_mlockfile(gpointer data, gpointer user_data)
+{
+    struct mlockfile *file = (struct mlockfile *) user_data;
+
+    if (!g_list_find_custom(file->tags, data, g_strcmp0)) {
+        file->tags = g_list_prepend(file->tags,
+                                    (gpointer) tags_add(data, file));
+    }
+}
+
+struct task {
+    void (*fn) (gpointer);
+    gpointer data;
+};
+
+void task_worker(gpointer data, gpointer user_data)
+{
+    struct task *t = (struct task *) data;
+
+    t->fn(t->data);
+    g_free(t);
+}
+
+/* Has fn(data) called from an aux_pool thread */
+void run_aux(void (*fn) (gpointer), gpointer data)
+{
+    GError *err = NULL;
+    struct task *t = g_new(struct task, 1);
+
+    t->fn = fn;
+    t->data = data;
+    if (!g_thread_pool_push(aux_pool, t, &err)) {
+        g_critical("run_aux: g_thread_pool_push: %s", err->message);
+        g_error_free(err);
+        task_worker(t, NULL);
+    }
+}
+
+/* Has fn(data) called from the main loop, from any thread */
+void complete_later(void (*fn) (gpointer), gpointer data)
+{
+    struct task *c = g_new(struct task, 1);
+
+    c->fn = fn;
+    c->data = data;
+    g_async_queue_push(completions, c);
+    if (write(completion_pipe[1], "", 1) < 0)
+        g_critical("complete_later: write: %s", strerror(errno));
+}
+
+void handle_completions()
+{
+    char buf[256];
+    struct task *c;
+
+    while (read(completion_pipe[0], buf, sizeof(buf)) > 0);
+
+    while ((c = g_async_queue_try_pop(completions))) {
+        c->fn(c->data);
+        g_free(c);
+    }
+}
+
+struct lock_range {
+    off_t offset;
+    size_t length;
+};
+
+/* Groups lock jobs answered with a single reply */
+struct lock_batch {
+    struct pcma_client *client;
+    guint pending;              /* lock jobs */
+    guint walking;              /* directory walks */
+    guint64 files;
+    guint64 bytes;
+    guint64 failed;
+    GList *tags;
+    gsize rootlen;
+    GPtrArray *includes;        /* GPatternSpec */
+    GPtrArray *excludes;        /* GPatternSpec */
+    GPtrArray *results;         /* packed reply per lock job, or NULL */
+    int strategy;               /* for the files found by walks */
+    struct throttle *throttle;  /* for the files found by walks */
+};
+
+struct lock_job {
+    struct pcma_client *client; /* NULL for internal relocks */
+    gchar *path;
+    GList *tags;
+    GArray *ranges;             /* struct lock_range, NULL for whole file */
+    int strategy;               /* enum mlock_strategy */
+    struct throttle *throttle;  /* of the request, NULL if none */
+    gboolean reopen;            /* lock the file currently at path */
+    gboolean shared;            /* other paths lead to the entry's inode */
+    gboolean replaced;          /* path no longer leads to it */
+    gboolean linked;            /* path leads to an inode locked already */
+    struct lock_batch *batch;   /* replies through the batch if set */
+    guint index;                /* in the batch's results */
+    struct restore_entry *restore;      /* reports to the restore if set */
+    /* Entry in lockfiles, marked busy while the job runs */
+    struct mlockfile *file;
+    /* Private copy of the entry's mapping, handed over to the worker */
+    struct mlockfile work;
+    GArray *claims;             /* struct budget_claim, reserved if set */
+    struct stat stats;          /* of path, for admission */
+    int stat_ret;               /* of stat(2), negative if it failed */
+    gchar *errmsg;              /* why the job was not admitted */
+    int ret;
+};
+
+/* A lock from the saved state, relocked on startup */
+struct restore_entry {
+    gchar *path;
+    GList *tags;
+    GArray *ranges;             /* struct lock_range, NULL for whole file */
+    guint64 size;               /* when saved */
+    guint64 dev;
+    guint64 ino;
+    int strategy;
+    guint priority;             /* lower first */
+    guint order;                /* in the saved state */
+};
+
+/* Files unlocked together under memory pressure */
+struct shed_tier {
+    gint priority;
+    GPtrArray *entries;         /* struct restore_entry */
+    guint files;
+    guint64 bytes;
+    gint64 shed;                /* monotonic, in microseconds */
+};
+
+struct shedding {
+    GQueue *tiers;              /* struct shed_tier, last shed first */
+    guint64 triggers;
+    guint64 shed;               /* files */
+    guint64 restored;           /* files */
+};
+
+struct restore {
+    GPtrArray *entries;         /* struct restore_entry, by priority */
+    guint next;                 /* entry to dispatch next */
+    guint inflight;
+    guint depth;                /* entries locked concurrently */
+    guint64 total;
+    guint64 done;
+    guint64 failed;
+    guint64 replaced;           /* files that changed since saved */
+    guint64 bytes;
+    gint64 started;             /* monotonic, in microseconds */
+    gint64 finished;            /* 0 while running */
+};
 
+void lock_job_complete(gpointer data);
+void walk_job_complete(gpointer data);
+void restore_done(struct restore_entry *entry, struct mlockfile *locked);
+void shedding_stats_pack(msgpack_packer * pk);
+const char *shed_forget(const gchar * path, struct lock_range *range);
+
+int lock_batch_packfn(msgpack_packer * pk, void *lbp)
+{
+    struct lock_batch *batch = (struct lock_batch *) lbp;
+
+    if (batch->results)
+        return (packed_list_packfn(pk, batch->results));
+
+    msgpack_pack_array(pk, 2);
     msgpack_pack_true(pk);
+    msgpack_pack_array(pk, 3);
+    msgpack_pack_uint64(pk, batch->files);
+    msgpack_pack_uint64(pk, batch->bytes);
+    msgpack_pack_uint64(pk, batch->failed);
+    return (0);
+}
+
+struct lock_batch *lock_batch_new(struct pcma_client *client, GList * tags)
+{
+    struct lock_batch *batch = g_new0(struct lock_batch, 1);
+    GList *t;
+
+    batch->client = client;
+    batch->strategy = default_strategy;
+    for (t = tags; t; t = t->next)
+        batch->tags = g_list_prepend(batch->tags, g_strdup(t->data));
+    batch->includes = g_ptr_array_new_with_free_func((GDestroyNotify)
+                                                     g_pattern_spec_free);
+    batch->excludes = g_ptr_array_new_with_free_func((GDestroyNotify)
+                                                     g_pattern_spec_free);
+    return (batch);
+}
+
+/* Replies and frees the batch once nothing is pending anymore */
+void lock_batch_check(struct lock_batch *batch)
+{
+    if (batch->pending > 0 || batch->walking > 0)
+        return;
+
+    g_info("batch done: %" G_GUINT64_FORMAT " files, %" G_GUINT64_FORMAT
+           " bytes, %" G_GUINT64_FORMAT " failures", batch->files,
+           batch->bytes, batch->failed);
+    client_reply(batch->client, lock_batch_packfn, batch);
+
+    g_list_free_full(batch->tags, g_free);
+    g_ptr_array_free(batch->includes, TRUE);
+    g_ptr_array_free(batch->excludes, TRUE);
+    if (batch->results)
+        g_ptr_array_free(batch->results, TRUE);
+    throttle_unref(batch->throttle);
+    g_free(batch);
+}
+
+/* locked is NULL on failure */
+void lock_batch_done(struct lock_batch *batch, guint index,
+                     struct mlockfile *locked, char *errmsg)
+{
+    batch->pending--;
+    if (locked) {
+        batch->files++;
+        batch->bytes += locked->mmappedsize;
+    } else {
+        batch->failed++;
+    }
+    if (batch->results)
+        g_ptr_array_index(batch->results, index) = locked ?
+            packed_new(mlockfile_packfn, locked) :
+            packed_new(failed_packfn, errmsg);
+    lock_batch_check(batch);
+}
+
+gboolean lock_batch_matches(struct lock_batch *batch, GPtrArray * patterns,
+                            const gchar * path)
+{
+    guint i;
+    const gchar *relative = path + batch->rootlen;
+
+    while (*relative == '/')
+        relative++;
+
+    for (i = 0; i < patterns->len; i++)
+        if (g_pattern_match_string(g_ptr_array_index(patterns, i),
+                                   relative))
+            return (TRUE);
+    return (FALSE);
+}
+
+void lock_job_free(struct lock_job *job)
+{
+    g_free(job->path);
+    g_list_free_full(job->tags, g_free);
+    if (job->ranges)
+        g_array_free(job->ranges, TRUE);
+    if (job->claims)
+        budget_claims_free(job->claims);
+    throttle_unref(job->throttle);
+    g_free(job->errmsg);
+    g_free(job);
+}
+
+int lock_job_ranges(struct lock_job *job, struct mlockfile *f)
+{
+    struct lock_range *range;
+    guint i;
+    int ret = 0;
+
+    for (i = 0; i < job->ranges->len; i++) {
+        range = &g_array_index(job->ranges, struct lock_range, i);
+        ret = mlockfile_lock_range(job->path, f, range->offset,
+                                   range->length, job->strategy);
+        if (ret < 0)
+            break;
+    }
+    return (ret);
+}
+
+/* Locks the new file at the job's path, then releases the previous one.
+ * Regions locked in the previous file are locked in the new one too. */
+int lock_job_reopen(struct lock_job *job)
+{
+    struct mlockfile fresh;
+    struct mlockregion *r;
+    guint i;
+    int ret = 0;
+
+    memset(&fresh, 0, sizeof(fresh));
+    fresh.fd = -1;
+    fresh.regions = g_array_new(FALSE, FALSE, sizeof(struct mlockregion));
+    fresh.throttle = job->work.throttle;
+
+    for (i = 0; i < job->work.regions->len && ret >= 0; i++) {
+        r = &g_array_index(job->work.regions, struct mlockregion, i);
+        ret = mlockfile_lock_range(job->path, &fresh, r->offset, r->length,
+                                   r->strategy);
+    }
+    if (ret >= 0)
+        ret = job->ranges ? lock_job_ranges(job, &fresh) :
+            mlockfile_lock(job->path, &fresh, job->strategy);
+
+    if (ret < 0) {
+        if (mlockfile_unlock(&fresh) < 0)
+            g_critical("lock_job_reopen: could not release new file");
+        g_array_free(fresh.regions, TRUE);
+        job->work.times = fresh.times;
+        return (ret);
+    }
+
+    if (mlockfile_unlock(&job->work) < 0)
+        g_critical("lock_job_reopen: could not release previous file");
+    g_array_free(job->work.regions, TRUE);
+
+    job->work.fd = fresh.fd;
+    job->work.dev = fresh.dev;
+    job->work.ino = fresh.ino;
+    job->work.size = fresh.size;
+    job->work.mmappedsize = fresh.mmappedsize;
+    job->work.regions = fresh.regions;
+    job->work.times = fresh.times;
+    return (0);
+}
+
+/* Whether another file took the job's path since the entry was locked */
+gboolean lock_job_replaced(struct lock_job *job)
+{
+    struct stat stats;
+
+    if (job->work.fd < 0 || stat(job->path, &stats) < 0)
+        return (FALSE);
+    return (stats.st_dev != job->work.dev || stats.st_ino != job->work.ino);
+}
+
+gboolean lockinodes_held(dev_t dev, ino_t ino);
+
+/* Whether the job's path is a hardlink to an inode locked already, in
+ * which case the entry is left unmapped and lock_job_complete merges it */
+gboolean lock_job_linked(struct lock_job *job)
+{
+    struct stat stats;
+
+    if (job->work.fd >= 0 || job->shared || stat(job->path, &stats) < 0)
+        return (FALSE);
+    if (!lockinodes_held(stats.st_dev, stats.st_ino))
+        return (FALSE);
+    job->work.dev = stats.st_dev;
+    job->work.ino = stats.st_ino;
+    return (TRUE);
+}
+
+/* Runs in a lock_pool thread; only touches the job's private copy */
+void lock_worker(gpointer data, gpointer user_data)
+{
+    struct lock_job *job = (struct lock_job *) data;
+
+    if (!job->reopen && lock_job_replaced(job)) {
+        /* The inode stays locked for its other paths, lock_job_complete
+         * detaches this one and dispatches the job again */
+        if (job->shared) {
+            job->replaced = TRUE;
+            complete_later(lock_job_complete, job);
+            return;
+        }
+        job->reopen = TRUE;
+    }
+
+    if (!job->reopen && lock_job_linked(job)) {
+        job->linked = TRUE;
+        complete_later(lock_job_complete, job);
+        return;
+    }
+
+    if (job->reopen) {
+        job->ret = lock_job_reopen(job);
+    } else if (!job->ranges) {
+        job->ret = mlockfile_lock(job->path, &job->work, job->strategy);
+    } else {
+        job->ret = lock_job_ranges(job, &job->work);
+    }
+
+    complete_later(lock_job_complete, job);
+}
+
+/* Accounts the entry's current size against its tags */
+void lockfile_charge(struct mlockfile *file)
+{
+    file->charged = file->mmappedsize;
+    budget_charge(file->tags, file->charged);
+    lockfiles_generation++;
+}
+
+void lockfile_release(struct mlockfile *file)
+{
+    budget_release(file->tags, file->charged);
+    file->charged = 0;
+}
+
+guint lockinode_hash(gconstpointer p)
+{
+    const struct mlockfile *f = (const struct mlockfile *) p;
+
+    return ((guint) f->ino ^ ((guint) f->dev << 16));
+}
+
+gboolean lockinode_equal(gconstpointer a, gconstpointer b)
+{
+    const struct mlockfile *fa = (const struct mlockfile *) a;
+    const struct mlockfile *fb = (const struct mlockfile *) b;
+
+    return (fa->dev == fb->dev && fa->ino == fb->ino);
+}
+
+/* Entry holding the inode, if any; main thread only */
+struct mlockfile *lockinodes_find(dev_t dev, ino_t ino)
+{
+    struct mlockfile probe;
+
+    probe.dev = dev;
+    probe.ino = ino;
+    return (g_hash_table_lookup(lockinodes, &probe));
+}
+
+/* Whether an entry holds the inode, for workers */
+gboolean lockinodes_held(dev_t dev, ino_t ino)
+{
+    gboolean held;
+
+    g_mutex_lock(&lockinodes_mutex);
+    held = lockinodes_find(dev, ino) != NULL;
+    g_mutex_unlock(&lockinodes_mutex);
+    return (held);
+}
+
+/* Entries are indexed while they hold an inode; the first one locking an
+ * inode keeps it, see lock_job_complete */
+void lockinodes_add(struct mlockfile *file)
+{
+    g_mutex_lock(&lockinodes_mutex);
+    if (file->fd >= 0 && !g_hash_table_lookup(lockinodes, file))
+        g_hash_table_add(lockinodes, file);
+    g_mutex_unlock(&lockinodes_mutex);
+}
+
+/* To be called before the entry's inode changes */
+void lockinodes_remove(struct mlockfile *file)
+{
+    g_mutex_lock(&lockinodes_mutex);
+    if (g_hash_table_lookup(lockinodes, file) == file)
+        g_hash_table_remove(lockinodes, file);
+    g_mutex_unlock(&lockinodes_mutex);
+}
+
+/* Entry locking the path, under its own name or as an alias */
+struct mlockfile *lockfile_lookup(const gchar * path)
+{
+    struct mlockfile *file = g_hash_table_lookup(lockfiles, path);
+
+    return (file ? file : g_hash_table_lookup(lockaliases, path));
+}
+
+void lockfile_alias_add(struct mlockfile *file, const gchar * path)
+{
+    gchar *alias = g_strdup(path);
+
+    file->aliases = g_list_prepend(file->aliases, alias);
+    g_hash_table_insert(lockaliases, alias, file);
+    watch_add(alias);
+    lockfiles_generation++;
+}
+
+void lockfiles_key_destroy(gpointer p);
+
+/* Forgets one of the entry's paths, an alias taking over as its key in
+ * lockfiles if needed. Returns FALSE, leaving the entry untouched, when
+ * path is the only one left. path may not be one of the entry's strings. */
+gboolean lockfile_path_remove(struct mlockfile *file, const gchar * path)
+{
+    GList *alias = g_list_find_custom(file->aliases, path, g_strcmp0);
+    gchar *previous;
+
+    if (!alias && !file->aliases)
+        return (FALSE);
+    lockfiles_generation++;
+
+    if (alias) {
+        file->aliases = g_list_remove_link(file->aliases, alias);
+        g_hash_table_remove(lockaliases, alias->data);
+        watch_remove(alias->data);
+        g_free(alias->data);
+        g_list_free_1(alias);
+        return (TRUE);
+    }
+
+    alias = file->aliases;
+    file->aliases = g_list_remove_link(file->aliases, alias);
+    g_hash_table_remove(lockaliases, alias->data);
+
+    previous = file->path;
+    g_hash_table_steal(lockfiles, previous);
+    lockfiles_key_destroy(previous);
+    if (previous != (gchar *) (file + 1))
+        g_free(previous);
+
+    file->path = alias->data;
+    g_list_free_1(alias);
+    g_hash_table_insert(lockfiles, file->path, file);
+    g_sequence_insert_sorted(lockpaths, file->path, lockpaths_cmp, NULL);
+    return (TRUE);
+}
+
+void lock_job_claim(struct lock_job *job, const gchar * tag, guint64 bytes)
+{
+    struct budget_claim claim;
+
+    claim.tag = g_strdup(tag);
+    claim.bytes = bytes;
+    g_array_append_val(job->claims, claim);
+}
+
+/* Reserves what the entry may grow by once the job is done, before any
+ * page is faulted in. Returns why the job cannot be admitted, or NULL. */
+gchar *lock_job_admit(struct lock_job *job, struct mlockfile *file)
+{
+    struct stat *stats = &job->stats;
+    struct lock_range whole = { 0, 0 }, *range;
+    struct mlockregion *r;
+    guint i, j, nranges = job->ranges ? job->ranges->len : 1;
+    guint64 projected = 0, delta = 0;
+    gchar *reason;
+    GList *t;
+
+    /* The lock fails on its own if the file cannot be opened */
+    if (job->stat_ret < 0)
+        return (NULL);
+    /* Hardlinks are charged once merged with the entry holding the inode */
+    if (file->fd < 0 && !file->aliases &&
+        lockinodes_find(stats->st_dev, stats->st_ino))
+        return (NULL);
+
+    /* Regions the job does not relock keep their size */
+    for (i = 0; i < file->regions->len && !job->reopen; i++) {
+        r = &g_array_index(file->regions, struct mlockregion, i);
+        for (j = 0; j < nranges; j++) {
+            range = job->ranges ? &g_array_index(job->ranges,
+                                                 struct lock_range,
+                                                 j) : &whole;
+            if (range->offset == r->offset && range->length == r->length)
+                break;
+        }
+        if (j == nranges)
+            projected += r->mmappedsize;
+    }
+    for (j = 0; j < nranges; j++) {
+        range = job->ranges ? &g_array_index(job->ranges,
+                                             struct lock_range,
+                                             j) : &whole;
+        projected += mlockfile_range_size(stats->st_size, range->offset,
+                                          range->length);
+    }
+    if (projected > file->mmappedsize)
+        delta = projected - file->mmappedsize;
+
+    /* New tags get charged for the whole file */
+    job->claims = g_array_new(FALSE, FALSE, sizeof(struct budget_claim));
+    lock_job_claim(job, NULL, delta);
+    for (t = file->tags; t; t = t->next)
+        lock_job_claim(job, t->data, delta);
+    for (t = job->tags; t; t = t->next)
+        if (!g_list_find_custom(file->tags, t->data, g_strcmp0))
+            lock_job_claim(job, t->data, projected);
+
+    if ((reason = budget_reserve(job->claims))) {
+        budget_claims_free(job->claims);
+        job->claims = NULL;
+    }
+    return (reason);
+}
+
+void lock_job_start(struct lock_job *job)
+{
+    GError *err = NULL;
+
+    if (!g_thread_pool_push(lock_pool, job, &err)) {
+        g_critical("lock_job_start: g_thread_pool_push: %s", err->message);
+        g_error_free(err);
+        job->ret = -1;
+        complete_later(lock_job_complete, job);
+    }
+}
+
+/* Called from the main loop once lock_job_stat is done */
+void lock_job_admitted(gpointer data)
+{
+    struct lock_job *job = (struct lock_job *) data;
+
+    if ((job->errmsg = lock_job_admit(job, job->file))) {
+        g_warning("%s: %s", job->path, job->errmsg);
+        job->ret = -6;
+        lock_job_complete(job);
+        return;
+    }
+    lock_job_start(job);
+}
+
+/* Runs in an aux_pool thread, stat(2) blocking on slow filesystems */
+void lock_job_stat(gpointer data)
+{
+    struct lock_job *job = (struct lock_job *) data;
+
+    job->stat_ret = stat(job->path, &job->stats);
+    complete_later(lock_job_admitted, job);
+}
+
+void lock_job_dispatch(struct lock_job *job)
+{
+    gchar *key;
+    struct mlockfile *file = lockfile_lookup(job->path);
+
+    if (file) {
+        g_debug("lock_job_dispatch: found lock for %s", job->path);
+    } else {
+        g_debug("lock_job_dispatch: first lock for %s", job->path);
+        file = mlockfile_init(job->path);
+        key = file->path;
+        g_hash_table_insert(lockfiles, key, file);
+        g_sequence_insert_sorted(lockpaths, key, lockpaths_cmp, NULL);
+    }
+
+    if (file->busy) {
+        g_debug("lock_job_dispatch: %s is busy, queueing", job->path);
+        if (!file->waiting)
+            file->waiting = g_queue_new();
+        g_queue_push_tail(file->waiting, job);
+        return;
+    }
+
+    file->busy = TRUE;
+    job->file = file;
+    job->shared = file->aliases || strcmp(file->path, job->path);
+    mlockfile_copy(&job->work, file);
+    job->work.throttle = job->throttle;
+
+    /* Admission needs the size of the file, which is not stat'ed here */
+    if (budget_limited())
+        run_aux(lock_job_stat, job);
+    else
+        lock_job_start(job);
+}
+
+/* locked is NULL on failure */
+void lock_job_reply(struct lock_job *job, struct mlockfile *locked,
+                    char *errmsg)
+{
+    if (job->restore)
+        restore_done(job->restore, locked);
+    if (job->batch)
+        lock_batch_done(job->batch, job->index, locked, errmsg);
+    else if (job->client && locked)
+        client_reply(job->client, mlockfile_packfn, locked);
+    else if (job->client)
+        client_reply(job->client, failed_packfn, errmsg);
+    job->client = NULL;
+}
+
+/* Sends the job through lock_job_dispatch again, as if new */
+void lock_job_retry(struct lock_job *job)
+{
+    if (job->claims)
+        budget_claims_free(job->claims);
+    job->claims = NULL;
+    job->file = NULL;
+    memset(&job->work, 0, sizeof(job->work));
+    job->shared = FALSE;
+    job->replaced = FALSE;
+    job->linked = FALSE;
+    job->ret = 0;
+    lock_job_dispatch(job);
+}
+
+/* Ranges currently locked for a file, to relock them all */
+GArray *lockfile_ranges(struct mlockfile *file)
+{
+    struct lock_range range;
+    struct mlockregion *r;
+    guint i;
+    GArray *ranges = g_array_sized_new(FALSE, FALSE,
+                                       sizeof(struct lock_range),
+                                       file->regions->len);
+
+    for (i = 0; i < file->regions->len; i++) {
+        r = &g_array_index(file->regions, struct mlockregion, i);
+        range.offset = r->offset;
+        range.length = r->length;
+        g_array_append_val(ranges, range);
+    }
+    return (ranges);
+}
+
+void lock_job_complete(gpointer data)
+{
+    struct lock_job *job = (struct lock_job *) data;
+    struct mlockfile *file = job->file, *other;
+    GQueue *waiting = file->waiting;
+    struct lock_job *next, *retry = NULL;
+    gboolean relock = file->regions->len > 0;
+    GArray *ranges;
+    GList *t;
+
+    if (job->claims)
+        budget_unreserve(job->claims);
+    if (!file->detached)
+        lockfile_release(file);
+    lockinodes_remove(file);
+    metrics_lock(&job->work.times);
+
+    file->fd = job->work.fd;
+    file->dev = job->work.dev;
+    file->ino = job->work.ino;
+    file->size = job->work.size;
+    file->mmappedsize = job->work.mmappedsize;
+    g_array_free(file->regions, TRUE);
+    file->regions = job->work.regions;
+    file->busy = FALSE;
+    file->waiting = NULL;
+
+    if (file->detached) {
+        g_info("%s was unlocked while locking", job->path);
+        lock_job_reply(job, NULL, "unlocked while locking");
+        mlockfile_destroy(file);
+        file = NULL;
+    } else if (job->replaced) {
+        g_info("%s was replaced, locking the new file", job->path);
+        /* Its other paths may have been unlocked in the meantime */
+        if (!lockfile_path_remove(file, job->path))
+            job->reopen = TRUE;
+        retry = job;
+    } else if (job->ret < 0) {
+        if (!job->errmsg) {
+            g_critical("mlockfile_lock: %i", job->ret);
+            job->errmsg = g_strdup("mlockfile_lock failed");
+        }
+        events_publish(EVENT_FAIL, job->path, 0, job->tags, string_packfn,
+                       job->errmsg);
+        lock_job_reply(job, NULL, job->errmsg);
+        if (!file->regions->len) {
+            if (g_hash_table_remove(lockfiles, file->path) == FALSE)
+                g_error("lock_job_complete: g_hash_table_remove failed");
+            file = NULL;
+        }
+    } else if (!file->aliases &&
+               (other = lockinodes_find(file->dev, file->ino))) {
+        /* A hardlink to an inode locked already: the path becomes one of
+         * its aliases and the job is run against that entry */
+        g_info("%s is a link to %s, sharing its lock", job->path,
+               other->path);
+        if (job->ranges) {
+            ranges = lockfile_ranges(file);
+            g_array_append_vals(job->ranges, ranges->data, ranges->len);
+            g_array_free(ranges, TRUE);
+        }
+        for (t = file->tags; t; t = t->next)
+            if (!g_list_find_custom(job->tags, t->data, g_strcmp0))
+                job->tags = g_list_prepend(job->tags, g_strdup(t->data));
+        if (g_hash_table_remove(lockfiles, file->path) == FALSE)
+            g_error("lock_job_complete: g_hash_table_remove failed");
+        file = NULL;
+        lockfile_alias_add(other, job->path);
+        retry = job;
+    } else if (job->linked) {
+        /* The inode got unlocked since the worker found it held */
+        retry = job;
+    } else {
+        g_list_foreach(job->tags, add_new_tags_to_mlockfile, file);
+        events_publish(relock ? EVENT_RELOCK : EVENT_LOCK, job->path,
+                       file->mmappedsize, file->tags, lock_times_packfn,
+                       &job->work.times);
+        lock_job_reply(job, file, NULL);
+        g_info("locked %s", job->path);
+        if (job->reopen)
+            watch_remove(job->path);
+        watch_add(job->path);
+    }
+    if (file) {
+        lockfile_charge(file);
+        lockinodes_add(file);
+    }
+    if (!retry)
+        lock_job_free(job);
+
+    if (waiting && file) {
+        file->waiting = waiting;
+        if ((next = g_queue_pop_head(waiting)))
+            lock_job_dispatch(next);
+    } else if (waiting) {
+        /* The entry is gone, its waiters start over */
+        while ((next = g_queue_pop_head(waiting)))
+            lock_job_dispatch(next);
+        g_queue_free(waiting);
+    }
+
+    if (retry)
+        lock_job_retry(retry);
+}
+
+struct lock_job *lock_job_new(struct pcma_client *client,
+                              const gchar * path, GList * tags,
+                              GArray * ranges)
+{
+    struct lock_job *job = g_new0(struct lock_job, 1);
+    GList *t;
+
+    job->client = client;
+    job->path = g_strdup(path);
+    job->strategy = default_strategy;
+    for (t = tags; t; t = t->next)
+        job->tags = g_list_prepend(job->tags, g_strdup(t->data));
+    if (ranges) {
+        job->ranges = g_array_sized_new(FALSE, FALSE,
+                                        sizeof(struct lock_range),
+                                        ranges->len);
+        g_array_append_vals(job->ranges, ranges->data, ranges->len);
+    }
+
+    return (job);
+}
+
+void handle_lock_request(struct pcma_client *client, const gchar * path,
+                         GList * tags, GArray * ranges, int strategy,
+                         guint64 rate)
+{
+    struct lock_job *job = lock_job_new(client, path, tags, ranges);
+
+    g_info("lock request (%s)", path);
+
+    job->strategy = strategy;
+    if (rate)
+        job->throttle = throttle_new(rate, path);
+    lock_job_dispatch(job);
+}
+
+struct walk_job {
+    struct lock_batch *batch;
+    gchar *dir;
+    GPtrArray *dirs;            /* to walk next */
+    GPtrArray *files;           /* to lock */
+    int ret;
+};
+
+/* Runs in an aux_pool thread; the batch is only read */
+void walk_worker(gpointer data)
+{
+    struct walk_job *job = (struct walk_job *) data;
+    struct lock_batch *batch = job->batch;
+    struct dirent *ent;
+    struct stat stats;
+    unsigned char type;
+    gchar *path;
+    DIR *dir;
+
+    if (!(dir = opendir(job->dir))) {
+        g_warning("walk_worker: opendir(%s): %s", job->dir,
+                  strerror(errno));
+        job->ret = -1;
+        complete_later(walk_job_complete, job);
+        return;
+    }
+
+    while ((ent = readdir(dir))) {
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+            continue;
+
+        path = g_build_filename(job->dir, ent->d_name, NULL);
+
+        type = ent->d_type;
+        if (type == DT_UNKNOWN) {
+            if (lstat(path, &stats) < 0)
+                type = DT_UNKNOWN;
+            else if (S_ISDIR(stats.st_mode))
+                type = DT_DIR;
+            else if (S_ISREG(stats.st_mode))
+                type = DT_REG;
+        }
+
+        if (lock_batch_matches(batch, batch->excludes, path))
+            g_free(path);
+        else if (type == DT_DIR)
+            g_ptr_array_add(job->dirs, path);
+        else if (type == DT_REG && (batch->includes->len == 0 ||
+                                    lock_batch_matches(batch,
+                                                       batch->includes,
+                                                       path)))
+            g_ptr_array_add(job->files, path);
+        else
+            g_free(path);
+    }
+
+    if (closedir(dir) < 0)
+        g_warning("walk_worker: closedir: %s", strerror(errno));
+
+    complete_later(walk_job_complete, job);
+}
+
+void walk_job_dispatch(struct lock_batch *batch, const gchar * dir)
+{
+    struct walk_job *job = g_new0(struct walk_job, 1);
+
+    job->batch = batch;
+    job->dir = g_strdup(dir);
+    job->dirs = g_ptr_array_new_with_free_func(g_free);
+    job->files = g_ptr_array_new_with_free_func(g_free);
+
+    batch->walking++;
+    run_aux(walk_worker, job);
+}
+
+void walk_job_complete(gpointer data)
+{
+    struct walk_job *job = (struct walk_job *) data;
+    struct lock_batch *batch = job->batch;
+    struct lock_job *lock;
+    guint i;
+
+    batch->walking--;
+    if (job->ret < 0)
+        batch->failed++;
+
+    for (i = 0; i < job->dirs->len; i++)
+        walk_job_dispatch(batch, g_ptr_array_index(job->dirs, i));
+
+    for (i = 0; i < job->files->len; i++) {
+        lock = lock_job_new(NULL, g_ptr_array_index(job->files, i),
+                            batch->tags, NULL);
+        lock->batch = batch;
+        lock->strategy = batch->strategy;
+        lock->throttle = throttle_ref(batch->throttle);
+        batch->pending++;
+        lock_job_dispatch(lock);
+    }
+
+    g_free(job->dir);
+    g_ptr_array_free(job->dirs, TRUE);
+    g_ptr_array_free(job->files, TRUE);
+    g_free(job);
+
+    lock_batch_check(batch);
+}
+
+void handle_lockdir_request(struct pcma_client *client, const gchar * root,
+                            GList * tags, GList * includes,
+                            GList * excludes, int strategy, guint64 rate)
+{
+    struct lock_batch *batch = lock_batch_new(client, tags);
+    GList *p;
+
+    g_info("lockdir request (%s)", root);
+
+    batch->strategy = strategy;
+    if (rate)
+        batch->throttle = throttle_new(rate, root);
+    batch->rootlen = strlen(root);
+    for (p = includes; p; p = p->next)
+        g_ptr_array_add(batch->includes, g_pattern_spec_new(p->data));
+    for (p = excludes; p; p = p->next)
+        g_ptr_array_add(batch->excludes, g_pattern_spec_new(p->data));
+
+    walk_job_dispatch(batch, root);
+}
+
+struct warm_job {
+    struct pcma_client *client;
+    gchar *path;
+    GArray *ranges;             /* struct lock_range, NULL for whole files */
+    struct warm_stats stats;
+};
+
+int warm_job_packfn(msgpack_packer * pk, void *wjp)
+{
+    struct warm_job *job = (struct warm_job *) wjp;
+
+    msgpack_pack_array(pk, 2);
+    msgpack_pack_true(pk);
+    msgpack_pack_array(pk, 5);
+    msgpack_pack_uint64(pk, job->stats.files);
+    msgpack_pack_uint64(pk, job->stats.bytes);
+    msgpack_pack_uint64(pk, job->stats.before);
+    msgpack_pack_uint64(pk, job->stats.after);
+    msgpack_pack_uint64(pk, job->stats.failed);
+    return (0);
+}
+
+void warm_job_complete(gpointer data)
+{
+    struct warm_job *job = (struct warm_job *) data;
+
+    g_info("warmed %s: %" G_GUINT64_FORMAT " -> %" G_GUINT64_FORMAT
+           " resident bytes", job->path, job->stats.before,
+           job->stats.after);
+    client_reply(job->client, warm_job_packfn, job);
+
+    g_free(job->path);
+    if (job->ranges)
+        g_array_free(job->ranges, TRUE);
+    g_free(job);
+}
+
+/* Runs in an aux_pool thread, which waits for warm_pool to be done */
+void warm_worker(gpointer data)
+{
+    struct warm_job *job = (struct warm_job *) data;
+    struct warm_run *run = warm_run_new();
+    struct lock_range *range;
+    guint i;
+
+    if (job->ranges) {
+        for (i = 0; i < job->ranges->len; i++) {
+            range = &g_array_index(job->ranges, struct lock_range, i);
+            warm_file(run, job->path, range->offset, range->length);
+        }
+    } else {
+        warm_tree(run, job->path);
+    }
+
+    warm_run_finish(run, &job->stats);
+    complete_later(warm_job_complete, job);
+}
+
+void handle_warm_request(struct pcma_client *client, const gchar * path,
+                         GArray * ranges)
+{
+    struct warm_job *job = g_new0(struct warm_job, 1);
+
+    g_info("warm request (%s)", path);
+
+    job->client = client;
+    job->path = g_strdup(path);
+    if (ranges) {
+        job->ranges = g_array_sized_new(FALSE, FALSE,
+                                        sizeof(struct lock_range),
+                                        ranges->len);
+        g_array_append_vals(job->ranges, ranges->data, ranges->len);
+    }
+
+    run_aux(warm_worker, job);
+}
+
+struct residency_job {
+    struct pcma_client *client;
+    gboolean by_tag;
+    GPtrArray *paths;
+    struct residency *results;  /* one per path */
+    int ret;
+};
+
+void residency_pack(msgpack_packer * pk, struct residency *r)
+{
+    guint i;
+
+    msgpack_pack_array(pk, r->runs ? 3 : 2);
+    msgpack_pack_uint64(pk, r->size);
+    msgpack_pack_uint64(pk, r->resident);
+    if (r->runs) {
+        msgpack_pack_array(pk, r->runs->len);
+        for (i = 0; i < r->runs->len; i++)
+            msgpack_pack_uint64(pk, g_array_index(r->runs, guint64, i));
+    }
+}
+
+int residency_job_packfn(msgpack_packer * pk, void *rjp)
+{
+    struct residency_job *job = (struct residency_job *) rjp;
+    const gchar *path;
+    guint64 size = 0, resident = 0;
+    guint i;
+
+    msgpack_pack_array(pk, 2);
+    msgpack_pack_true(pk);
+
+    if (!job->by_tag) {
+        residency_pack(pk, &job->results[0]);
+        return (0);
+    }
+
+    for (i = 0; i < job->paths->len; i++) {
+        size += job->results[i].size;
+        resident += job->results[i].resident;
+    }
+
+    msgpack_pack_array(pk, 3);
+    msgpack_pack_uint64(pk, size);
+    msgpack_pack_uint64(pk, resident);
+    msgpack_pack_map(pk, job->paths->len);
+    for (i = 0; i < job->paths->len; i++) {
+        path = g_ptr_array_index(job->paths, i);
+        msgpack_pack_raw(pk, strlen(path));
+        msgpack_pack_raw_body(pk, path, strlen(path));
+        residency_pack(pk, &job->results[i]);
+    }
+    return (0);
+}
+
+void residency_job_complete(gpointer data)
+{
+    struct residency_job *job = (struct residency_job *) data;
+    guint i;
+
+    if (job->ret < 0)
+        client_reply(job->client, failed_packfn, "residency failed");
+    else
+        client_reply(job->client, residency_job_packfn, job);
+
+    for (i = 0; i < job->paths->len; i++)
+        residency_clear(&job->results[i]);
+    g_free(job->results);
+    g_ptr_array_free(job->paths, TRUE);
+    g_free(job);
+}
+
+/* Runs in an aux_pool thread */
+void residency_worker(gpointer data)
+{
+    struct residency_job *job = (struct residency_job *) data;
+    guint i;
+
+    for (i = 0; i < job->paths->len; i++) {
+        /* Files unlocked in the meantime are reported as empty */
+        if (residency_file(g_ptr_array_index(job->paths, i),
+                           &job->results[i], !job->by_tag) < 0
+            && !job->by_tag)
+            job->ret = -1;
+    }
+
+    complete_later(residency_job_complete, job);
+}
+
+/* Either path or tags is set */
+void handle_residency_request(struct pcma_client *client,
+                              const gchar * path, GList * tags)
+{
+    struct residency_job *job = g_new0(struct residency_job, 1);
+    GHashTable *tagged, *seen;
+    GHashTableIter iter;
+    struct mlockfile *file;
+    gpointer key;
+    GList *t;
+
+    job->client = client;
+    job->paths = g_ptr_array_new_with_free_func(g_free);
+
+    if (path) {
+        g_info("residency request (%s)", path);
+        g_ptr_array_add(job->paths, g_strdup(path));
+    } else {
+        g_info("residency request (tags)");
+        job->by_tag = TRUE;
+        seen = g_hash_table_new(g_direct_hash, g_direct_equal);
+        for (t = tags; t; t = t->next) {
+            if (!(tagged = tags_files(t->data)))
+                continue;
+            g_hash_table_iter_init(&iter, tagged);
+            while (g_hash_table_iter_next(&iter, &key, NULL)) {
+                file = (struct mlockfile *) key;
+                if (g_hash_table_contains(seen, file))
+                    continue;
+                g_hash_table_add(seen, file);
+                g_ptr_array_add(job->paths, g_strdup(file->path));
+            }
+        }
+        g_hash_table_unref(seen);
+    }
+
+    job->results = g_new0(struct residency, job->paths->len);
+    run_aux(residency_worker, job);
+}
+
+/* What stat said about a locked path */
+struct path_stat {
+    int error;                  /* errno, 0 if found */
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+};
+
+void path_stat(const gchar * path, struct path_stat *ps)
+{
+    struct stat stats;
+
+    memset(ps, 0, sizeof(*ps));
+    if (stat(path, &stats) < 0) {
+        ps->error = errno;
+        return;
+    }
+    ps->dev = stats.st_dev;
+    ps->ino = stats.st_ino;
+    ps->size = stats.st_size;
+}
+
+enum path_check {
+    PATH_UNCHANGED,
+    PATH_RESIZED,
+    PATH_REPLACED,
+    PATH_VANISHED,
+    PATH_FAILED
+};
+
+/* Publishes the unlock of a whole entry, before its regions go; entries
+ * leaving lockfiles otherwise, as when hardlinks get merged, are not
+ * unlocked as far as subscribers are concerned */
+void lockfile_publish_unlock(struct mlockfile *file, const gchar * path)
+{
+    if (file->regions->len)
+        events_publish(EVENT_UNLOCK, path, file->mmappedsize, file->tags,
+                       NULL, NULL);
+}
+
+/* Relocks what the entry has locked, path keeping its tags if it leaves */
+struct lock_job *lockfile_relock_job(struct mlockfile *file,
+                                     const gchar * path)
+{
+    struct lock_job *job = lock_job_new(NULL, path, file->tags, NULL);
+
+    job->ranges = lockfile_ranges(file);
+    /* Regions of a file are normally locked alike */
+    job->strategy = g_array_index(file->regions, struct mlockregion,
+                                  0).strategy;
+    return (job);
+}
+
+/* Brings the lock of one of the entry's paths in line with the file now
+ * at that path: the new file is locked before the previous one is
+ * released, if no other path keeps it. The entry may not be busy. */
+enum path_check lockfile_path_check(const gchar * path,
+                                    struct mlockfile *file,
+                                    struct path_stat *ps)
+{
+    struct lock_job *job;
+
+    if (ps->error && ps->error != ENOENT) {
+        g_warning("lockfile_path_check: stat(%s): %s", path,
+                  strerror(ps->error));
+        return (PATH_FAILED);
+    }
+
+    if (ps->error) {
+        g_info("%s disappeared, unlocking", path);
+        if (lockfile_path_remove(file, path))
+            return (PATH_VANISHED);
+        lockfile_publish_unlock(file, path);
+        if (mlockfile_unlock(file) < 0)
+            g_critical("lockfile_path_check: could not unlock %s", path);
+        if (g_hash_table_remove(lockfiles, file->path) == FALSE)
+            g_error("lockfile_path_check: g_hash_table_remove failed");
+        return (PATH_VANISHED);
+    }
+
+    if (ps->dev == file->dev && ps->ino == file->ino) {
+        if (ps->size == file->size)
+            return (PATH_UNCHANGED);
+        g_info("%s changed size, relocking", path);
+        lock_job_dispatch(lockfile_relock_job(file, path));
+        return (PATH_RESIZED);
+    }
+
+    g_info("%s was replaced, relocking", path);
+    job = lockfile_relock_job(file, path);
+    if (!lockfile_path_remove(file, path))
+        job->reopen = TRUE;
+    lock_job_dispatch(job);
+    return (PATH_REPLACED);
+}
+
+/* Called when inotify reported changes to a locked path */
+void check_lockfile(const gchar * path)
+{
+    struct path_stat ps;
+    struct mlockfile *file = lockfile_lookup(path);
+
+    if (!file || !file->regions->len)
+        return;
+
+    if (file->busy) {
+        watch_schedule(path);
+        return;
+    }
+
+    path_stat(path, &ps);
+    lockfile_path_check(path, file, &ps);
+}
+
+#define REFRESH_CHUNK 256       /* paths per aux_pool task */
+
+/* Checks every locked path at once, see handle_refresh_request */
+struct refresh_job {
+    struct pcma_client *client;
+    GPtrArray *paths;           /* primaries and aliases */
+    struct path_stat *stats;    /* one per path */
+    guint pending;              /* chunks */
+    guint64 counts[PATH_FAILED + 1];    /* by enum path_check */
+    guint64 skipped;            /* busy or unlocked in the meantime */
+};
+
+struct refresh_chunk {
+    struct refresh_job *job;
+    guint from;
+    guint to;
+};
+
+int refresh_job_packfn(msgpack_packer * pk, void *rjp)
+{
+    struct refresh_job *job = (struct refresh_job *) rjp;
+
+    msgpack_pack_array(pk, 2);
+    msgpack_pack_true(pk);
+    msgpack_pack_array(pk, 6);
+    msgpack_pack_uint64(pk, job->paths->len);
+    msgpack_pack_uint64(pk, job->counts[PATH_REPLACED]);
+    msgpack_pack_uint64(pk, job->counts[PATH_RESIZED]);
+    msgpack_pack_uint64(pk, job->counts[PATH_VANISHED]);
+    msgpack_pack_uint64(pk, job->counts[PATH_FAILED]);
+    msgpack_pack_uint64(pk, job->skipped);
+    return (0);
+}
+
+/* Runs once every path was stat'ed; relocks are dispatched, not awaited */
+void refresh_job_complete(struct refresh_job *job)
+{
+    struct mlockfile *file;
+    const gchar *path;
+    guint i;
+
+    for (i = 0; i < job->paths->len; i++) {
+        path = g_ptr_array_index(job->paths, i);
+        file = lockfile_lookup(path);
+        if (!file || !file->regions->len || file->busy) {
+            job->skipped++;
+            continue;
+        }
+        job->counts[lockfile_path_check(path, file, &job->stats[i])]++;
+    }
+
+    g_info("refreshed %u paths: %" G_GUINT64_FORMAT " replaced, %"
+           G_GUINT64_FORMAT " vanished", job->paths->len,
+           job->counts[PATH_REPLACED], job->counts[PATH_VANISHED]);
+    client_reply(job->client, refresh_job_packfn, job);
+
+    g_ptr_array_free(job->paths, TRUE);
+    g_free(job->stats);
+    g_free(job);
+}
+
+void refresh_chunk_complete(gpointer data)
+{
+    struct refresh_chunk *chunk = (struct refresh_chunk *) data;
+    struct refresh_job *job = chunk->job;
+
+    g_free(chunk);
+    if (--job->pending == 0)
+        refresh_job_complete(job);
+}
+
+/* Runs in an aux_pool thread, on its own slice of the job */
+void refresh_worker(gpointer data)
+{
+    struct refresh_chunk *chunk = (struct refresh_chunk *) data;
+    struct refresh_job *job = chunk->job;
+    guint i;
+
+    for (i = chunk->from; i < chunk->to; i++)
+        path_stat(g_ptr_array_index(job->paths, i), &job->stats[i]);
+
+    complete_later(refresh_chunk_complete, chunk);
+}
+
+/* Stats every locked path in parallel, then swaps the inodes that were
+ * replaced and unlocks the paths that disappeared */
+void handle_refresh_request(struct pcma_client *client)
+{
+    struct refresh_job *job = g_new0(struct refresh_job, 1);
+    struct refresh_chunk *chunk;
+    GHashTableIter iter;
+    gpointer key;
+    guint i;
+
+    g_info("refresh request");
+
+    job->client = client;
+    job->paths = g_ptr_array_new_full(g_hash_table_size(lockfiles) +
+                                      g_hash_table_size(lockaliases),
+                                      g_free);
+    g_hash_table_iter_init(&iter, lockfiles);
+    while (g_hash_table_iter_next(&iter, &key, NULL))
+        g_ptr_array_add(job->paths, g_strdup(key));
+    g_hash_table_iter_init(&iter, lockaliases);
+    while (g_hash_table_iter_next(&iter, &key, NULL))
+        g_ptr_array_add(job->paths, g_strdup(key));
+    job->stats = g_new0(struct path_stat, job->paths->len);
+
+    if (!job->paths->len) {
+        refresh_job_complete(job);
+        return;
+    }
+
+    for (i = 0; i < job->paths->len; i += REFRESH_CHUNK) {
+        chunk = g_new(struct refresh_chunk, 1);
+        chunk->job = job;
+        chunk->from = i;
+        chunk->to = MIN(i + REFRESH_CHUNK, job->paths->len);
+        job->pending++;
+        run_aux(refresh_worker, chunk);
+    }
+}
+
+/* Key destructor for lockfiles: paths leaving the table are not watched.
+ * Keys are owned by their entry, as they outlive busy entries. */
+void lockfiles_key_destroy(gpointer p)
+{
+    GSequenceIter *iter = g_sequence_lookup(lockpaths, p, lockpaths_cmp,
+                                            NULL);
+
+    if (iter)
+        g_sequence_remove(iter);
+    watch_remove((const gchar *) p);
+}
+
+/* Value destructor for lockfiles: entries owned by a lock worker are only
+ * flagged, lock_job_complete destroys them */
+void lockfiles_value_destroy(gpointer p)
+{
+    struct mlockfile *f = (struct mlockfile *) p;
+    GList *t;
+
+    lockfiles_generation++;
+    lockfile_release(f);
+    lockinodes_remove(f);
+    for (t = f->aliases; t; t = t->next) {
+        g_hash_table_remove(lockaliases, t->data);
+        watch_remove(t->data);
+    }
+    g_list_free_full(f->aliases, g_free);
+    f->aliases = NULL;
+    for (t = f->tags; t; t = t->next)
+        tags_remove(t->data, f);
+    g_list_free(f->tags);
+    f->tags = NULL;
+    if (f->busy)
+        f->detached = TRUE;
+    else
+        mlockfile_destroy(f);
+}
+
+int range_packfn(msgpack_packer * pk, void *lr)
+{
+    struct lock_range *range = (struct lock_range *) lr;
+
+    msgpack_pack_array(pk, 2);
+    msgpack_pack_uint64(pk, range->offset);
+    msgpack_pack_uint64(pk, range->length);
+    return (0);
+}
+
+/* Returns why the path could not be unlocked, or NULL */
+const char *unlock_path(const gchar * path, struct lock_range *range)
+{
+    int ret;
+    struct mlockfile *file = lockfile_lookup(path);
+
+    if (!file) {
+        /* Unlocked under memory pressure, not to be locked again */
+        if (!shed_forget(path, range))
+            return (NULL);
+        g_warning("unlock_path could not find %s", path);
+        return ("not found");
+    }
+
+    if (range) {
+        if (file->busy)
+            return ("lock in progress");
+        lockfile_release(file);
+        ret = mlockfile_unlock_range(file, range->offset, range->length);
+        lockfile_charge(file);
+        if (ret > 0)
+            return ("range not found");
+        if (ret < 0) {
+            g_critical("unlock_path: mlockfile_unlock_range: %i", ret);
+            return ("could not unlock");
+        }
+        if (file->regions->len) {
+            g_info("unlocked a range of %s", path);
+            events_publish(EVENT_UNLOCK, path, file->mmappedsize,
+                           file->tags, range_packfn, range);
+            return (NULL);
+        }
+    }
+
+    /* The inode stays locked for its other paths */
+    if (!range && lockfile_path_remove(file, path)) {
+        g_info("unlocked %s", path);
+        events_publish(EVENT_UNLOCK, path, 0, file->tags, NULL, NULL);
+        return (NULL);
+    }
+
+    lockfile_publish_unlock(file, path);
+    if (!file->busy) {
+        ret = mlockfile_unlock(file);
+        if (ret < 0) {
+            g_critical("unlock_path: mlockfile_unlock: %i", ret);
+            return ("could not unlock");
+        }
+    }
+
+    if (g_hash_table_remove(lockfiles, file->path) == FALSE)
+        g_error("unlock_path: g_hash_table_remove failed");
+
+    g_info("unlocked %s", path);
+    return (NULL);
+}
+
+void handle_unlock_request(struct pcma_client *client, const gchar * path,
+                           struct lock_range *range)
+{
+    const char *errmsg;
+
+    g_info("unlock request (%s)", path);
+
+    if ((errmsg = unlock_path(path, range)))
+        client_reply(client, failed_packfn, (void *) errmsg);
+    else
+        client_reply(client, empty_ok_packfn, NULL);
+}
+
+struct release_tag_data {
+    guint64 untagged;
+    guint64 unlocked;
+    guint64 untouched;
+    guint64 failed;
+    const gchar *tag;
+};
+
+void shed_release_tag(struct release_tag_data *data);
+
+int release_tag_data_packfn(msgpack_packer * pk, void *rtdp)
+{
+    struct release_tag_data *data = (struct release_tag_data *) rtdp;
+    msgpack_pack_array(pk, 2);
+    msgpack_pack_true(pk);
+    msgpack_pack_array(pk, 4);
+    msgpack_pack_uint64(pk, data->untagged);
+    msgpack_pack_uint64(pk, data->unlocked);
+    msgpack_pack_uint64(pk, data->untouched);
+    msgpack_pack_uint64(pk, data->failed);
+    return (0);
+}
+
+/* Returns TRUE when the file should leave lockfiles */
+gboolean releasetag(gpointer key, gpointer value, gpointer user_data)
+{
+    struct release_tag_data *data = user_data;
+    struct mlockfile *file = (struct mlockfile *) value;
+    GList *found = NULL;
+    int ret;
+
+    found = g_list_find_custom(file->tags, data->tag, g_strcmp0);
+    if (found) {
+        events_publish(EVENT_RELEASETAG, file->path, file->mmappedsize,
+                       file->tags, string_packfn, (gpointer) data->tag);
+        /* Under the tag too, for its subscribers */
+        if (!file->tags->next)
+            lockfile_publish_unlock(file, file->path);
+        lockfile_release(file);
+        file->tags = g_list_remove(file->tags, found->data);
+        tags_remove(data->tag, file);
+        lockfile_charge(file);
+        data->untagged++;
+
+        if (g_list_length(file->tags) == 0) {
+            if (file->busy) {
+                data->unlocked++;
+                return TRUE;
+            }
+
+            ret = mlockfile_unlock(file);
+            if (ret < 0) {
+                g_critical("releasetag: mlockfile_unlock: %i", ret);
+                data->failed++;
+            } else {
+                data->unlocked++;
+            }
+
+            return TRUE;
+        }
+    } else {
+        data->untouched++;
+    }
+    return FALSE;
+}
+
+void handle_releasetag_request(struct pcma_client *client,
+                               const gchar * tag)
+{
+    struct release_tag_data data = { 0, 0, 0, 0, NULL };
+    GHashTable *tagged = tags_files(tag);
+    struct mlockfile *file;
+    GList *files, *f;
+
+    data.tag = tag;
+
+    g_info("releasetag request (%s)", tag);
+
+    /* Only files carrying the tag are looked at */
+    data.untouched = g_hash_table_size(lockfiles);
+    files = tagged ? g_hash_table_get_keys(tagged) : NULL;
+    for (f = files; f; f = f->next) {
+        file = (struct mlockfile *) f->data;
+        data.untouched--;
+        if (releasetag(file->path, file, &data) &&
+            g_hash_table_remove(lockfiles, file->path) == FALSE)
+            g_error("handle_releasetag_request: g_hash_table_remove failed");
+    }
+    g_list_free(files);
+    shed_release_tag(&data);
+
+    if (data.untagged == 0) {
+        g_warning("handle_releasetag_request: nothing was tagged %s", tag);
+        client_reply(client, failed_packfn, "nothing was tagged");
+    } else
+        client_reply(client, release_tag_data_packfn, &data);
+}
+
+/* glib allocates these per entry, on top of what entries point to */
+#define HASH_SLOT_SIZE (2 * sizeof(gpointer) + sizeof(guint))
+#define SEQUENCE_NODE_SIZE (2 * sizeof(guint32) + 4 * sizeof(gpointer))
+
+void stats_uint_pack(msgpack_packer * pk, const char *key, guint64 value)
+{
+    string_pack((gpointer) key, pk);
+    msgpack_pack_uint64(pk, value);
+}
+
+void restore_stats_pack(msgpack_packer * pk, struct restore *r)
+{
+    gint64 end = r->finished ? r->finished : g_get_monotonic_time();
+
+    string_pack("restore", pk);
+    msgpack_pack_map(pk, 7);
+    stats_uint_pack(pk, "total", r->total);
+    stats_uint_pack(pk, "done", r->done);
+    stats_uint_pack(pk, "failed", r->failed);
+    stats_uint_pack(pk, "replaced", r->replaced);
+    stats_uint_pack(pk, "bytes", r->bytes);
+    stats_uint_pack(pk, "elapsed_ms", (end - r->started) / 1000);
+    string_pack("running", pk);
+    if (r->finished)
+        msgpack_pack_false(pk);
+    else
+        msgpack_pack_true(pk);
+}
+
+int stats_packfn(msgpack_packer * pk, void *ignored)
+{
+    GHashTableIter iter;
+    gpointer value;
+    guint files = g_hash_table_size(lockfiles);
+    guint aliases = g_hash_table_size(lockaliases);
+    guint64 entries = 0, tables, tags = tags_memory(), total;
+
+    g_hash_table_iter_init(&iter, lockfiles);
+    while (g_hash_table_iter_next(&iter, NULL, &value))
+        entries += mlockfile_memory(value);
+    tables = files * (HASH_SLOT_SIZE + SEQUENCE_NODE_SIZE) +
+        (aliases + g_hash_table_size(lockinodes)) * HASH_SLOT_SIZE;
+    total = entries + tables + tags;
+
+    msgpack_pack_array(pk, 2);
+    msgpack_pack_true(pk);
+    msgpack_pack_map(pk, 9 + (restoring ? 1 : 0) + (shedding ? 1 : 0));
+    stats_uint_pack(pk, "files", files);
+    stats_uint_pack(pk, "aliases", aliases);
+    stats_uint_pack(pk, "tags", tags_count());
+    string_pack("memory", pk);
+    msgpack_pack_map(pk, 5);
+    stats_uint_pack(pk, "entries", entries);
+    stats_uint_pack(pk, "tables", tables);
+    stats_uint_pack(pk, "tags", tags);
+    stats_uint_pack(pk, "total", total);
+    stats_uint_pack(pk, "per_file", files ? total / files : 0);
+    string_pack("budget", pk);
+    budget_pack(pk);
+    metrics_pack(pk);
+    throttle_pack(pk);
+    if (restoring)
+        restore_stats_pack(pk, restoring);
+    if (shedding)
+        shedding_stats_pack(pk);
+    return (0);
+}
+
+void handle_stats_request(struct pcma_client *client)
+{
+    g_info("stats request");
+
+    client_reply(client, stats_packfn, NULL);
+}
+
+void announce_failure(struct pcma_client *client, char *msg)
+{
+    g_warning("handle_req: %s", msg);
+    client_reply(client, failed_packfn, msg);
+}
+
+/* Parses an [offset, length] pair */
+int parse_range(msgpack_object * obj, struct lock_range *range)
+{
+    if (obj->type != MSGPACK_OBJECT_ARRAY || obj->via.array.size != 2 ||
+        obj->via.array.ptr[0].type != MSGPACK_OBJECT_POSITIVE_INTEGER ||
+        obj->via.array.ptr[1].type != MSGPACK_OBJECT_POSITIVE_INTEGER)
+        return (-1);
+
+    range->offset = obj->via.array.ptr[0].via.u64;
+    range->length = obj->via.array.ptr[1].via.u64;
+    return (0);
+}
+
+/* Parses a list of [offset, length] pairs, *ranges is left NULL if empty */
+int parse_ranges(msgpack_object * obj, GArray ** ranges)
+{
+    int i;
+    struct lock_range range;
+
+    if (obj->type != MSGPACK_OBJECT_ARRAY)
+        return (-1);
+
+    for (i = 0; i < obj->via.array.size; i++) {
+        if (parse_range(&obj->via.array.ptr[i], &range) < 0)
+            return (-2);
+        if (!*ranges)
+            *ranges = g_array_new(FALSE, FALSE, sizeof(struct lock_range));
+        g_array_append_val(*ranges, range);
+    }
+    return (0);
+}
+
+/* Appends the strings of a list to *strings, skipping other objects */
+int parse_strings(msgpack_object * obj, GList ** strings)
+{
+    int i;
+    gchar *str;
+
+    if (obj->type != MSGPACK_OBJECT_ARRAY)
+        return (-1);
+
+    for (i = 0; i < obj->via.array.size; i++) {
+        if (obj->via.array.ptr[i].type != MSGPACK_OBJECT_RAW)
+            continue;           /* drops a format error silently */
+        if (!(str = raw_to_string(&obj->via.array.ptr[i].via.raw)))
+            return (-2);
+        *strings = g_list_prepend(*strings, str);
+    }
+    return (0);
+}
+
+gboolean raw_equals(msgpack_object_raw * raw, const char *str)
+{
+    return (raw->size == strlen(str) && !bcmp(raw->ptr, str, raw->size));
+}
+
+/* Parses a map of list options */
+int parse_list_query(msgpack_object * obj, struct list_query *q)
+{
+    msgpack_object_kv *kv;
+    msgpack_object_raw *key;
+    gchar **str;
+    guint64 *num;
+    guint i;
+
+    if (obj->type != MSGPACK_OBJECT_MAP)
+        return (-1);
+
+    for (i = 0; i < obj->via.map.size; i++) {
+        kv = &obj->via.map.ptr[i];
+        if (kv->key.type != MSGPACK_OBJECT_RAW)
+            return (-2);
+        key = &kv->key.via.raw;
+        str = NULL;
+        num = NULL;
+
+        if (raw_equals(key, LIST_CURSOR))
+            str = &q->cursor;
+        else if (raw_equals(key, LIST_PREFIX))
+            str = &q->prefix;
+        else if (raw_equals(key, LIST_TAG))
+            str = &q->tag;
+        else if (raw_equals(key, LIST_LIMIT))
+            num = &q->limit;
+        else if (raw_equals(key, LIST_STREAM))
+            num = &q->stream;
+        else
+            return (-3);
+
+        if (str && kv->val.type == MSGPACK_OBJECT_RAW) {
+            free(*str);
+            if (!(*str = raw_to_string(&kv->val.via.raw)))
+                return (-4);
+        } else if (num && kv->val.type == MSGPACK_OBJECT_POSITIVE_INTEGER) {
+            *num = kv->val.via.u64;
+        } else {
+            return (-5);
+        }
+    }
+    return (0);
+}
+
+/* Parses a path, or a [path, tags?, ranges?] list */
+int parse_lock_entry(msgpack_object * obj, gchar ** path, GList ** tags,
+                     GArray ** ranges)
+{
+    if (obj->type == MSGPACK_OBJECT_ARRAY && obj->via.array.size > 0) {
+        if ((obj->via.array.size > 1 &&
+             parse_strings(&obj->via.array.ptr[1], tags) < 0) ||
+            (obj->via.array.size > 2 &&
+             parse_ranges(&obj->via.array.ptr[2], ranges) < 0))
+            return (-1);
+        obj = &obj->via.array.ptr[0];
+    }
+    if (obj->type != MSGPACK_OBJECT_RAW)
+        return (-2);
+    if (!(*path = raw_to_string(&obj->via.raw)))
+        return (-3);
+    return (0);
+}
+
+/* Parses a map of lock options, leaving unset ones untouched */
+int parse_lock_options(msgpack_object * obj, int *strategy, guint64 * rate)
+{
+    msgpack_object_kv *kv;
+    int i;
+
+    if (obj->type != MSGPACK_OBJECT_MAP)
+        return (-1);
+
+    for (i = 0; i < obj->via.map.size; i++) {
+        kv = &obj->via.map.ptr[i];
+        if (kv->key.type != MSGPACK_OBJECT_RAW)
+            return (-2);
+        if (raw_equals(&kv->key.via.raw, LOCK_STRATEGY)) {
+            if (kv->val.type != MSGPACK_OBJECT_RAW)
+                return (-3);
+            *strategy = mlock_strategy_parse(kv->val.via.raw.ptr,
+                                             kv->val.via.raw.size);
+            if (*strategy < 0)
+                return (-3);
+        } else if (raw_equals(&kv->key.via.raw, LOCK_RATE)) {
+            if (kv->val.type != MSGPACK_OBJECT_POSITIVE_INTEGER)
+                return (-3);
+            *rate = kv->val.via.u64;
+        } else {
+            return (-4);
+        }
+    }
+    return (0);
+}
+
+void lock_entry_free(gchar * path, GList * tags, GArray * ranges)
+{
+    free(path);
+    if (tags)
+        g_list_free_full(tags, free);
+    if (ranges)
+        g_array_free(ranges, TRUE);
+}
+
+/* Packs [path, tags, ranges, size, dev, ino, strategy] */
+void state_entry_pack(msgpack_packer * pk, const gchar * path,
+                      struct mlockfile *f)
+{
+    struct mlockregion *r;
+    guint i;
+
+    msgpack_pack_array(pk, 7);
+    string_pack((gpointer) path, pk);
+    msgpack_pack_array(pk, g_list_length(f->tags));
+    g_list_foreach(f->tags, string_pack, pk);
+    msgpack_pack_array(pk, f->regions->len);
+    for (i = 0; i < f->regions->len; i++) {
+        r = &g_array_index(f->regions, struct mlockregion, i);
+        msgpack_pack_array(pk, 2);
+        msgpack_pack_uint64(pk, r->offset);
+        msgpack_pack_uint64(pk, r->length);
+    }
+    msgpack_pack_uint64(pk, f->size);
+    msgpack_pack_uint64(pk, f->dev);
+    msgpack_pack_uint64(pk, f->ino);
+    r = &g_array_index(f->regions, struct mlockregion, 0);
+    string_pack((gpointer) mlock_strategy_name(r->strategy), pk);
+}
+
+/* Packs a parsed entry as state_entry_pack does */
+void restore_entry_pack(msgpack_packer * pk, struct restore_entry *entry)
+{
+    struct lock_range *r;
+    guint i, n = entry->ranges ? entry->ranges->len : 0;
+
+    msgpack_pack_array(pk, 7);
+    string_pack(entry->path, pk);
+    msgpack_pack_array(pk, g_list_length(entry->tags));
+    g_list_foreach(entry->tags, string_pack, pk);
+    msgpack_pack_array(pk, n);
+    for (i = 0; i < n; i++) {
+        r = &g_array_index(entry->ranges, struct lock_range, i);
+        msgpack_pack_array(pk, 2);
+        msgpack_pack_uint64(pk, r->offset);
+        msgpack_pack_uint64(pk, r->length);
+    }
+    msgpack_pack_uint64(pk, entry->size);
+    msgpack_pack_uint64(pk, entry->dev);
+    msgpack_pack_uint64(pk, entry->ino);
+    string_pack((gpointer) mlock_strategy_name(entry->strategy), pk);
+}
+
+/* Packs [STATE_VERSION, [entry, ...]], aliases being saved as entries of
+ * their own: restored, they share the lock again. Files shed under
+ * memory pressure are saved too. */
+int state_packfn(msgpack_packer * pk, void *ignored)
+{
+    GHashTableIter iter;
+    gpointer value;
+    struct mlockfile *f;
+    struct shed_tier *tier;
+    GList *a, *t;
+    guint count = 0, i;
+
+    for (t = shedding ? shedding->tiers->head : NULL; t; t = t->next)
+        count += ((struct shed_tier *) t->data)->entries->len;
+
+    g_hash_table_iter_init(&iter, lockfiles);
+    while (g_hash_table_iter_next(&iter, NULL, &value))
+        if (((struct mlockfile *) value)->regions->len)
+            count += 1 + g_list_length(((struct mlockfile *)
+                                        value)->aliases);
+
+    msgpack_pack_array(pk, 2);
+    msgpack_pack_uint32(pk, STATE_VERSION);
+    msgpack_pack_array(pk, count);
+    g_hash_table_iter_init(&iter, lockfiles);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        f = (struct mlockfile *) value;
+        if (!f->regions->len)
+            continue;
+        state_entry_pack(pk, f->path, f);
+        for (a = f->aliases; a; a = a->next)
+            state_entry_pack(pk, a->data, f);
+    }
+    for (t = shedding ? shedding->tiers->head : NULL; t; t = t->next) {
+        tier = (struct shed_tier *) t->data;
+        for (i = 0; i < tier->entries->len; i++)
+            restore_entry_pack(pk, g_ptr_array_index(tier->entries, i));
+    }
+    return (0);
+}
+
+static guint64 saved_generation = 0;
+static gint64 save_deadline = -1;
+
+/* Saves the state, from the writer thread unless now is set */
+void state_save(gboolean now)
+{
+    msgpack_sbuffer *buffer = packed_new(state_packfn, NULL);
+
+    saved_generation = lockfiles_generation;
+    save_deadline = -1;
+    if (now)
+        state_write_now(buffer);
+    else
+        state_write(buffer);
+}
+
+/* Whether the state should be saved, not while it is being restored */
+gboolean state_dirty()
+{
+    return (state_enabled && saved_generation != lockfiles_generation &&
+            (!restoring || restoring->finished));
+}
+
+/* Microseconds until the state is due to be saved, -1 if it is not.
+ * Saves are delayed so that bursts of changes are written once. */
+glong state_timeout()
+{
+    gint64 now;
+
+    if (!state_dirty())
+        return (-1);
+
+    now = g_get_monotonic_time();
+    if (save_deadline < 0)
+        save_deadline = now + STATE_SAVE_DELAY * 1000;
+    return (save_deadline > now ? save_deadline - now : 0);
+}
+
+void state_check()
+{
+    if (state_dirty() && save_deadline >= 0 &&
+        g_get_monotonic_time() >= save_deadline)
+        state_save(FALSE);
+}
+
+void restore_entry_free(gpointer p)
+{
+    struct restore_entry *entry = (struct restore_entry *) p;
+
+    lock_entry_free(entry->path, entry->tags, entry->ranges);
+    g_free(entry);
+}
+
+gint restore_entry_cmp(gconstpointer a, gconstpointer b)
+{
+    const struct restore_entry *ea = *(struct restore_entry **) a;
+    const struct restore_entry *eb = *(struct restore_entry **) b;
+
+    if (ea->priority != eb->priority)
+        return (ea->priority < eb->priority ? -1 : 1);
+    return (ea->order < eb->order ? -1 : ea->order > eb->order);
+}
+
+/* Rank of the first of the tags listed with -p, after all of them if none */
+guint restore_priority(GList * tags)
+{
+    guint i, best = restore_priorities ? restore_priorities->len : 0;
+    GList *t;
+
+    for (t = tags; t; t = t->next)
+        for (i = 0; i < best; i++)
+            if (!strcmp(t->data, g_ptr_array_index(restore_priorities, i)))
+                best = i;
+    return (best);
+}
+
+/* Parses [path, tags, ranges, size, dev, ino, strategy?] */
+struct restore_entry *restore_entry_parse(msgpack_object * obj)
+{
+    struct restore_entry *entry;
+    msgpack_object *fields = obj->via.array.ptr;
+    int i, strategy = default_strategy;
+
+    if (obj->type != MSGPACK_OBJECT_ARRAY || obj->via.array.size < 6)
+        return (NULL);
+    for (i = 3; i < 6; i++)
+        if (fields[i].type != MSGPACK_OBJECT_POSITIVE_INTEGER)
+            return (NULL);
+
+    if (obj->via.array.size > 6 &&
+        (fields[6].type != MSGPACK_OBJECT_RAW ||
+         (strategy = mlock_strategy_parse(fields[6].via.raw.ptr,
+                                          fields[6].via.raw.size)) < 0))
+        return (NULL);
+
+    entry = g_new0(struct restore_entry, 1);
+    entry->strategy = strategy;
+    if (parse_lock_entry(obj, &entry->path, &entry->tags,
+                         &entry->ranges) < 0) {
+        restore_entry_free(entry);
+        return (NULL);
+    }
+    entry->size = fields[3].via.u64;
+    entry->dev = fields[4].via.u64;
+    entry->ino = fields[5].via.u64;
+    entry->priority = restore_priority(entry->tags);
+    return (entry);
+}
+
+/* Loads the saved entries, to be locked by restore_dispatch */
+int restore_load(struct restore *r)
+{
+    gchar *contents;
+    gsize length;
+    msgpack_unpacked unpacked;
+    msgpack_object *obj, *entries;
+    struct restore_entry *entry;
+    int ret;
+    guint i;
+
+    if ((ret = state_read(&contents, &length)) != 0)
+        return (ret);
+
+    msgpack_unpacked_init(&unpacked);
+    if (!msgpack_unpack_next(&unpacked, contents, length, NULL)) {
+        g_critical("restore_load: cannot unpack the saved state");
+        ret = -2;
+        goto out;
+    }
+    obj = &unpacked.data;
+    if (obj->type != MSGPACK_OBJECT_ARRAY || obj->via.array.size != 2 ||
+        obj->via.array.ptr[0].type != MSGPACK_OBJECT_POSITIVE_INTEGER ||
+        obj->via.array.ptr[1].type != MSGPACK_OBJECT_ARRAY) {
+        g_critical("restore_load: malformed saved state");
+        ret = -3;
+        goto out;
+    }
+    if (obj->via.array.ptr[0].via.u64 != STATE_VERSION) {
+        g_critical("restore_load: unsupported state version %"
+                   G_GUINT64_FORMAT, obj->via.array.ptr[0].via.u64);
+        ret = -4;
+        goto out;
+    }
+
+    entries = &obj->via.array.ptr[1];
+    for (i = 0; i < entries->via.array.size; i++) {
+        if (!(entry = restore_entry_parse(&entries->via.array.ptr[i]))) {
+            g_warning("restore_load: skipping malformed entry %u", i);
+            r->failed++;
+            continue;
+        }
+        entry->order = i;
+        g_ptr_array_add(r->entries, entry);
+    }
+    g_ptr_array_sort(r->entries, restore_entry_cmp);
+    r->total = entries->via.array.size;
+
+  out:
+    msgpack_unpacked_destroy(&unpacked);
+    g_free(contents);
+    return (ret);
+}
+
+/* Keeps depth lock jobs in flight until every entry is done */
+void restore_dispatch(gpointer ignored)
+{
+    struct restore *r = restoring;
+    struct restore_entry *entry;
+    struct lock_job *job;
+
+    while (r->inflight < r->depth && r->next < r->entries->len) {
+        entry = g_ptr_array_index(r->entries, r->next++);
+        job = lock_job_new(NULL, entry->path, entry->tags, entry->ranges);
+        job->strategy = entry->strategy;
+        job->restore = entry;
+        r->inflight++;
+        lock_job_dispatch(job);
+    }
+
+    if (r->inflight || r->next < r->entries->len || r->finished)
+        return;
+
+    r->finished = g_get_monotonic_time();
+    g_info("restored %" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT
+           " files (%" G_GUINT64_FORMAT " bytes, %" G_GUINT64_FORMAT
+           " replaced) in %" G_GINT64_FORMAT " ms", r->done, r->total,
+           r->bytes, r->replaced, (r->finished - r->started) / 1000);
+    g_ptr_array_free(r->entries, TRUE);
+    r->entries = NULL;
+    /* Drops what could not be restored from the saved state */
+    lockfiles_generation++;
+}
+
+/* Called for each restored entry as its lock job completes */
+void restore_done(struct restore_entry *entry, struct mlockfile *locked)
+{
+    struct restore *r = restoring;
+
+    r->inflight--;
+    if (!locked) {
+        r->failed++;
+    } else {
+        r->done++;
+        r->bytes += locked->mmappedsize;
+        if (locked->dev != entry->dev || locked->ino != entry->ino) {
+            g_info("%s was replaced since the state was saved",
+                   entry->path);
+            r->replaced++;
+        } else if (locked->size != entry->size) {
+            g_info("%s was resized since the state was saved",
+                   entry->path);
+        }
+    }
+    /* The entry still belongs to the job */
+    complete_later(restore_dispatch, NULL);
+}
+
+/* Relocks what was saved, most important tags first */
+void restore_start(int workers)
+{
+    struct restore *r = g_new0(struct restore, 1);
+
+    r->entries = g_ptr_array_new_with_free_func(restore_entry_free);
+    r->depth = workers * 2;
+    r->started = g_get_monotonic_time();
+    restoring = r;
+
+    if (restore_load(r) < 0)
+        g_warning("restore_start: not restoring the saved state");
+    g_info("restoring %u files", r->entries->len);
+    restore_dispatch(NULL);
+}
+
+int priority_packfn(msgpack_packer * pk, void *p)
+{
+    msgpack_pack_int(pk, *(gint *) p);
+    return (0);
+}
+
+/* Parsed state entry of one of the entry's paths */
+struct restore_entry *state_entry_copy(const gchar * path,
+                                       struct mlockfile *f)
+{
+    msgpack_sbuffer *buffer = msgpack_sbuffer_new();
+    msgpack_packer pk;
+    msgpack_unpacked unpacked;
+    struct restore_entry *entry = NULL;
+
+    msgpack_packer_init(&pk, buffer, msgpack_sbuffer_write);
+    state_entry_pack(&pk, path, f);
+    msgpack_unpacked_init(&unpacked);
+    if (msgpack_unpack_next(&unpacked, buffer->data, buffer->size, NULL))
+        entry = restore_entry_parse(&unpacked.data);
+    msgpack_unpacked_destroy(&unpacked);
+    msgpack_sbuffer_free(buffer);
+    return (entry);
+}
+
+void shed_tier_add(struct shed_tier *tier, const gchar * path,
+                   struct mlockfile *f)
+{
+    struct restore_entry *entry = state_entry_copy(path, f);
+
+    if (entry)
+        g_ptr_array_add(tier->entries, entry);
+    else
+        g_critical("shed_tier_add: cannot copy the entry of %s", path);
+}
+
+/*
+ * Under memory pressure, files of the lowest priority still locked are
+ * unlocked, one priority at a time on every PSI trigger, the files of the
+ * highest priority being kept. Their state entries are kept aside, and
+ * locked again in the reverse order as calm periods go by; unlocking
+ * them or releasing their tags meanwhile forgets them.
+ */
+void shed_next(gpointer ignored)
+{
+    GHashTableIter iter;
+    gpointer value;
+    struct mlockfile *f;
+    struct shed_tier *tier;
+    GPtrArray *victims;
+    gint lowest = G_MAXINT, highest = G_MININT, priority;
+    GList *a;
+    guint i;
+
+    shedding->triggers++;
+    g_hash_table_iter_init(&iter, lockfiles);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        f = (struct mlockfile *) value;
+        if (f->busy || !f->regions->len)
+            continue;
+        priority = pressure_priority(f->tags);
+        lowest = MIN(lowest, priority);
+        highest = MAX(highest, priority);
+    }
+    if (lowest >= highest) {
+        g_warning("memory pressure, but no file can be unlocked");
+        return;
+    }
+
+    victims = g_ptr_array_new();
+    g_hash_table_iter_init(&iter, lockfiles);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        f = (struct mlockfile *) value;
+        if (!f->busy && f->regions->len &&
+            pressure_priority(f->tags) == lowest)
+            g_ptr_array_add(victims, f);
+    }
+
+    tier = g_new0(struct shed_tier, 1);
+    tier->priority = lowest;
+    tier->entries = g_ptr_array_new_with_free_func(restore_entry_free);
+    tier->shed = g_get_monotonic_time();
+    for (i = 0; i < victims->len; i++) {
+        f = g_ptr_array_index(victims, i);
+        shed_tier_add(tier, f->path, f);
+        for (a = f->aliases; a; a = a->next)
+            shed_tier_add(tier, a->data, f);
+        tier->files++;
+        tier->bytes += f->mmappedsize;
+        events_publish(EVENT_SHED, f->path, f->mmappedsize, f->tags,
+                       priority_packfn, &lowest);
+        lockfile_publish_unlock(f, f->path);
+        if (mlockfile_unlock(f) < 0)
+            g_critical("shed_next: could not unlock %s", f->path);
+        if (g_hash_table_remove(lockfiles, f->path) == FALSE)
+            g_error("shed_next: g_hash_table_remove failed");
+    }
+    g_ptr_array_free(victims, TRUE);
+
+    shedding->shed += tier->files;
+    g_queue_push_head(shedding->tiers, tier);
+    g_warning("memory pressure: unlocked %u files of priority %i (%"
+              G_GUINT64_FORMAT " bytes)", tier->files, lowest, tier->bytes);
+}
+
+void shed_tier_free(struct shed_tier *tier)
+{
+    g_ptr_array_free(tier->entries, TRUE);
+    g_free(tier);
+}
+
+void unshed_last(gpointer ignored)
+{
+    struct shed_tier *tier = g_queue_pop_head(shedding->tiers);
+    struct restore_entry *entry;
+    struct lock_job *job;
+    guint i;
+
+    if (!tier)
+        return;
+
+    g_info("memory pressure subsided: locking %u files of priority %i (%"
+           G_GUINT64_FORMAT " bytes) again", tier->files, tier->priority,
+           tier->bytes);
+    for (i = 0; i < tier->entries->len; i++) {
+        entry = g_ptr_array_index(tier->entries, i);
+        job = lock_job_new(NULL, entry->path, entry->tags, entry->ranges);
+        job->strategy = entry->strategy;
+        events_publish(EVENT_UNSHED, entry->path, entry->size, job->tags,
+                       priority_packfn, &tier->priority);
+        lock_job_dispatch(job);
+    }
+    shedding->restored += tier->files;
+    shed_tier_free(tier);
+    /* The state no longer holds the entries until their locks complete */
+    lockfiles_generation++;
+}
+
+/* Drops an entry of a tier, and the tier once empty. Returns FALSE once
+ * the tier is gone. */
+gboolean shed_tier_remove(struct shed_tier *tier, guint i)
+{
+    struct restore_entry *entry = g_ptr_array_index(tier->entries, i);
+    struct restore_entry *other;
+    guint64 bytes = entry->size;
+    guint j;
+
+    lockfiles_generation++;
+    for (j = 0; j < tier->entries->len; j++) {
+        other = g_ptr_array_index(tier->entries, j);
+        /* Another path of the same file */
+        if (j != i && other->dev == entry->dev && other->ino == entry->ino)
+            break;
+    }
+    if (j == tier->entries->len) {
+        if (entry->ranges) {
+            bytes = 0;
+            for (j = 0; j < entry->ranges->len; j++)
+                bytes += g_array_index(entry->ranges, struct lock_range,
+                                       j).length;
+        }
+        tier->files--;
+        tier->bytes -= MIN(tier->bytes, bytes);
+    }
+    g_ptr_array_remove_index(tier->entries, i);
 
-    msgpack_pack_map(pk, g_hash_table_size(lockfiles));
-    g_hash_table_foreach(lockfiles, lockfiles_entry_packfn, (gpointer) pk);
-    return (0);
+    if (tier->entries->len)
+        return (TRUE);
+    g_queue_remove(shedding->tiers, tier);
+    shed_tier_free(tier);
+    return (FALSE);
 }
 
-int failed_packfn(msgpack_packer * pk, void *msg)
+/* Forgets a shed path, or a range of it, as unlock_path would have
+ * unlocked it. Returns why it could not, or NULL. */
+const char *shed_forget(const gchar * path, struct lock_range *range)
 {
-    size_t msg_length = strlen((char *) msg);
-
-    msgpack_pack_array(pk, 2);
-    msgpack_pack_false(pk);
-
-    msgpack_pack_raw(pk, msg_length);
-    msgpack_pack_raw_body(pk, msg, msg_length);
-    return (0);
+    struct shed_tier *tier;
+    struct restore_entry *entry;
+    struct lock_range *r;
+    GList *t;
+    guint i, j;
+
+    for (t = shedding ? shedding->tiers->head : NULL; t; t = t->next) {
+        tier = (struct shed_tier *) t->data;
+        for (i = 0; i < tier->entries->len; i++) {
+            entry = g_ptr_array_index(tier->entries, i);
+            if (strcmp(entry->path, path))
+                continue;
+            if (range) {
+                for (j = 0; entry->ranges && j < entry->ranges->len; j++) {
+                    r = &g_array_index(entry->ranges, struct lock_range, j);
+                    if (r->offset == range->offset &&
+                        r->length == range->length)
+                        break;
+                }
+                if (!entry->ranges || j == entry->ranges->len)
+                    return ("range not found");
+                g_array_remove_index(entry->ranges, j);
+                if (entry->ranges->len) {
+                    lockfiles_generation++;
+                    g_info("forgot a shed range of %s", path);
+                    return (NULL);
+                }
+            }
+            shed_tier_remove(tier, i);
+            g_info("forgot shed %s", path);
+            return (NULL);
+        }
+    }
+    return ("not found");
 }
 
-int empty_ok_packfn(msgpack_packer * pk, void *ignored)
+/* Releases a tag from shed entries, see releasetag */
+void shed_release_tag(struct release_tag_data *data)
 {
-    msgpack_pack_array(pk, 1);
-    msgpack_pack_true(pk);
-    return (0);
+    struct shed_tier *tier;
+    struct restore_entry *entry;
+    GList *t, *next, *found;
+    guint i;
+
+    for (t = shedding ? shedding->tiers->head : NULL; t; t = next) {
+        next = t->next;
+        tier = (struct shed_tier *) t->data;
+        for (i = tier->entries->len; i-- > 0;) {
+            entry = g_ptr_array_index(tier->entries, i);
+            if (!(found = g_list_find_custom(entry->tags, data->tag,
+                                             g_strcmp0)))
+                continue;
+            free(found->data);
+            entry->tags = g_list_delete_link(entry->tags, found);
+            lockfiles_generation++;
+            data->untagged++;
+            if (entry->tags)
+                continue;
+            data->unlocked++;
+            if (!shed_tier_remove(tier, i))
+                break;
+        }
+    }
 }
 
-void handle_ping_request(void *socket)
+/* Called from the pressure thread */
+void pressure_changed(gboolean high)
 {
-    g_info("ping request");
-
-    pcma_send(socket, empty_ok_packfn, NULL);
+    complete_later(high ? shed_next : unshed_last, NULL);
 }
 
-void handle_list_request(void *socket)
+void shedding_stats_pack(msgpack_packer * pk)
 {
-    g_info("list request");
-
-    int ret = pcma_send(socket, lockfiles_packfn, lockfiles);
-    if (ret < 0)
-        g_critical("handle_list_request: pcma_send: %i", ret);
+    gint64 now = g_get_monotonic_time();
+    struct shed_tier *tier;
+    GList *t;
+
+    string_pack("pressure", pk);
+    msgpack_pack_map(pk, 4);
+    stats_uint_pack(pk, "triggers", shedding->triggers);
+    stats_uint_pack(pk, "shed", shedding->shed);
+    stats_uint_pack(pk, "restored", shedding->restored);
+    string_pack("tiers", pk);
+    msgpack_pack_array(pk, g_queue_get_length(shedding->tiers));
+    for (t = shedding->tiers->head; t; t = t->next) {
+        tier = (struct shed_tier *) t->data;
+        msgpack_pack_array(pk, 4);
+        msgpack_pack_int(pk, tier->priority);
+        msgpack_pack_uint64(pk, tier->files);
+        msgpack_pack_uint64(pk, tier->bytes);
+        msgpack_pack_uint64(pk, (now - tier->shed) / 1000);
+    }
 }
 
-void add_new_tags_to_mlockfile(gpointer data, gpointer user_data)
+static gboolean advice_equal(struct advice *a, struct advice *b)
 {
-    struct mlockfile *file = (struct mlockfile *) user_data;
-
-    if (!g_list_find_custom(file->tags, data, g_strcmp0))
-        file->tags = g_list_prepend(file->tags, g_strdup(data));
+    return (a->offset == b->offset && a->length == b->length &&
+            !strcmp(a->path, b->path));
 }
 
-void handle_lock_request(void *socket, const gchar * path, GList * tags)
+static gboolean advice_find(GPtrArray * list, struct advice *a)
 {
-    int ret;
+    guint i;
 
-    g_info("lock request (%s)", path);
+    for (i = 0; i < list->len; i++)
+        if (advice_equal(g_ptr_array_index(list, i), a))
+            return (TRUE);
+    return (FALSE);
+}
 
-    struct mlockfile *file, *found = g_hash_table_lookup(lockfiles, path);
+static gboolean advice_path_find(GPtrArray * list, const gchar * path)
+{
+    guint i;
+    struct advice *a;
 
-    if (found) {
-        g_debug("handle_lock_request: found lock for %s", path);
-        file = found;
-    } else {
-        g_debug("handle_lock_request: first lock for %s", path);
-        if (!(file = mlockfile_init(path))) {
-            g_critical("mlockfile_init failed");
-            pcma_send(socket, failed_packfn, "mlockfile_init failed");
-            return;
-        }
+    for (i = 0; i < list->len; i++) {
+        a = g_ptr_array_index(list, i);
+        if (!strcmp(a->path, path))
+            return (TRUE);
     }
+    return (FALSE);
+}
 
-    g_list_foreach(tags, add_new_tags_to_mlockfile, file);
-
-    ret = mlockfile_lock(path, file);
-    if (ret < 0) {
-        g_critical("mlockfile_lock: %i", ret);
-        pcma_send(socket, failed_packfn, "mlockfile_lock failed");
-        return;
-    }
+static void advice_keep(GPtrArray * list, struct advice *a)
+{
+    struct advice *kept = g_new(struct advice, 1);
 
-    if (!found)
-        g_hash_table_insert(lockfiles, g_strdup(path), file);
+    *kept = *a;
+    kept->path = g_strdup(a->path);
+    g_ptr_array_add(list, kept);
+}
 
-    ret = pcma_send(socket, mlockfile_packfn, file);
-    if (ret < 0)
-        g_critical("handle_lock_request: pcma_send: %i", ret);
+/* Whether the file has the range locked already */
+static gboolean advice_locked(struct mlockfile *file, struct advice *a)
+{
+    struct mlockregion *r;
+    guint i;
 
-    g_info("locked %s", path);
+    for (i = 0; i < file->regions->len; i++) {
+        r = &g_array_index(file->regions, struct mlockregion, i);
+        if (r->offset == a->offset && r->length == a->length)
+            return (TRUE);
+    }
+    return (FALSE);
 }
 
-void handle_unlock_request(void *socket, const gchar * path)
+/* Takes ADVISE_TAG off the file at path, as releasetag would */
+static void advise_release(const gchar * path)
 {
-    int ret;
-    struct mlockfile *file =
-        (struct mlockfile *) g_hash_table_lookup(lockfiles, path);
+    struct release_tag_data data = { 0, 0, 0, 0, ADVISE_TAG };
+    struct mlockfile *file = lockfile_lookup(path);
 
-    g_info("unlock request (%s)", path);
+    if (file && releasetag(file->path, file, &data) &&
+        g_hash_table_remove(lockfiles, file->path) == FALSE)
+        g_error("advise_release: g_hash_table_remove failed");
+}
 
-    if (!file) {
-        g_warning("handle_lock_request could not find %s", path);
-        pcma_send(socket, failed_packfn, "not found");
-        return;
+/*
+ * Locks the ranges selected by the advisor under ADVISE_TAG, unlocking
+ * those it locked last time and dropped since. Files locked by clients
+ * without the tag, and ranges locked already, are left alone, their pages
+ * being resident anyway; advised only tracks the ranges locked here.
+ */
+void advise_apply(gpointer data)
+{
+    GPtrArray *selected = (GPtrArray *) data, *applied;
+    GList tag = { ADVISE_TAG, NULL, NULL };
+    struct advice *a;
+    struct mlockfile *file;
+    struct lock_job *job;
+    struct lock_range range;
+    GArray *ranges;
+    const char *errmsg;
+    guint i, locked = 0, unlocked = 0;
+
+    if (!advised)
+        advised = g_ptr_array_new_with_free_func(advice_free);
+    applied = g_ptr_array_new_with_free_func(advice_free);
+
+    for (i = 0; i < advised->len; i++) {
+        a = g_ptr_array_index(advised, i);
+        file = lockfile_lookup(a->path);
+        if (advice_find(selected, a) || (file && file->busy)) {
+            /* Busy ones are unlocked on the next pass */
+            advice_keep(applied, a);
+            continue;
+        }
+        /* Clients releasing the tag took the range over */
+        if (!file || !g_list_find_custom(file->tags, ADVISE_TAG, g_strcmp0))
+            continue;
+        range.offset = a->offset;
+        range.length = a->length;
+        if ((errmsg = unlock_path(a->path, &range)))
+            g_warning("advise_apply: could not unlock a range of %s: %s",
+                      a->path, errmsg);
+        else
+            unlocked++;
     }
 
-    ret = mlockfile_unlock(file);
-    if (ret < 0) {
-        g_critical("handle_unlock_request: mlockfile_unlock: %i", ret);
-        pcma_send(socket, failed_packfn, "could not unlock");
-        return;
+    /* Files left with ranges locked by clients keep them, not the tag */
+    for (i = 0; i < advised->len; i++) {
+        a = g_ptr_array_index(advised, i);
+        if (!advice_path_find(selected, a->path) &&
+            !advice_path_find(applied, a->path))
+            advise_release(a->path);
     }
 
-    if (g_hash_table_remove(lockfiles, path) == FALSE)
-        g_error("handle_unlock_request: g_hash_table_remove failed");
+    for (i = 0; i < selected->len; i++) {
+        a = g_ptr_array_index(selected, i);
+        if (advice_find(applied, a))
+            continue;
+        file = lockfile_lookup(a->path);
+        if (file && (!g_list_find_custom(file->tags, ADVISE_TAG, g_strcmp0)
+                     || advice_locked(file, a)))
+            continue;
+        range.offset = a->offset;
+        range.length = a->length;
+        ranges = g_array_new(FALSE, FALSE, sizeof(struct lock_range));
+        g_array_append_val(ranges, range);
+        job = lock_job_new(NULL, a->path, &tag, ranges);
+        g_array_free(ranges, TRUE);
+        lock_job_dispatch(job);
+        advice_keep(applied, a);
+        locked++;
+    }
 
-    pcma_send(socket, empty_ok_packfn, NULL);
-    g_info("unlocked %s", path);
+    if (locked || unlocked)
+        g_info("advisor: locking %u ranges, unlocking %u", locked,
+               unlocked);
+    g_ptr_array_free(advised, TRUE);
+    g_ptr_array_free(selected, TRUE);
+    advised = applied;
 }
 
-struct release_tag_data {
-    guint64 untagged;
-    guint64 unlocked;
-    guint64 untouched;
-    guint64 failed;
-    const gchar *tag;
-};
+/* Called from the advisor thread */
+void advise_selected(GPtrArray * selected)
+{
+    complete_later(advise_apply, selected);
+}
 
-int release_tag_data_packfn(msgpack_packer * pk, void *rtdp)
+int advise_packfn(msgpack_packer * pk, void *count)
 {
-    struct release_tag_data *data = (struct release_tag_data *) rtdp;
     msgpack_pack_array(pk, 2);
     msgpack_pack_true(pk);
-    msgpack_pack_array(pk, 4);
-    msgpack_pack_uint64(pk, data->untagged);
-    msgpack_pack_uint64(pk, data->unlocked);
-    msgpack_pack_uint64(pk, data->untouched);
-    msgpack_pack_uint64(pk, data->failed);
+    advise_pack(pk, *(guint *) count);
     return (0);
 }
 
-gboolean releasetag(gpointer key, gpointer value, gpointer user_data)
+void handle_advise_request(struct pcma_client *client, guint count)
 {
-    struct release_tag_data *data = user_data;
-    struct mlockfile *file = (struct mlockfile *) value;
-    GList *found = NULL;
-    int ret;
-
-    found = g_list_find_custom(file->tags, data->tag, g_strcmp0);
-    if (found) {
-        file->tags = g_list_remove(file->tags, found->data);
-        data->untagged++;
-
-        if (g_list_length(file->tags) == 0) {
-            ret = mlockfile_unlock(file);
-            if (ret < 0) {
-                g_critical("releasetag: mlockfile_unlock: %i", ret);
-                data->failed++;
-            } else {
-                data->unlocked++;
-            }
+    g_info("advise request");
 
-            return TRUE;
-        }
-    } else {
-        data->untouched++;
-    }
-    return FALSE;
+    if (!advise_enabled())
+        client_reply(client, failed_packfn, "no directory is sampled");
+    else
+        client_reply(client, advise_packfn, &count);
 }
 
-void handle_releasetag_request(void *socket, const gchar * tag)
+/* Locks all entries concurrently, replying once with a result per entry */
+void handle_lockmany_request(struct pcma_client *client,
+                             msgpack_object * entries)
 {
-    struct release_tag_data data = { 0, 0, 0, 0, NULL };
-    data.tag = tag;
-
-    g_info("releasetag request (%s)", tag);
-
-    g_hash_table_foreach_remove(lockfiles, releasetag, &data);
+    struct lock_batch *batch = lock_batch_new(client, NULL);
+    struct lock_job *job;
+    msgpack_object *entry;
+    gchar *path;
+    GList *tags;
+    GArray *ranges;
+    int strategy;
+    guint64 rate;
+    guint i;
+
+    g_info("lockmany request (%u entries)", entries->via.array.size);
+
+    batch->results = packed_list_new(entries->via.array.size);
+
+    for (i = 0; i < entries->via.array.size; i++) {
+        path = NULL;
+        tags = NULL;
+        ranges = NULL;
+        entry = &entries->via.array.ptr[i];
+        strategy = default_strategy;
+        rate = 0;
+        if (parse_lock_entry(entry, &path, &tags, &ranges) < 0 ||
+            (entry->type == MSGPACK_OBJECT_ARRAY &&
+             entry->via.array.size > 3 &&
+             parse_lock_options(&entry->via.array.ptr[3], &strategy,
+                                &rate) < 0)) {
+            g_ptr_array_index(batch->results, i) =
+                packed_new(failed_packfn, "malformed entry");
+            batch->failed++;
+        } else {
+            job = lock_job_new(NULL, path, tags, ranges);
+            job->strategy = strategy;
+            if (rate)
+                job->throttle = throttle_new(rate, path);
+            job->batch = batch;
+            job->index = i;
+            batch->pending++;
+            lock_job_dispatch(job);
+        }
+        lock_entry_free(path, tags, ranges);
+    }
 
-    if (data.untagged == 0) {
-        g_warning("handle_releasetag_request: nothing was tagged %s", tag);
-        pcma_send(socket, failed_packfn, "nothing was tagged");
-    } else
-        pcma_send(socket, release_tag_data_packfn, &data);
+    lock_batch_check(batch);
 }
 
-void announce_failure(void *socket, char *msg)
+/* Entries are paths, or [path, [offset, length]] to unlock a range */
+void handle_unlockmany_request(struct pcma_client *client,
+                               msgpack_object * entries)
 {
-    g_warning("handle_req: %s", msg);
-    pcma_send(socket, failed_packfn, msg);
+    GPtrArray *results = packed_list_new(entries->via.array.size);
+    msgpack_object *entry;
+    struct lock_range range, *r;
+    const char *errmsg;
+    gchar *path;
+    guint i;
+
+    g_info("unlockmany request (%u entries)", entries->via.array.size);
+
+    for (i = 0; i < entries->via.array.size; i++) {
+        entry = &entries->via.array.ptr[i];
+        path = NULL;
+        errmsg = NULL;
+        r = NULL;
+        if (entry->type == MSGPACK_OBJECT_ARRAY &&
+            entry->via.array.size == 2) {
+            if (parse_range(&entry->via.array.ptr[1], &range) < 0)
+                errmsg = "malformed entry";
+            entry = &entry->via.array.ptr[0];
+            r = &range;
+        }
+        if (!errmsg && (entry->type != MSGPACK_OBJECT_RAW ||
+                        !(path = raw_to_string(&entry->via.raw))))
+            errmsg = "malformed entry";
+        if (!errmsg)
+            errmsg = unlock_path(path, r);
+
+        g_ptr_array_index(results, i) = errmsg ?
+            packed_new(failed_packfn, (void *) errmsg) :
+            packed_new(empty_ok_packfn, NULL);
+        free(path);
+    }
+
+    client_reply(client, packed_list_packfn, results);
+    g_ptr_array_free(results, TRUE);
 }
 
-int handle_req(void *socket, zmq_msg_t * msg)
+int handle_req(struct pcma_client *client, zmq_msg_t * msg)
 {
-    int command_id, i;
-    const gchar *query, *tag, *path = NULL;
-    GList *tags = NULL;
+    int command_id, ret = 0;
+    const gchar *path = NULL;
+    GList *tags = NULL, *includes = NULL, *excludes = NULL;
+    GArray *ranges = NULL;
+    struct lock_range range;
+    struct list_query query;
+    int strategy = default_strategy;
+    guint64 rate = 0;
+    guint count = ADVISE_REPORT;
 
     msgpack_object obj;
     msgpack_unpacked pack;
 
     msgpack_unpacked_init(&pack);
+    memset(&query, 0, sizeof(query));
 
     if (!msgpack_unpack_next
         (&pack, zmq_msg_data(msg), zmq_msg_size(msg), NULL)) {
-        announce_failure(socket, "msgpack_unpack_next failed");
-        return (-1);
+        announce_failure(client, "msgpack_unpack_next failed");
+        ret = -1;
+        goto out;
     }
 
     obj = pack.data;
 
     if (obj.type != MSGPACK_OBJECT_ARRAY) {
-        announce_failure(socket, "not an array");
-        return (-2);
+        announce_failure(client, "not an array");
+        ret = -2;
+        goto out;
     }
 
     const gchar *command =
         (const gchar *) obj.via.array.ptr[0].via.raw.ptr;
     int command_size = obj.via.array.ptr[0].via.raw.size;
     if (!command) {
-        announce_failure(socket, "no command");
-        return (-3);
+        announce_failure(client, "no command");
+        ret = -3;
+        goto out;
     }
 
     if (command_size == PING_COMMAND_SIZE &&
@@ -322,118 +3298,358 @@ int handle_req(void *socket, zmq_msg_t * msg)
                !bcmp(RELEASETAG_COMMAND, command,
                      RELEASETAG_COMMAND_SIZE)) {
         command_id = RELEASETAG_COMMAND_ID;
+    } else if (command_size == WARM_COMMAND_SIZE &&
+               !bcmp(WARM_COMMAND, command, WARM_COMMAND_SIZE)) {
+        command_id = WARM_COMMAND_ID;
+    } else if (command_size == RESIDENCY_COMMAND_SIZE &&
+               !bcmp(RESIDENCY_COMMAND, command, RESIDENCY_COMMAND_SIZE)) {
+        command_id = RESIDENCY_COMMAND_ID;
+    } else if (command_size == LOCKMANY_COMMAND_SIZE &&
+               !bcmp(LOCKMANY_COMMAND, command, LOCKMANY_COMMAND_SIZE)) {
+        command_id = LOCKMANY_COMMAND_ID;
+    } else if (command_size == UNLOCKMANY_COMMAND_SIZE &&
+               !bcmp(UNLOCKMANY_COMMAND, command,
+                     UNLOCKMANY_COMMAND_SIZE)) {
+        command_id = UNLOCKMANY_COMMAND_ID;
+    } else if (command_size == STATS_COMMAND_SIZE &&
+               !bcmp(STATS_COMMAND, command, STATS_COMMAND_SIZE)) {
+        command_id = STATS_COMMAND_ID;
+    } else if (command_size == LOCKDIR_COMMAND_SIZE &&
+               !bcmp(LOCKDIR_COMMAND, command, LOCKDIR_COMMAND_SIZE)) {
+        command_id = LOCKDIR_COMMAND_ID;
+    } else if (command_size == REFRESH_COMMAND_SIZE &&
+               !bcmp(REFRESH_COMMAND, command, REFRESH_COMMAND_SIZE)) {
+        command_id = REFRESH_COMMAND_ID;
+    } else if (command_size == ADVISE_COMMAND_SIZE &&
+               !bcmp(ADVISE_COMMAND, command, ADVISE_COMMAND_SIZE)) {
+        command_id = ADVISE_COMMAND_ID;
     } else {
-        announce_failure(socket, "unknown command");
-        return (-4);
+        announce_failure(client, "unknown command");
+        ret = -4;
+        goto out;
     }
+    client->command = command_id;
 
     switch (command_id) {
     case PING_COMMAND_ID:
-    case LIST_COMMAND_ID:
+    case STATS_COMMAND_ID:
+    case REFRESH_COMMAND_ID:
         if (obj.via.array.size != 1) {
-            announce_failure(socket, "no parameter expected");
-            return (-5);
+            announce_failure(client, "no parameter expected");
+            ret = -5;
+            goto out;
         }
         break;
-    case UNLOCK_COMMAND_ID:
+    case LIST_COMMAND_ID:
+        if (obj.via.array.size > 2) {
+            announce_failure(client, "at most 1 parameter expected");
+            ret = -5;
+            goto out;
+        }
+        if (obj.via.array.size == 2 &&
+            parse_list_query(&obj.via.array.ptr[1], &query) < 0) {
+            list_query_clear(&query);
+            announce_failure(client, "invalid list options");
+            ret = -9;
+            goto out;
+        }
+        break;
+    case ADVISE_COMMAND_ID:
+        if (obj.via.array.size > 2) {
+            announce_failure(client, "at most 1 parameter expected");
+            ret = -5;
+            goto out;
+        }
+        if (obj.via.array.size == 2) {
+            if (obj.via.array.ptr[1].type !=
+                MSGPACK_OBJECT_POSITIVE_INTEGER) {
+                announce_failure(client, "count should be an integer");
+                ret = -7;
+                goto out;
+            }
+            count = MIN(obj.via.array.ptr[1].via.u64, G_MAXUINT);
+        }
+        break;
+    case LOCKMANY_COMMAND_ID:
+    case UNLOCKMANY_COMMAND_ID:
+        if (obj.via.array.size != 2 ||
+            obj.via.array.ptr[1].type != MSGPACK_OBJECT_ARRAY) {
+            announce_failure(client, "list of entries expected");
+            ret = -6;
+            goto out;
+        }
+        break;
+    case RESIDENCY_COMMAND_ID:
+        if (obj.via.array.size != 2) {
+            announce_failure(client, "1 parameter expected");
+            ret = -6;
+            goto out;
+        }
+        if (obj.via.array.ptr[1].type == MSGPACK_OBJECT_ARRAY) {
+            if (parse_strings(&obj.via.array.ptr[1], &tags) < 0) {
+                announce_failure(client, "raw_to_string failed");
+                ret = -8;
+                goto out;
+            }
+            break;
+        }
+        /* fallthrough */
     case RELEASETAG_COMMAND_ID:
         if (obj.via.array.size != 2) {
-            announce_failure(socket, "1 parameter expected");
-            return (-6);
+            announce_failure(client, "1 parameter expected");
+            ret = -6;
+            goto out;
         }
         /* fallthrough */
+    case UNLOCK_COMMAND_ID:
     case LOCK_COMMAND_ID:
+    case LOCKDIR_COMMAND_ID:
+    case WARM_COMMAND_ID:
+        if (obj.via.array.size < 2) {
+            announce_failure(client, "path expected");
+            ret = -6;
+            goto out;
+        }
         if (obj.via.array.ptr[1].type != MSGPACK_OBJECT_RAW) {
-            announce_failure(socket, "RAW parameter expected");
-            return (-7);
+            announce_failure(client, "RAW parameter expected");
+            ret = -7;
+            goto out;
         }
         path = raw_to_string(&obj.via.array.ptr[1].via.raw);
         if (!path) {
-            announce_failure(socket, "raw_to_string failed");
-            return (-8);
+            announce_failure(client, "raw_to_string failed");
+            ret = -8;
+            goto out;
         }
     }
 
     switch (command_id) {
     case PING_COMMAND_ID:
-        handle_ping_request(socket);
+        handle_ping_request(client);
+        break;
+    case STATS_COMMAND_ID:
+        handle_stats_request(client);
+        break;
+    case REFRESH_COMMAND_ID:
+        handle_refresh_request(client);
+        break;
+    case ADVISE_COMMAND_ID:
+        handle_advise_request(client, count);
         break;
     case LIST_COMMAND_ID:
-        handle_list_request(socket);
+        handle_list_request(client, &query);
+        list_query_clear(&query);
         break;
     case LOCK_COMMAND_ID:
+        if (obj.via.array.size > 3 &&
+            parse_ranges(&obj.via.array.ptr[3], &ranges) < 0) {
+            announce_failure(client,
+                             "ranges should be a list of [offset, length]");
+            break;
+        }
+        if (obj.via.array.size > 2 &&
+            parse_strings(&obj.via.array.ptr[2], &tags) < 0) {
+            announce_failure(client, "tags should be a list");
+            break;
+        }
+        if (obj.via.array.size > 4 &&
+            parse_lock_options(&obj.via.array.ptr[4], &strategy,
+                               &rate) < 0) {
+            announce_failure(client, "invalid lock options");
+            break;
+        }
+        handle_lock_request(client, path, tags, ranges, strategy, rate);
+        break;
+    case WARM_COMMAND_ID:
+        if (obj.via.array.size > 2 &&
+            parse_ranges(&obj.via.array.ptr[2], &ranges) < 0) {
+            announce_failure(client,
+                             "ranges should be a list of [offset, length]");
+            break;
+        }
+        handle_warm_request(client, path, ranges);
+        break;
+    case LOCKDIR_COMMAND_ID:
+        if ((obj.via.array.size > 2 &&
+             parse_strings(&obj.via.array.ptr[2], &tags) < 0) ||
+            (obj.via.array.size > 3 &&
+             parse_strings(&obj.via.array.ptr[3], &includes) < 0) ||
+            (obj.via.array.size > 4 &&
+             parse_strings(&obj.via.array.ptr[4], &excludes) < 0)) {
+            announce_failure(client, "tags and patterns should be lists");
+            break;
+        }
+        if (obj.via.array.size > 5 &&
+            parse_lock_options(&obj.via.array.ptr[5], &strategy,
+                               &rate) < 0) {
+            announce_failure(client, "invalid lock options");
+            break;
+        }
+        handle_lockdir_request(client, path, tags, includes, excludes,
+                               strategy, rate);
+        break;
+    case UNLOCK_COMMAND_ID:
         if (obj.via.array.size > 2) {
-            if (obj.via.array.ptr[2].type != MSGPACK_OBJECT_ARRAY)
-                announce_failure(socket, "tags should be a list");
-            else {
-                for (i = 0; i < obj.via.array.ptr[2].via.array.size; i++) {
-                    if (obj.via.array.ptr[2].via.array.ptr[i].type !=
-                        MSGPACK_OBJECT_RAW)
-                        continue;       /* drops a format error silently */
-                    tag =
-                        raw_to_string(&
-                                      (obj.via.array.ptr[2].via.
-                                       array.ptr[i]).via.raw);
-                    if (tag)
-                        tags = g_list_prepend(tags, (gchar *) tag);
-                    else {
-                        announce_failure(socket,
-                                         "tag raw_to_string failed");
-                        free((void *) path);
-                        g_list_free(tags);
-                        return (-10);
-                    }
-                }
-                handle_lock_request(socket, path, tags);
-            }
+            if (parse_range(&obj.via.array.ptr[2], &range) < 0)
+                announce_failure(client, "range should be [offset, length]");
+            else
+                handle_unlock_request(client, path, &range);
         } else {
-            handle_lock_request(socket, path, NULL);
+            handle_unlock_request(client, path, NULL);
         }
         break;
-    case UNLOCK_COMMAND_ID:
-        handle_unlock_request(socket, path);
+    case LOCKMANY_COMMAND_ID:
+        handle_lockmany_request(client, &obj.via.array.ptr[1]);
+        break;
+    case UNLOCKMANY_COMMAND_ID:
+        handle_unlockmany_request(client, &obj.via.array.ptr[1]);
         break;
     case RELEASETAG_COMMAND_ID:
-        handle_releasetag_request(socket, path);
+        handle_releasetag_request(client, path);
+        break;
+    case RESIDENCY_COMMAND_ID:
+        handle_residency_request(client, path, tags);
         break;
     }
 
+  out:
     msgpack_unpacked_destroy(&pack);
 
     if (path)
         free((char *) path);
     if (tags)
         g_list_free_full(tags, free);
+    if (includes)
+        g_list_free_full(includes, free);
+    if (excludes)
+        g_list_free_full(excludes, free);
+    if (ranges)
+        g_array_free(ranges, TRUE);
+
+    return (ret);
+}
+
+/* Receives a multipart request from the ROUTER socket: routing frames go to
+ * the returned client, the last frame to msg */
+struct pcma_client *client_recv(void *socket, zmq_msg_t * msg)
+{
+    struct pcma_client *client = client_new();
+    zmq_msg_t *frame;
+    int64_t more;
+    size_t more_size;
+
+    for (;;) {
+        frame = g_new(zmq_msg_t, 1);
+        if (zmq_msg_init(frame) < 0)
+            g_error("client_recv: zmq_msg_init: %s", strerror(errno));
 
-    return 0;
+        while (zmq_recv(socket, frame, 0) < 0) {
+            if (errno != EINTR)
+                g_error("client_recv: zmq_recv: %s", strerror(errno));
+        }
+
+        more_size = sizeof(more);
+        if (zmq_getsockopt(socket, ZMQ_RCVMORE, &more, &more_size) < 0)
+            g_error("client_recv: zmq_getsockopt: %s", strerror(errno));
+
+        if (!more)
+            break;
+
+        g_ptr_array_add(client->envelope, frame);
+    }
+
+    client->received = g_get_monotonic_time();
+    if (zmq_msg_move(msg, frame) < 0)
+        g_error("client_recv: zmq_msg_move: %s", strerror(errno));
+    if (zmq_msg_close(frame) < 0)
+        g_warning("client_recv: zmq_msg_close: %s", strerror(errno));
+    g_free(frame);
+
+    return (client);
+}
+
+/* Earliest of the timers, -1 if none is set */
+glong loop_timeout()
+{
+    glong timers[3], timeout = -1;
+    guint i;
+
+    timers[0] = watch_timeout();
+    timers[1] = state_timeout();
+    timers[2] = metrics_timeout();
+
+    for (i = 0; i < G_N_ELEMENTS(timers); i++)
+        if (timers[i] >= 0 && (timeout < 0 || timers[i] < timeout))
+            timeout = timers[i];
+    return (timeout);
 }
 
 int loop(void *socket)
 {
-    int ret = 0;
+    int ret = 0, nitems = 2;
     zmq_msg_t msg;
+    zmq_pollitem_t items[3];
+    struct pcma_client *client;
+    gchar *path;
+
+    items[0].socket = socket;
+    items[0].events = ZMQ_POLLIN;
+    items[1].socket = NULL;
+    items[1].fd = completion_pipe[0];
+    items[1].events = ZMQ_POLLIN;
+    items[2].socket = NULL;
+    items[2].fd = watch_fd();
+    items[2].events = ZMQ_POLLIN;
+    items[2].revents = 0;
+    if (items[2].fd >= 0)
+        nitems = 3;
+
+    while (!leave_signal) {
+        if (zmq_poll(items, nitems, loop_timeout()) < 0) {
+            if (errno == EINTR)
+                continue;
+            else
+                g_error("loop: zmq_poll: %s", strerror(errno));
+        }
+
+        if (items[1].revents & ZMQ_POLLIN)
+            handle_completions();
+
+        if (shed_signal) {
+            shed_signal = 0;
+            if (shedding)
+                shed_next(NULL);
+        }
+
+        if (items[2].revents & ZMQ_POLLIN)
+            watch_handle_events();
+
+        while ((path = watch_pop_expired())) {
+            check_lockfile(path);
+            g_free(path);
+        }
+
+        state_check();
+        metrics_check();
+
+        if (!(items[0].revents & ZMQ_POLLIN))
+            continue;
 
-    for (;;) {
         if (zmq_msg_init(&msg) < 0) {
             g_warning("loop: zmq_msg_init: %s", strerror(errno));
             continue;
         }
 
-        if (zmq_recv(socket, &msg, 0) < 0) {
-            if (errno == EINTR)
-                continue;
-            else
-                g_error("loop: zmq_recv: %s", strerror(errno));
-        }
+        client = client_recv(socket, &msg);
 
-        if ((ret = handle_req(socket, &msg)) < 0)
+        if ((ret = handle_req(client, &msg)) < 0)
             g_warning("loop: handle_req: %i", ret);
 
         if (zmq_msg_close(&msg) < 0)
             g_warning("loop: zmq_msg_close: %s", strerror(errno));
     }
 
-    return (-42);               /* Yiipee! */
+    return (0);
 }
 
 void help(const gchar * name)
@@ -442,7 +3658,14 @@ void help(const gchar * name)
     if (!disp_name)
         disp_name = default_name;
 
-    fprintf(stderr, "Usage: %s [-e ENDPOINT]\n", disp_name);
+    fprintf(stderr,
+            "Usage: %s [-e ENDPOINT]... [-i THREADS] [-w WORKERS] "
+            "[-W DELAY] [-q DEPTH] [-m BYTES] [-Q TAG=BYTES]... "
+            "[-s STATEFILE] [-p TAG]... [-M FILE] [-L STRATEGY] "
+            "[-F THREADS] [-C BYTES] [-R BYTES] [-P ENDPOINT] "
+            "[-S STALL/WINDOW[/CALM]] [-T TAG=PRIORITY]... "
+            "[-A DIR]... [-D SECONDS] [-N COUNT] [-B BYTES]\n",
+            disp_name);
     exit(EXIT_FAILURE);
 }
 
@@ -454,6 +3677,7 @@ int server_leave(int signum)
 
     if (pcmad_sock && (zmq_close(pcmad_sock) < 0))
         return (-1);
+    events_close();
     if (pcmad_ctx && (zmq_term(pcmad_ctx) < 0))
         return (-2);
     if (lockfiles)
@@ -462,11 +3686,13 @@ int server_leave(int signum)
     return (0);
 }
 
+/* Only flags the signal, the main loop leaving once woken up: saving the
+ * state from here could deadlock with the state writer */
 void sh_termination(int signum)
 {
-    if (server_leave(signum) < 0)
-        exit(EXIT_FAILURE);
-    exit(EXIT_SUCCESS);
+    leave_signal = signum;
+    if (write(completion_pipe[1], "", 1) < 0)
+        return;
 }
 
 void sh_abrt(int signum)
@@ -481,31 +3707,175 @@ void sh_usr1(int signum)
     lockfiles_print(lockfiles);
 }
 
+/* Sheds files as a memory pressure trigger would, from the main loop */
+void sh_usr2(int signum)
+{
+    shed_signal = 1;
+    if (write(completion_pipe[1], "", 1) < 0)
+        return;
+}
+
 void setup_signals()
 {
     setup_sig(SIGTERM, sh_termination, 1);
     setup_sig(SIGINT, sh_termination, 1);
     setup_sig(SIGQUIT, sh_termination, 1);
     setup_sig(SIGUSR1, sh_usr1, 0);
+    setup_sig(SIGUSR2, sh_usr2, 0);
     setup_sig(SIGABRT, sh_abrt, 0);
 }
 
+void setup_workers(int workers)
+{
+    GError *err = NULL;
+
+    if (pipe(completion_pipe) < 0)
+        g_error("pipe: %s", strerror(errno));
+    if (fcntl(completion_pipe[0], F_SETFL, O_NONBLOCK) < 0)
+        g_error("fcntl: %s", strerror(errno));
+
+    completions = g_async_queue_new();
+
+    lock_pool = g_thread_pool_new(lock_worker, NULL, workers, TRUE, &err);
+    if (!lock_pool)
+        g_error("g_thread_pool_new: %s", err->message);
+
+    aux_pool = g_thread_pool_new(task_worker, NULL, workers, TRUE, &err);
+    if (!aux_pool)
+        g_error("g_thread_pool_new: %s", err->message);
+}
+
 int main(int argc, char **argv)
 {
-    int ret, opt;
-    const gchar *endpoint = default_ep;
+    int ret, opt, workers = DEFAULT_LOCK_WORKERS, watch_delay = -1;
+    int warm_depth = DEFAULT_WARM_DEPTH, fault_threads = 0;
+    int io_threads = DEFAULT_IO_THREADS;
+    GPtrArray *endpoints = g_ptr_array_new(), *advise_dirs = NULL;
+    const gchar *state_path = NULL, *events_ep = NULL;
+    guint stall = 0, window = 0, calm = 0;
+    int advise_interval = DEFAULT_ADVISE_INTERVAL, advise_count = 0;
+    gint priority;
+    guint i;
+    guint64 limit = 0, tag_limit, fault_chunk, rate = 0, advise_budget = 0;
+    gchar *sep;
 
     lockfiles =
-        g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
-                              mlockfile_destroy);
+        g_hash_table_new_full(g_str_hash, g_str_equal,
+                              lockfiles_key_destroy,
+                              lockfiles_value_destroy);
+    lockpaths = g_sequence_new(NULL);
+    lockaliases = g_hash_table_new(g_str_hash, g_str_equal);
+    lockinodes = g_hash_table_new(lockinode_hash, lockinode_equal);
+    tags_init();
 
     setup_logging();
     setup_signals();
+    budget_init(0);
+    parse_size(DEFAULT_FAULT_CHUNK, &fault_chunk);
 
-    while ((opt = getopt(argc, argv, "e:")) != -1) {
+    while ((opt =
+            getopt(argc, argv,
+                   "e:i:m:p:q:s:w:A:B:C:D:F:L:M:N:P:Q:R:S:T:W:")) != -1) {
         switch (opt) {
         case 'e':
-            endpoint = optarg;
+            g_ptr_array_add(endpoints, optarg);
+            break;
+        case 'P':
+            events_ep = optarg;
+            break;
+        case 'S':
+            if (sscanf(optarg, "%u/%u/%u", &stall, &window, &calm) < 2 ||
+                !stall || stall > window)
+                g_error("pressure threshold %s should be STALL/WINDOW[/CALM]",
+                        optarg);
+            break;
+        case 'A':
+            if (!advise_dirs)
+                advise_dirs = g_ptr_array_new();
+            g_ptr_array_add(advise_dirs, optarg);
+            break;
+        case 'D':
+            advise_interval = atoi(optarg);
+            if (advise_interval < 1)
+                g_error("the sampling interval should be at least 1 s");
+            break;
+        case 'N':
+            advise_count = atoi(optarg);
+            if (advise_count < 0)
+                g_error("the number of advised ranges cannot be negative");
+            break;
+        case 'B':
+            if (parse_size(optarg, &advise_budget) < 0)
+                g_error("invalid advice budget %s", optarg);
+            break;
+        case 'T':
+            if (!(sep = strrchr(optarg, '=')) || sep == optarg ||
+                sscanf(sep + 1, "%i", &priority) != 1)
+                g_error("tag priority %s should be TAG=PRIORITY", optarg);
+            *sep = '\0';
+            pressure_set_priority(optarg, priority);
+            break;
+        case 'i':
+            io_threads = atoi(optarg);
+            if (io_threads < 1)
+                g_error("at least 1 I/O thread is required");
+            break;
+        case 'w':
+            workers = atoi(optarg);
+            if (workers < 1)
+                g_error("at least 1 worker is required");
+            break;
+        case 'q':
+            warm_depth = atoi(optarg);
+            if (warm_depth < 1)
+                g_error("the warm queue depth should be at least 1");
+            break;
+        case 'm':
+            if (parse_size(optarg, &limit) < 0)
+                g_error("invalid memory budget %s", optarg);
+            budget_init(limit);
+            break;
+        case 'Q':
+            if (!(sep = strrchr(optarg, '=')) || sep == optarg ||
+                parse_size(sep + 1, &tag_limit) < 0)
+                g_error("tag budget %s should be TAG=BYTES", optarg);
+            *sep = '\0';
+            budget_set_tag_limit(optarg, tag_limit);
+            break;
+        case 's':
+            state_path = optarg;
+            break;
+        case 'p':
+            if (!restore_priorities)
+                restore_priorities = g_ptr_array_new();
+            g_ptr_array_add(restore_priorities, optarg);
+            break;
+        case 'F':
+            fault_threads = atoi(optarg);
+            if (fault_threads < 0)
+                g_error("the fault-in thread count cannot be negative");
+            break;
+        case 'C':
+            if (parse_size(optarg, &fault_chunk) < 0 || !fault_chunk)
+                g_error("invalid fault-in chunk size %s", optarg);
+            break;
+        case 'R':
+            if (parse_size(optarg, &rate) < 0)
+                g_error("invalid rate %s", optarg);
+            break;
+        case 'L':
+            default_strategy = mlock_strategy_parse(optarg, strlen(optarg));
+            if (default_strategy < 0)
+                g_error("unknown lock strategy %s", optarg);
+            break;
+        case 'M':
+            if (metrics_init(optarg) < 0)
+                g_error("metrics_init failed");
+            break;
+        case 'W':
+            watch_delay = atoi(optarg);
+            if (watch_delay < 0)
+                g_error("the watch delay cannot be negative");
             break;
         default:
             if (argc > 0)
@@ -515,23 +3885,92 @@ int main(int argc, char **argv)
         }
     }
 
-    g_info("using endpoint %s", endpoint);
+    if (!endpoints->len)
+        g_ptr_array_add(endpoints, (gpointer) default_ep);
+    g_info("using %i lock workers", workers);
+    if (limit)
+        g_info("locking at most %" G_GUINT64_FORMAT " bytes", limit);
+
+    setup_workers(workers);
+
+    throttle_init(rate);
+    if (rate)
+        g_info("faulting in at most %" G_GUINT64_FORMAT " bytes per second",
+               rate);
+
+    if (fault_threads > 1) {
+        g_info("faulting in mappings over %" G_GUINT64_FORMAT
+               " bytes with %i threads", fault_chunk, fault_threads);
+        if (mlock_parallel_init(fault_threads, fault_chunk) < 0)
+            g_error("mlock_parallel_init failed");
+    }
+
+    if (warm_init(warm_depth) < 0)
+        g_error("warm_init failed");
+
+    if (watch_delay >= 0) {
+        g_info("watching locked files, checking them after %i ms",
+               watch_delay);
+        if (watch_init(watch_delay) < 0)
+            g_error("watch_init failed");
+    }
+
+    if (state_path) {
+        g_info("saving the lock state to %s", state_path);
+        if (state_init(state_path) < 0)
+            g_error("state_init failed");
+        state_enabled = TRUE;
+        restore_start(workers);
+    }
 
-    if (!(pcmad_ctx = zmq_init(1)))
+    g_info("using %i I/O threads", io_threads);
+    if (!(pcmad_ctx = zmq_init(io_threads)))
         g_error("zmq_init: %s", strerror(errno));
 
-    if (!(pcmad_sock = zmq_socket(pcmad_ctx, ZMQ_REP)))
+    if (!(pcmad_sock = zmq_socket(pcmad_ctx, ZMQ_ROUTER)))
         g_error("zmq_socket: %s", strerror(errno));
 
-    if (zmq_bind(pcmad_sock, endpoint) < 0)
-        g_error("zmq_bind: %s", strerror(errno));
+    /* A single socket serves every endpoint, replies being routed back
+     * through the connection their request came from */
+    for (i = 0; i < endpoints->len; i++) {
+        g_info("using endpoint %s", (gchar *) endpoints->pdata[i]);
+        if (zmq_bind(pcmad_sock, endpoints->pdata[i]) < 0)
+            g_error("zmq_bind(%s): %s", (gchar *) endpoints->pdata[i],
+                    strerror(errno));
+    }
+    g_ptr_array_free(endpoints, TRUE);
+
+    if (stall) {
+        g_info("shedding files after stalls of %u ms within %u ms", stall,
+               window);
+        shedding = g_new0(struct shedding, 1);
+        shedding->tiers = g_queue_new();
+        if (pressure_init(stall, window, calm, pressure_changed) < 0)
+            g_error("pressure_init failed");
+    }
+
+    if (advise_dirs) {
+        g_info("sampling %u directories every %i s", advise_dirs->len,
+               advise_interval);
+        if (advise_count)
+            g_info("locking the %i best ranges on advice", advise_count);
+        if (advise_init(advise_dirs, advise_interval, advise_count,
+                        advise_budget, advise_selected) < 0)
+            g_error("advise_init failed");
+    }
+
+    if (events_ep) {
+        g_info("publishing events on %s", events_ep);
+        if (events_init(pcmad_ctx, events_ep) < 0)
+            g_error("events_init failed");
+    }
 
     loop(pcmad_sock);
 
-    if (pcmad_sock && zmq_close(pcmad_sock) < 0)
-        g_error("zmq_close: %s", strerror(errno));
-    if (pcmad_ctx && zmq_term(pcmad_ctx) < 0)
-        g_error("zmq_term: %s", strerror(errno));
+    if (state_dirty())
+        state_save(TRUE);
+    if (server_leave(leave_signal) < 0)
+        return (EXIT_FAILURE);
 
     return (EXIT_SUCCESS);
 }
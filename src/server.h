@@ -1,8 +1,41 @@
 #ifndef PCMA__SERVER_H
 #define PCMA__SERVER_H
 
+#define DEFAULT_LOCK_WORKERS 4
+#define DEFAULT_IO_THREADS 1
+
 const char *default_name = "pcmad";
 void *pcmad_ctx = NULL, *pcmad_sock = NULL;
 GHashTable *lockfiles = NULL;
+GSequence *lockpaths = NULL;    /* keys of lockfiles, sorted */
+/* Every inode is locked by a single entry, found under its key in
+ * lockfiles or any of its aliases; lockinodes is the set of entries
+ * holding an inode, looked up by device and inode numbers. */
+GHashTable *lockaliases = NULL; /* alias -> entry */
+GHashTable *lockinodes = NULL;
+/* Held by the main thread while it changes lockinodes, and by workers
+ * looking it up */
+GMutex lockinodes_mutex;
+
+/* Lock requests are run by lock_pool, other slow requests by aux_pool;
+ * finished jobs are pushed to completions and the main loop is woken up
+ * through completion_pipe. */
+GThreadPool *lock_pool = NULL;
+GThreadPool *aux_pool = NULL;
+GAsyncQueue *completions = NULL;
+int completion_pipe[2] = { -1, -1 };
+
+int default_strategy = 0;       /* enum mlock_strategy, see -L */
+
+/* Bumped whenever lockfiles changes; the state is saved when it moved */
+guint64 lockfiles_generation = 0;
+gboolean state_enabled = FALSE;
+GPtrArray *restore_priorities = NULL;   /* tags restored first, in order */
+struct restore *restoring = NULL;       /* kept after the restore ends */
+struct shedding *shedding = NULL;       /* set with -S */
+/* Set by termination signals, the main loop then returns */
+volatile sig_atomic_t leave_signal = 0;
+volatile sig_atomic_t shed_signal = 0;   /* SIGUSR2, see -S */
+GPtrArray *advised = NULL;      /* ranges locked on advice, see -N */
 
 #endif                          /* PCMA__SERVER_H */
@@ -0,0 +1,117 @@
+#include <glib.h>
+#include <fcntl.h>
+#include <msgpack.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "common.h"
+#include "state.h"
+
+/*
+ * The lock state is snapshotted to a file, written to a temporary file
+ * that is then renamed over the previous snapshot, so that a crash never
+ * leaves a partial one behind. Snapshots are written by a dedicated
+ * thread, one at a time.
+ */
+
+static gchar *state_path = NULL;
+static gchar *state_tmp = NULL;
+static GThreadPool *writer = NULL;
+static GMutex writing;
+
+static int state_write_file(msgpack_sbuffer * buffer)
+{
+    size_t done = 0;
+    ssize_t ret;
+    int fd;
+
+    if ((fd = open(state_tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0) {
+        g_critical("state_write_file: open(%s): %s", state_tmp,
+                   strerror(errno));
+        return (-1);
+    }
+
+    while (done < buffer->size) {
+        ret = write(fd, buffer->data + done, buffer->size - done);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0) {
+            g_critical("state_write_file: write: %s", strerror(errno));
+            close(fd);
+            return (-2);
+        }
+        done += ret;
+    }
+
+    if (fsync(fd) < 0)
+        g_warning("state_write_file: fsync: %s", strerror(errno));
+    if (close(fd) < 0) {
+        g_critical("state_write_file: close: %s", strerror(errno));
+        return (-3);
+    }
+
+    if (rename(state_tmp, state_path) < 0) {
+        g_critical("state_write_file: rename: %s", strerror(errno));
+        return (-4);
+    }
+    return (0);
+}
+
+void state_write_now(msgpack_sbuffer * buffer)
+{
+    g_mutex_lock(&writing);
+    if (state_write_file(buffer) == 0)
+        g_debug("saved state (%lu bytes)", (unsigned long) buffer->size);
+    g_mutex_unlock(&writing);
+    msgpack_sbuffer_free(buffer);
+}
+
+static void state_writer(gpointer data, gpointer user_data)
+{
+    state_write_now((msgpack_sbuffer *) data);
+}
+
+int state_init(const gchar * path)
+{
+    GError *err = NULL;
+
+    state_path = g_strdup(path);
+    state_tmp = g_strdup_printf("%s.tmp", path);
+
+    writer = g_thread_pool_new(state_writer, NULL, 1, FALSE, &err);
+    if (!writer) {
+        g_critical("state_init: g_thread_pool_new: %s", err->message);
+        g_error_free(err);
+        return (-1);
+    }
+    return (0);
+}
+
+/* Returns 1 when there is no state to restore */
+int state_read(gchar ** contents, gsize * length)
+{
+    GError *err = NULL;
+
+    if (!g_file_get_contents(state_path, contents, length, &err)) {
+        if (g_error_matches(err, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+            g_error_free(err);
+            return (1);
+        }
+        g_critical("state_read: %s", err->message);
+        g_error_free(err);
+        return (-1);
+    }
+    return (0);
+}
+
+/* Writes the snapshot from the writer thread, taking the buffer over */
+void state_write(msgpack_sbuffer * buffer)
+{
+    GError *err = NULL;
+
+    if (!g_thread_pool_push(writer, buffer, &err)) {
+        g_critical("state_write: g_thread_pool_push: %s", err->message);
+        g_error_free(err);
+        state_write_now(buffer);
+    }
+}
@@ -0,0 +1,15 @@
+#ifndef PCMA__STATE_H
+#define PCMA__STATE_H
+
+#include <glib.h>
+#include <msgpack.h>
+
+#define STATE_VERSION 1
+#define STATE_SAVE_DELAY 1000   /* ms */
+
+int state_init(const gchar * path);
+int state_read(gchar ** contents, gsize * length);
+void state_write(msgpack_sbuffer * buffer);
+void state_write_now(msgpack_sbuffer * buffer);
+
+#endif                          /* PCMA__STATE_H */
@@ -0,0 +1,95 @@
+#include <glib.h>
+#include <malloc.h>
+#include <string.h>
+#include "common.h"
+#include "tags.h"
+
+/*
+ * Inverted index of tags: every tag maps to the set of locked files
+ * carrying it, so that requests on a tag only touch those files. Files
+ * are opaque pointers, kept in sync by whoever changes their tags.
+ *
+ * Tags are interned: files reference the name held by the index instead
+ * of a copy of their own, and the name lives as long as a file carries it.
+ */
+
+struct tag {
+    gchar *name;
+    GHashTable *files;          /* set of files */
+};
+
+static GHashTable *tag_index = NULL;    /* name -> struct tag */
+
+static void tag_free(gpointer p)
+{
+    struct tag *t = (struct tag *) p;
+
+    g_hash_table_unref(t->files);
+    g_free(t->name);
+    g_free(t);
+}
+
+void tags_init()
+{
+    tag_index = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+                                      tag_free);
+}
+
+/* Indexes the file, returning the interned name it should reference */
+const gchar *tags_add(const gchar * tag, gpointer file)
+{
+    struct tag *t = g_hash_table_lookup(tag_index, tag);
+
+    if (!t) {
+        t = g_new(struct tag, 1);
+        t->name = g_strdup(tag);
+        t->files = g_hash_table_new(g_direct_hash, g_direct_equal);
+        g_hash_table_insert(tag_index, t->name, t);
+    }
+    g_hash_table_add(t->files, file);
+    return (t->name);
+}
+
+/* The interned name is freed along with the last file carrying it */
+void tags_remove(const gchar * tag, gpointer file)
+{
+    struct tag *t = g_hash_table_lookup(tag_index, tag);
+
+    if (!t || !g_hash_table_remove(t->files, file)) {
+        g_critical("tags_remove: %s was not indexed", tag);
+        return;
+    }
+    if (!g_hash_table_size(t->files))
+        g_hash_table_remove(tag_index, t->name);
+}
+
+/* Set of files carrying the tag, NULL if none does */
+GHashTable *tags_files(const gchar * tag)
+{
+    struct tag *t = g_hash_table_lookup(tag_index, tag);
+
+    return (t ? t->files : NULL);
+}
+
+guint tags_count()
+{
+    return (g_hash_table_size(tag_index));
+}
+
+/* Heap used by the index, hash table slots being estimated */
+gsize tags_memory()
+{
+    GHashTableIter iter;
+    gpointer value;
+    struct tag *t;
+    gsize slot = 2 * sizeof(gpointer) + sizeof(guint);
+    gsize total = g_hash_table_size(tag_index) * slot;
+
+    g_hash_table_iter_init(&iter, tag_index);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        t = (struct tag *) value;
+        total += malloc_usable_size(t) + malloc_usable_size(t->name);
+        total += g_hash_table_size(t->files) * slot;
+    }
+    return (total);
+}
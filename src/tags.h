@@ -0,0 +1,13 @@
+#ifndef PCMA__TAGS_H
+#define PCMA__TAGS_H
+
+#include <glib.h>
+
+void tags_init();
+const gchar *tags_add(const gchar * tag, gpointer file);
+void tags_remove(const gchar * tag, gpointer file);
+GHashTable *tags_files(const gchar * tag);
+guint tags_count();
+gsize tags_memory();
+
+#endif                          /* PCMA__TAGS_H */
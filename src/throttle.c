@@ -0,0 +1,141 @@
+#include <glib.h>
+#include <msgpack.h>
+#include "common.h"
+#include "throttle.h"
+
+/*
+ * Token buckets pacing how fast lock workers fault pages in, so that
+ * locking large sets of files does not saturate the disks other services
+ * read from. Workers take tokens for every chunk they are about to read:
+ * a bucket may go into debt, each worker sleeping until its share is paid
+ * back, so concurrent workers are paced together.
+ *
+ * There is a global bucket, and requests may bring their own, shared by
+ * all the files they lock. Request buckets are created, referenced and
+ * released by the main thread only; their counters are under their lock.
+ */
+
+struct throttle {
+    GMutex lock;
+    guint64 rate;               /* bytes per second, 0 for unlimited */
+    gint64 tokens;              /* bytes, negative while in debt */
+    gint64 last;                /* monotonic, when tokens were refilled */
+    guint64 bytes;              /* taken */
+    guint64 waited;             /* microseconds workers were held back */
+    guint refs;
+    gchar *label;               /* path of the request */
+};
+
+static struct throttle global;
+static GList *requests = NULL;  /* struct throttle, by creation */
+
+static void throttle_setup(struct throttle *t, guint64 rate)
+{
+    g_mutex_init(&t->lock);
+    t->rate = rate;
+    t->tokens = THROTTLE_CHUNK;
+    t->last = g_get_monotonic_time();
+}
+
+/* Limits all lock workers to rate bytes per second, 0 for unlimited */
+void throttle_init(guint64 rate)
+{
+    throttle_setup(&global, rate);
+}
+
+struct throttle *throttle_new(guint64 rate, const gchar * label)
+{
+    struct throttle *t = g_new0(struct throttle, 1);
+
+    throttle_setup(t, rate);
+    t->refs = 1;
+    t->label = g_strdup(label);
+    requests = g_list_append(requests, t);
+    return (t);
+}
+
+struct throttle *throttle_ref(struct throttle *t)
+{
+    if (t)
+        t->refs++;
+    return (t);
+}
+
+void throttle_unref(struct throttle *t)
+{
+    if (!t || --t->refs > 0)
+        return;
+    requests = g_list_remove(requests, t);
+    g_mutex_clear(&t->lock);
+    g_free(t->label);
+    g_free(t);
+}
+
+/* Whether faulting pages in is paced at all, t may be NULL */
+gboolean throttle_active(struct throttle *t)
+{
+    return (global.rate || (t && t->rate));
+}
+
+/* Returns how long to wait before reading bytes, in microseconds */
+static gint64 throttle_reserve(struct throttle *t, size_t bytes)
+{
+    gint64 now = g_get_monotonic_time(), wait = 0;
+
+    g_mutex_lock(&t->lock);
+    t->bytes += bytes;
+    if (t->rate) {
+        t->tokens += (gdouble) (now - t->last) * t->rate / G_USEC_PER_SEC;
+        t->tokens = MIN(t->tokens, THROTTLE_CHUNK);
+        t->last = now;
+        t->tokens -= bytes;
+        if (t->tokens < 0)
+            wait = (gdouble) - t->tokens * G_USEC_PER_SEC / t->rate;
+        t->waited += wait;
+    }
+    g_mutex_unlock(&t->lock);
+    return (wait);
+}
+
+/* Blocks the calling lock worker until bytes may be read */
+void throttle_take(struct throttle *t, size_t bytes)
+{
+    gint64 wait = throttle_reserve(&global, bytes);
+
+    if (t)
+        wait = MAX(wait, throttle_reserve(t, bytes));
+    if (wait > 0)
+        g_usleep(wait);
+}
+
+static void throttle_counters_pack(msgpack_packer * pk, struct throttle *t)
+{
+    g_mutex_lock(&t->lock);
+    string_pack("rate", pk);
+    msgpack_pack_uint64(pk, t->rate);
+    string_pack("bytes", pk);
+    msgpack_pack_uint64(pk, t->bytes);
+    string_pack("waited_us", pk);
+    msgpack_pack_uint64(pk, t->waited);
+    g_mutex_unlock(&t->lock);
+}
+
+/* Packs the "throttle" entry of stats replies */
+void throttle_pack(msgpack_packer * pk)
+{
+    struct throttle *t;
+    GList *r;
+
+    string_pack("throttle", pk);
+    msgpack_pack_map(pk, 4);
+    throttle_counters_pack(pk, &global);
+    string_pack("requests", pk);
+    msgpack_pack_array(pk, g_list_length(requests));
+    for (r = requests; r; r = r->next) {
+        t = (struct throttle *) r->data;
+        msgpack_pack_map(pk, 4);
+        string_pack("path", pk);
+        string_pack(t->label, pk);
+        throttle_counters_pack(pk, t);
+    }
+}
@@ -0,0 +1,20 @@
+#ifndef PCMA__THROTTLE_H
+#define PCMA__THROTTLE_H
+
+#include <glib.h>
+#include <msgpack.h>
+
+/* Pages are faulted in by chunks of this size when throttled */
+#define THROTTLE_CHUNK (8 << 20)
+
+struct throttle;
+
+void throttle_init(guint64 rate);
+struct throttle *throttle_new(guint64 rate, const gchar * label);
+struct throttle *throttle_ref(struct throttle *t);
+void throttle_unref(struct throttle *t);
+gboolean throttle_active(struct throttle *t);
+void throttle_take(struct throttle *t, size_t bytes);
+void throttle_pack(msgpack_packer * pk);
+
+#endif                          /* PCMA__THROTTLE_H */
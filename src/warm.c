@@ -0,0 +1,265 @@
+#define _GNU_SOURCE             /* readahead */
+#include <glib.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "common.h"
+#include "residency.h"
+#include "warm.h"
+
+/*
+ * Warming reads files into the page cache without pinning them. Files are
+ * split into chunks populated by warm_pool, whose size is the queue depth;
+ * the thread issuing a run blocks while too many chunks are in flight.
+ */
+
+#define WARM_CHUNK (8 << 20)
+
+struct warm_file {
+    int fd;
+    gint refs;
+};
+
+struct warm_run {
+    GMutex mutex;
+    GCond cond;
+    guint pending;              /* chunks in flight */
+    struct warm_stats stats;
+    GHashTable *paths;          /* measured before warming */
+};
+
+struct warm_chunk {
+    struct warm_run *run;
+    struct warm_file *file;
+    off_t offset;
+    size_t length;
+};
+
+static GThreadPool *warm_pool = NULL;
+static guint warm_depth = DEFAULT_WARM_DEPTH;
+
+static int warm_populate(int fd, off_t offset, size_t length)
+{
+#ifdef MADV_POPULATE_READ
+    off_t start = offset - offset % sysconf(_SC_PAGESIZE);
+    size_t size = length + (offset - start);
+    void *mmapped;
+    int ret;
+
+    mmapped = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, start);
+    if (mmapped != MAP_FAILED) {
+        ret = madvise(mmapped, size, MADV_POPULATE_READ);
+        if (munmap(mmapped, size) < 0)
+            g_warning("warm_populate: munmap: %s", strerror(errno));
+        if (ret == 0)
+            return (0);
+        /* EINVAL on kernels without MADV_POPULATE_READ */
+        if (errno != EINVAL) {
+            g_warning("warm_populate: madvise: %s", strerror(errno));
+            return (-1);
+        }
+    }
+#endif
+
+    if (readahead(fd, offset, length) < 0) {
+        g_warning("warm_populate: readahead: %s", strerror(errno));
+        return (-2);
+    }
+    return (0);
+}
+
+static void warm_run_failed(struct warm_run *run)
+{
+    g_mutex_lock(&run->mutex);
+    run->stats.failed++;
+    g_mutex_unlock(&run->mutex);
+}
+
+static void warm_file_unref(struct warm_file *file)
+{
+    if (!g_atomic_int_dec_and_test(&file->refs))
+        return;
+    if (close(file->fd) < 0)
+        g_warning("warm_file_unref: close: %s", strerror(errno));
+    g_free(file);
+}
+
+static void warm_chunk_worker(gpointer data, gpointer user_data)
+{
+    struct warm_chunk *chunk = (struct warm_chunk *) data;
+    struct warm_run *run = chunk->run;
+    int ret = warm_populate(chunk->file->fd, chunk->offset, chunk->length);
+
+    warm_file_unref(chunk->file);
+
+    g_mutex_lock(&run->mutex);
+    if (ret < 0)
+        run->stats.failed++;
+    run->pending--;
+    g_cond_signal(&run->cond);
+    g_mutex_unlock(&run->mutex);
+
+    g_free(chunk);
+}
+
+int warm_init(guint depth)
+{
+    GError *err = NULL;
+
+    warm_depth = depth;
+    warm_pool = g_thread_pool_new(warm_chunk_worker, NULL, depth, FALSE,
+                                  &err);
+    if (!warm_pool) {
+        g_critical("warm_init: g_thread_pool_new: %s", err->message);
+        g_error_free(err);
+        return (-1);
+    }
+    return (0);
+}
+
+struct warm_run *warm_run_new()
+{
+    struct warm_run *run = g_new0(struct warm_run, 1);
+
+    g_mutex_init(&run->mutex);
+    g_cond_init(&run->cond);
+    run->paths = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                       NULL);
+    return (run);
+}
+
+static void warm_chunk_dispatch(struct warm_run *run,
+                                struct warm_file *file, off_t offset,
+                                size_t length)
+{
+    GError *err = NULL;
+    struct warm_chunk *chunk = g_new(struct warm_chunk, 1);
+
+    chunk->run = run;
+    chunk->file = file;
+    chunk->offset = offset;
+    chunk->length = length;
+    g_atomic_int_inc(&file->refs);
+
+    g_mutex_lock(&run->mutex);
+    while (run->pending >= 2 * warm_depth)
+        g_cond_wait(&run->cond, &run->mutex);
+    run->pending++;
+    g_mutex_unlock(&run->mutex);
+
+    if (!g_thread_pool_push(warm_pool, chunk, &err)) {
+        g_critical("warm_chunk_dispatch: g_thread_pool_push: %s",
+                   err->message);
+        g_error_free(err);
+        warm_chunk_worker(chunk, NULL);
+    }
+}
+
+/* Warms [offset, offset + length), length 0 meaning up to the end */
+void warm_file(struct warm_run *run, const gchar * path, off_t offset,
+               size_t length)
+{
+    struct residency r;
+    struct stat stats;
+    struct warm_file *file;
+    off_t end, chunk;
+
+    if (!g_hash_table_contains(run->paths, path)) {
+        if (residency_file(path, &r, FALSE) == 0)
+            run->stats.before += r.resident;
+        g_hash_table_add(run->paths, g_strdup(path));
+        run->stats.files++;
+    }
+
+    file = g_new(struct warm_file, 1);
+    file->refs = 1;
+    if ((file->fd = open(path, O_RDONLY)) < 0
+        || fstat(file->fd, &stats) < 0) {
+        g_warning("warm_file: %s: %s", path, strerror(errno));
+        if (file->fd >= 0)
+            close(file->fd);
+        g_free(file);
+        warm_run_failed(run);
+        return;
+    }
+
+    end = stats.st_size;
+    if (length && offset + (off_t) length < end)
+        end = offset + length;
+
+    for (; offset < end; offset += chunk) {
+        chunk = MIN(end - offset, WARM_CHUNK);
+        run->stats.bytes += chunk;
+        warm_chunk_dispatch(run, file, offset, chunk);
+    }
+
+    warm_file_unref(file);
+}
+
+/* Warms a whole file, or every regular file under a directory */
+void warm_tree(struct warm_run *run, const gchar * path)
+{
+    struct stat stats;
+    struct dirent *ent;
+    gchar *child;
+    DIR *dir;
+
+    if (lstat(path, &stats) < 0) {
+        g_warning("warm_tree: lstat(%s): %s", path, strerror(errno));
+        warm_run_failed(run);
+        return;
+    }
+
+    if (S_ISREG(stats.st_mode)) {
+        warm_file(run, path, 0, 0);
+        return;
+    }
+
+    if (!S_ISDIR(stats.st_mode))
+        return;
+
+    if (!(dir = opendir(path))) {
+        g_warning("warm_tree: opendir(%s): %s", path, strerror(errno));
+        warm_run_failed(run);
+        return;
+    }
+
+    while ((ent = readdir(dir))) {
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+            continue;
+        child = g_build_filename(path, ent->d_name, NULL);
+        warm_tree(run, child);
+        g_free(child);
+    }
+
+    if (closedir(dir) < 0)
+        g_warning("warm_tree: closedir: %s", strerror(errno));
+}
+
+/* Waits for all chunks, then measures what is resident and frees run */
+void warm_run_finish(struct warm_run *run, struct warm_stats *stats)
+{
+    GHashTableIter iter;
+    gpointer path;
+    struct residency r;
+
+    g_mutex_lock(&run->mutex);
+    while (run->pending > 0)
+        g_cond_wait(&run->cond, &run->mutex);
+    g_mutex_unlock(&run->mutex);
+
+    g_hash_table_iter_init(&iter, run->paths);
+    while (g_hash_table_iter_next(&iter, &path, NULL))
+        if (residency_file(path, &r, FALSE) == 0)
+            run->stats.after += r.resident;
+
+    *stats = run->stats;
+
+    g_hash_table_unref(run->paths);
+    g_mutex_clear(&run->mutex);
+    g_cond_clear(&run->cond);
+    g_free(run);
+}
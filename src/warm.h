@@ -0,0 +1,26 @@
+#ifndef PCMA__WARM_H
+#define PCMA__WARM_H
+
+#include <glib.h>
+#include <sys/types.h>
+
+#define DEFAULT_WARM_DEPTH 16
+
+struct warm_stats {
+    guint64 files;
+    guint64 bytes;              /* requested */
+    guint64 before;             /* resident before warming */
+    guint64 after;              /* resident after warming */
+    guint64 failed;
+};
+
+struct warm_run;
+
+int warm_init(guint depth);
+struct warm_run *warm_run_new();
+void warm_file(struct warm_run *run, const gchar * path, off_t offset,
+               size_t length);
+void warm_tree(struct warm_run *run, const gchar * path);
+void warm_run_finish(struct warm_run *run, struct warm_stats *stats);
+
+#endif                          /* PCMA__WARM_H */
@@ -0,0 +1,279 @@
+#include <glib.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#include "common.h"
+#include "watch.h"
+
+/*
+ * Every watched path gets two inotify watches: one on the file itself,
+ * reporting writes and truncations, and one on its directory, reporting
+ * the path being deleted or replaced. Events only schedule a check of the
+ * path, at most once per delay, which coalesces bursts of writes.
+ */
+
+#define FILE_EVENTS (IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+#define DIR_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+
+struct watch {
+    int wd;
+    gchar *dir;                 /* directory watches only */
+    GHashTable *paths;          /* watched paths this watch reports on */
+};
+
+struct watched {
+    int filewd;
+    int dirwd;
+};
+
+struct due {
+    gchar *path;
+    gint64 deadline;
+};
+
+static int inotify_fd = -1;
+static gint64 delay = 0;        /* in microseconds */
+static GHashTable *watches = NULL;      /* wd -> struct watch */
+static GHashTable *watched = NULL;      /* path -> struct watched */
+static GHashTable *pending = NULL;      /* paths in due */
+static GQueue due = G_QUEUE_INIT;       /* struct due, by deadline */
+
+static void watch_free(gpointer p)
+{
+    struct watch *w = (struct watch *) p;
+
+    g_free(w->dir);
+    g_hash_table_unref(w->paths);
+    g_free(w);
+}
+
+int watch_init(guint delay_ms)
+{
+    inotify_fd = inotify_init();
+    if (inotify_fd < 0) {
+        g_critical("watch_init: inotify_init: %s", strerror(errno));
+        return (-1);
+    }
+    if (fcntl(inotify_fd, F_SETFL, O_NONBLOCK) < 0) {
+        g_critical("watch_init: fcntl: %s", strerror(errno));
+        return (-2);
+    }
+
+    delay = (gint64) delay_ms *1000;
+    watches = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                    watch_free);
+    watched = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    pending = g_hash_table_new(g_str_hash, g_str_equal);
+
+    return (0);
+}
+
+int watch_fd()
+{
+    return (inotify_fd);
+}
+
+static int watch_attach(const gchar * target, guint32 mask,
+                        const gchar * dir, const gchar * path)
+{
+    struct watch *w;
+    int wd = inotify_add_watch(inotify_fd, target, mask);
+
+    if (wd < 0) {
+        g_warning("watch_attach: inotify_add_watch(%s): %s",
+                  target, strerror(errno));
+        return (-1);
+    }
+
+    if (!(w = g_hash_table_lookup(watches, GINT_TO_POINTER(wd)))) {
+        w = g_new0(struct watch, 1);
+        w->wd = wd;
+        w->dir = g_strdup(dir);
+        w->paths = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                         NULL);
+        g_hash_table_insert(watches, GINT_TO_POINTER(wd), w);
+    }
+    g_hash_table_add(w->paths, g_strdup(path));
+
+    return (wd);
+}
+
+static void watch_detach(int wd, const gchar * path)
+{
+    struct watch *w = g_hash_table_lookup(watches, GINT_TO_POINTER(wd));
+
+    if (!w)
+        return;
+
+    g_hash_table_remove(w->paths, path);
+    if (g_hash_table_size(w->paths) > 0)
+        return;
+
+    if (inotify_rm_watch(inotify_fd, wd) < 0)
+        g_warning("watch_detach: inotify_rm_watch: %s", strerror(errno));
+    g_hash_table_remove(watches, GINT_TO_POINTER(wd));
+}
+
+void watch_add(const gchar * path)
+{
+    struct watched *w;
+    gchar *dir;
+
+    if (inotify_fd < 0 || g_hash_table_lookup(watched, path))
+        return;
+
+    w = g_new(struct watched, 1);
+    w->filewd = watch_attach(path, FILE_EVENTS, NULL, path);
+    dir = g_path_get_dirname(path);
+    w->dirwd = watch_attach(dir, DIR_EVENTS, dir, path);
+    g_free(dir);
+
+    g_hash_table_insert(watched, g_strdup(path), w);
+    g_debug("watching %s", path);
+}
+
+void watch_remove(const gchar * path)
+{
+    struct watched *w;
+
+    if (inotify_fd < 0 || !(w = g_hash_table_lookup(watched, path)))
+        return;
+
+    if (w->filewd >= 0)
+        watch_detach(w->filewd, path);
+    if (w->dirwd >= 0)
+        watch_detach(w->dirwd, path);
+
+    g_hash_table_remove(watched, path);
+    g_debug("stopped watching %s", path);
+}
+
+void watch_schedule(const gchar * path)
+{
+    struct due *d;
+
+    if (g_hash_table_contains(pending, path))
+        return;
+
+    d = g_new(struct due, 1);
+    d->path = g_strdup(path);
+    d->deadline = g_get_monotonic_time() + delay;
+    g_queue_push_tail(&due, d);
+    g_hash_table_add(pending, d->path);
+}
+
+static void watch_schedule_all()
+{
+    GHashTableIter iter;
+    gpointer path;
+
+    g_hash_table_iter_init(&iter, watched);
+    while (g_hash_table_iter_next(&iter, &path, NULL))
+        watch_schedule(path);
+}
+
+/* The kernel dropped a watch, paths it reported on lose it */
+static void watch_forget(struct watch *w)
+{
+    GHashTableIter iter;
+    gpointer path;
+    struct watched *entry;
+
+    g_hash_table_iter_init(&iter, w->paths);
+    while (g_hash_table_iter_next(&iter, &path, NULL)) {
+        if (!(entry = g_hash_table_lookup(watched, path)))
+            continue;
+        if (entry->filewd == w->wd)
+            entry->filewd = -1;
+        if (entry->dirwd == w->wd)
+            entry->dirwd = -1;
+        /* The file was probably deleted or replaced */
+        watch_schedule(path);
+    }
+    g_hash_table_remove(watches, GINT_TO_POINTER(w->wd));
+}
+
+static void watch_handle_event(struct inotify_event *ev)
+{
+    struct watch *w;
+    GHashTableIter iter;
+    gpointer path;
+    gchar *child;
+
+    if (ev->mask & IN_Q_OVERFLOW) {
+        g_warning("inotify queue overflow, checking all files");
+        watch_schedule_all();
+        return;
+    }
+
+    if (!(w = g_hash_table_lookup(watches, GINT_TO_POINTER(ev->wd))))
+        return;
+
+    if (ev->mask & IN_IGNORED) {
+        watch_forget(w);
+        return;
+    }
+
+    if (w->dir) {
+        if (!ev->len)
+            return;
+        child = g_build_filename(w->dir, ev->name, NULL);
+        if (g_hash_table_contains(w->paths, child))
+            watch_schedule(child);
+        g_free(child);
+    } else {
+        g_hash_table_iter_init(&iter, w->paths);
+        while (g_hash_table_iter_next(&iter, &path, NULL))
+            watch_schedule(path);
+    }
+}
+
+void watch_handle_events()
+{
+    char buf[4096]
+        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    ssize_t len;
+    char *ptr;
+
+    while ((len = read(inotify_fd, buf, sizeof(buf))) > 0) {
+        for (ptr = buf; ptr < buf + len;
+             ptr += sizeof(struct inotify_event) + ev->len) {
+            ev = (struct inotify_event *) ptr;
+            watch_handle_event(ev);
+        }
+    }
+
+    if (len < 0 && errno != EAGAIN && errno != EINTR)
+        g_critical("watch_handle_events: read: %s", strerror(errno));
+}
+
+/* Microseconds until the next check is due, -1 if none is */
+glong watch_timeout()
+{
+    struct due *d = g_queue_peek_head(&due);
+    gint64 left;
+
+    if (!d)
+        return (-1);
+
+    left = d->deadline - g_get_monotonic_time();
+    return (left > 0 ? left : 0);
+}
+
+/* Returns the next path due for a check, to be freed by the caller */
+gchar *watch_pop_expired()
+{
+    struct due *d = g_queue_peek_head(&due);
+    gchar *path;
+
+    if (!d || d->deadline > g_get_monotonic_time())
+        return (NULL);
+
+    g_queue_pop_head(&due);
+    g_hash_table_remove(pending, d->path);
+    path = d->path;
+    g_free(d);
+    return (path);
+}
@@ -0,0 +1,15 @@
+#ifndef PCMA__WATCH_H
+#define PCMA__WATCH_H
+
+#include <glib.h>
+
+int watch_init(guint delay);
+int watch_fd();
+void watch_add(const gchar * path);
+void watch_remove(const gchar * path);
+void watch_schedule(const gchar * path);
+void watch_handle_events();
+glong watch_timeout();
+gchar *watch_pop_expired();
+
+#endif                          /* PCMA__WATCH_H */
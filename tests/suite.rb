@@ -1,16 +1,36 @@
 #!/usr/bin/env ruby
 
 begin; require 'rubygems'; rescue; end
-%w[zmq msgpack].each {|m| require m}
+%w[zmq msgpack fileutils].each {|m| require m}
+
+ENDPOINT = "ipc:///var/run/pcma.socket"
 
 $ctx = ZMQ::Context.new(1)
 $sock = $ctx.socket(ZMQ::REQ)
-$sock.connect("ipc:///var/run/pcma.socket")
+$sock.connect(ENDPOINT)
+
+def answer sock, f
+  r, v = MessagePack.unpack sock.recv
+  puts "#{r and 'B)' or ':('} #{f.inspect} => #{v.inspect}"
+end
 
 def run f
   $sock.send MessagePack.pack f
-  r, v = MessagePack.unpack $sock.recv
-  puts "#{r and 'B)' or ':('} #{f.inspect} => #{v.inspect}"
+  answer $sock, f
+end
+
+# Sends f on a socket of its own, for finish to print the reply later
+def start f
+  sock = $ctx.socket(ZMQ::REQ)
+  sock.connect(ENDPOINT)
+  sock.send MessagePack.pack f
+  [sock, f]
+end
+
+def finish pending
+  sock, f = pending
+  answer sock, f
+  sock.close
 end
 
 puts "=== STUFF THAT FAILS ==="
@@ -40,5 +60,232 @@ run %w[unlock /bin/cat]
 run %w[list]
 run %w[unlock /bin/cat]
 
+puts "=== RANGES ==="
+File.open('/tmp/pcma-ranges', 'w') {|f| f.write 'x' * 65536}
+run ['lock', '/tmp/pcma-ranges', [], [[0, 4096], [32768, 0]]]
+run %w[list]
+run ['unlock', '/tmp/pcma-ranges', [0, 4096]]
+puts "--- range not found ---"
+run ['unlock', '/tmp/pcma-ranges', [0, 4096]]
+run ['unlock', '/tmp/pcma-ranges', [4096, 4096]]
+run ['unlock', '/tmp/pcma-ranges', [32768, 0]]
+puts "--- unlocked with its last range ---"
+run ['unlock', '/tmp/pcma-ranges']
+# A sparse file is not cached, so locking it at 4 MiB/s takes seconds
+File.open('/tmp/pcma-slow', 'w') {|f| f.truncate 24 << 20}
+slow = start ['lock', '/tmp/pcma-slow', [], [[0, 0]], {'rate' => 4 << 20}]
+sleep 0.5
+puts "--- lock in progress ---"
+run ['unlock', '/tmp/pcma-slow', [0, 0]]
+run ['unlock', '/tmp/pcma-slow']
+puts "--- unlocked while locking ---"
+finish slow
+
+puts "=== GROWTH ==="
+File.write '/tmp/pcma-grow', 'g' * 6000
+run ['lock', '/tmp/pcma-grow']
+File.write '/tmp/pcma-grow-tail', 't' * 6000
+run ['lock', '/tmp/pcma-grow-tail', [], [[4096, 0]]]
+puts "--- grown within the last page ---"
+File.open('/tmp/pcma-grow', 'a') {|f| f.write 'g' * 1000}
+run %w[lock /tmp/pcma-grow]
+run %w[list]
+puts "--- grown by many pages, regions extended in place ---"
+File.open('/tmp/pcma-grow', 'a') {|f| f.write 'g' * (1 << 20)}
+File.open('/tmp/pcma-grow-tail', 'a') {|f| f.write 't' * (1 << 20)}
+run %w[lock /tmp/pcma-grow]
+run ['lock', '/tmp/pcma-grow-tail', [], [[4096, 0]]]
+run %w[list]
+run %w[residency /tmp/pcma-grow]
+puts "--- shrunk ---"
+File.truncate '/tmp/pcma-grow', 4096
+run %w[lock /tmp/pcma-grow]
+run %w[list]
+run %w[unlock /tmp/pcma-grow]
+run %w[unlock /tmp/pcma-grow-tail]
+
+puts "=== LOCKDIR ==="
+FileUtils.mkdir_p '/tmp/pcma-dir/tmp'
+%w[a.idx b.dat tmp/c.idx].each {|f| File.write "/tmp/pcma-dir/#{f}", f}
+puts "--- only /tmp/pcma-dir/a.idx ---"
+run ['lockdir', '/tmp/pcma-dir', ['dir'], ['*.idx'], ['tmp/*']]
+run %w[list]
+run %w[releasetag dir]
+puts "--- all three files ---"
+run ['lockdir', '/tmp/pcma-dir', ['dir']]
+run %w[releasetag dir]
+run %w[lockdir /tmp/pcma-nodir]
+
+puts "=== RESIDENCY ==="
+run %w[residency /bin/cat]
+run ['lock', '/bin/cat', ['res']]
+run ['lock', '/bin/echo', ['res']]
+run %w[residency /bin/cat]
+run ['residency', ['res']]
+run ['residency', ['nothing']]
+run %w[releasetag res]
+run %w[residency /bin/dog]
+
+puts "=== WARM ==="
+run %w[warm /bin/cat]
+run ['warm', '/bin/cat', [[0, 4096], [8192, 0]]]
+run %w[warm /tmp/pcma-dir]
+run %w[list]
+run %w[warm /bin/dog]
+
+puts "=== LOCKMANY ==="
+run ['lockmany', ['/bin/cat', ['/bin/echo', ['many']],
+                  ['/tmp/pcma-ranges', [], [[0, 4096]]], '/bin/dog']]
+run %w[list]
+run ['unlockmany', ['/bin/cat', '/bin/echo', ['/tmp/pcma-ranges', [0, 4096]],
+                    '/bin/dog']]
+run %w[list]
+run ['lockmany', []]
+run ['lockmany', '/bin/cat']
+
+puts "=== LIST PAGES ==="
+run ['lock', '/bin/cat', ['page']]
+run ['lock', '/bin/echo', ['page']]
+run ['lock', '/bin/ls']
+puts "--- one file per page ---"
+run ['list', {'limit' => 1}]
+run ['list', {'limit' => 1, 'cursor' => '/bin/cat'}]
+run ['list', {'limit' => 1, 'cursor' => '/bin/echo'}]
+puts "--- filtered ---"
+run ['list', {'tag' => 'page'}]
+run ['list', {'prefix' => '/bin/e'}]
+run ['list', {'prefix' => '/usr/'}]
+run ['list', {'limit' => 'one'}]
+run ['list', {'sort' => 'size'}]
+run %w[releasetag page]
+run %w[unlock /bin/ls]
+
+puts "=== STATS ==="
+run %w[stats]
+run ['lock', '/bin/cat', ['stats']]
+run %w[stats]
+run %w[releasetag stats]
+
+puts "=== HARD LINKS ==="
+File.write '/tmp/pcma-link-a', 'a' * 8192
+File.link '/tmp/pcma-link-a', '/tmp/pcma-link-b'
+File.link '/tmp/pcma-link-a', '/tmp/pcma-link-c'
+run ['lock', '/tmp/pcma-link-a', ['link']]
+puts "--- /tmp/pcma-link-b and c are aliases of /tmp/pcma-link-a ---"
+run ['lock', '/tmp/pcma-link-b', ['alias']]
+run ['lock', '/tmp/pcma-link-c']
+run %w[list]
+puts "--- /tmp/pcma-link-b takes over ---"
+run %w[unlock /tmp/pcma-link-a]
+run %w[list]
+puts "=== REFRESH ==="
+run %w[refresh]
+File.open('/tmp/pcma-link-b', 'a') {|f| f.write 'b' * 8192}
+File.write '/tmp/pcma-link-new', 'c' * 4096
+File.rename '/tmp/pcma-link-new', '/tmp/pcma-link-c'
+puts "--- /tmp/pcma-link-c replaced, /tmp/pcma-link-b resized ---"
+run %w[refresh]
+sleep 0.5
+run %w[list]
+File.delete '/tmp/pcma-link-c'
+puts "--- /tmp/pcma-link-c vanished ---"
+run %w[refresh]
+run %w[list]
+run %w[releasetag link]
+run %w[releasetag alias]
+
+puts "=== ADVISE ==="
+# Fails unless pcmad samples directories, see -A
+run %w[advise]
+run ['advise', 4]
+run ['advise', 'four']
+
+puts "=== STRATEGIES ==="
+%w[mlock onfault maplocked populate].each do |strategy|
+  run ['lock', '/tmp/pcma-ranges', [], [], {'strategy' => strategy}]
+  run ['residency', '/tmp/pcma-ranges']
+end
+run ['lock', '/tmp/pcma-ranges', [], [[0, 4096]], {'strategy' => 'onfault'}]
+run %w[list]
+puts "--- unknown strategy ---"
+run ['lock', '/tmp/pcma-ranges', [], [], {'strategy' => 'mmap'}]
+run ['lock', '/tmp/pcma-ranges', [], [], {'strategy' => 1}]
+run %w[unlock /tmp/pcma-ranges]
+
+# Needs pcmad -S 100/1000/2000 -T keep=1, whose pid is in PCMAD_PID
+if ENV['PCMAD_PID']
+  puts "=== SHEDDING ==="
+  run ['lock', '/bin/cat', ['keep']]
+  run ['lock', '/bin/echo', ['spare']]
+  run ['lock', '/bin/ls', ['spare', 'other']]
+  Process.kill 'USR2', ENV['PCMAD_PID'].to_i
+  sleep 0.5
+  puts "--- only /bin/cat is left ---"
+  run %w[list]
+  run %w[unlock /bin/echo]
+  run %w[unlock /bin/echo]
+  run %w[releasetag other]
+  sleep 3
+  puts "--- /bin/ls is back, /bin/echo is not ---"
+  run %w[list]
+  run %w[unlock /bin/ls]
+  run %w[unlock /bin/cat]
+end
+
+# Needs pcmad -s, whose pid is in PCMAD_PID, and a command starting it
+# again with the same options in PCMAD_START
+if ENV['PCMAD_PID'] && ENV['PCMAD_START']
+  puts "=== RESTORE ==="
+  File.write '/tmp/pcma-kept', 'k' * 65536
+  File.write '/tmp/pcma-replaced', 'r' * 8192
+  run ['lock', '/tmp/pcma-kept', ['saved'], [[0, 4096], [32768, 0]]]
+  run ['lock', '/tmp/pcma-replaced', ['saved', 'other']]
+  # The state is saved on termination
+  pid = ENV['PCMAD_PID'].to_i
+  Process.kill 'TERM', pid
+  begin
+    loop { Process.kill 0, pid; sleep 0.1 }
+  rescue Errno::ESRCH
+  end
+  File.write '/tmp/pcma-new', 'n' * 4096
+  File.rename '/tmp/pcma-new', '/tmp/pcma-replaced'
+  system ENV['PCMAD_START']
+  sleep 1
+  puts "--- both are back with their ranges and tags, the new file locked ---"
+  run %w[list]
+  puts "--- restore: 2 total, 2 done, 1 replaced ---"
+  run %w[stats]
+  run %w[releasetag saved]
+end
+
+# Needs pcmad -P with the endpoint in PCMAD_PUB
+if ENV['PCMAD_PUB']
+  puts "=== EVENTS ==="
+  sub = $ctx.socket(ZMQ::SUB)
+  sub.setsockopt(ZMQ::SUBSCRIBE, 'ev')
+  sub.connect(ENV['PCMAD_PUB'])
+  sleep 0.5
+  File.write '/tmp/pcma-events', 'e' * 8192
+  run ['lock', '/tmp/pcma-events', ['ev1', 'ev2']]
+  run ['lock', '/bin/cat', ['other']]
+  run ['lock', '/tmp/pcma-events']
+  run ['lock', '/bin/dog', ['ev1']]
+  run %w[releasetag ev1]
+  run %w[releasetag ev2]
+  run %w[releasetag other]
+  sleep 0.5
+  puts "--- lock, relock, fail, releasetag and unlock under ev1 and ev2 ---"
+  last = {}
+  while tag = sub.recv(ZMQ::NOBLOCK)
+    event = MessagePack.unpack sub.recv
+    # Sequences run per tag, without gaps
+    ok = !last[tag] || event[0] == last[tag] + 1
+    last[tag] = event[0]
+    puts "#{ok and 'B)' or ':('} #{tag.inspect} => #{event.inspect}"
+  end
+  sub.close
+end
+
+FileUtils.rm_rf Dir['/tmp/pcma-*']
 $sock.close
 $ctx.close